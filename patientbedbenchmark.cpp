@@ -0,0 +1,202 @@
+/*
+MIT License
+
+Copyright (c) 2025 Rohit Nair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Microbenchmarks for the simulator hot path. Reports ns/op and heap allocations/op.
+// Build alongside the simulator (see .vscode/tasks.json); pass a substring to run matching benchmarks only,
+// or --check-allocations to fail (exit 1) if serializing a sample allocates in steady state.
+
+#define PATIENTBED_NO_MAIN
+#include "patientbedsimulation.cpp"
+
+#include <new>
+
+// --- Benchmark Parameters ---
+const double BENCHMARK_MIN_SECONDS = 0.2; // Per benchmark, after calibration
+const uint64_t BENCHMARK_CALIBRATION_OPS = 1000;
+const uint64_t ALLOCATION_CHECK_WARMUP_SAMPLES = 1000;
+const uint64_t ALLOCATION_CHECK_SAMPLES = 100000;
+
+// Every heap allocation in the process is counted; benchmarks run on the main thread only.
+// The replacements are not inlined: GCC would otherwise pair malloc/free with new/delete and warn.
+static std::atomic<uint64_t> allocationCount{0};
+
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+/**
+ * @brief Keep a value alive so the optimizer cannot drop the work that produced it.
+ */
+template <typename T>
+inline void doNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * @brief Run one benchmark: calibrate, time at least BENCHMARK_MIN_SECONDS and print ns/op and allocs/op.
+ * @param filter Only run when the name contains this substring (empty = all).
+ * @param name Benchmark name.
+ * @param op One operation; called repeatedly.
+ */
+template <typename Op>
+void runBenchmark(const std::string& filter, const std::string& name, Op op) {
+    if (!filter.empty() && name.find(filter) == std::string::npos) return;
+
+    auto timeOps = [&op](uint64_t ops) {
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < ops; ++i) op();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double calibration = timeOps(BENCHMARK_CALIBRATION_OPS); // Also warms caches and lazy statics
+    uint64_t ops = static_cast<uint64_t>(BENCHMARK_CALIBRATION_OPS * BENCHMARK_MIN_SECONDS / std::max(calibration, 1e-9));
+    ops = std::max<uint64_t>(ops, BENCHMARK_CALIBRATION_OPS);
+
+    uint64_t allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+    double seconds = timeOps(ops);
+    uint64_t allocations = allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+
+    std::cout << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << seconds * 1e9 / ops << " ns/op" << std::setprecision(2)
+              << std::setw(10) << static_cast<double>(allocations) / ops << " allocs/op" << std::endl;
+}
+
+/**
+ * @brief Check that serializing samples performs no heap allocations once the writer is warm.
+ * Timestamps advance and vitals vary per sample, so every digit width and state is formatted.
+ * @return true if the measured samples allocated nothing.
+ */
+bool checkSampleAllocations() {
+    const std::string deviceId("PatientBed1");
+    TelemetryWriter writer;
+    char timestampBuffer[TIMESTAMP_BUFFER_BYTES];
+    auto time = std::chrono::system_clock::now();
+    auto serialize = [&](uint64_t i) {
+        time += std::chrono::milliseconds(DATA_SEND_INTERVAL_SECONDS * 1000 + static_cast<int64_t>(i % 1000));
+        BedInclinationState state = i % 7 == 0 ? BedInclinationState::INCLINED : BedInclinationState::FLAT;
+        TelemetrySample sample{deviceId, time, 40.0 + static_cast<double>(i % 90), 90.0 + static_cast<double>(i % 100) / 10.0,
+                               state == BedInclinationState::FLAT ? 0.0 : MEAL_INCLINATION_DEGREES, state};
+        sample.includeState = i % 3 == 0;
+        doNotOptimize(writer.write(sample));
+        doNotOptimize(formatTimestampLocal(time, timestampBuffer, sizeof(timestampBuffer)));
+    };
+    for (uint64_t i = 0; i < ALLOCATION_CHECK_WARMUP_SAMPLES; ++i) serialize(i); // Grows the buffer, loads the time zone
+
+    uint64_t allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+    for (uint64_t i = 0; i < ALLOCATION_CHECK_SAMPLES; ++i) serialize(i);
+    uint64_t allocations = allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+
+    std::cout << "TelemetryWriter::write + formatTimestampLocal: " << allocations << " allocations in " << ALLOCATION_CHECK_SAMPLES
+              << " samples" << (allocations == 0 ? " (ok)" : " (FAILED: expected none)") << std::endl;
+    return allocations == 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter = argc > 1 ? argv[1] : "";
+    if (filter == "--check-allocations") {
+        return checkSampleAllocations() ? 0 : 1;
+    }
+    std::cout << std::left << std::setw(36) << "benchmark" << std::right << std::setw(18) << "time" << std::setw(20) << "allocations" << std::endl;
+
+    const std::string deviceId("PatientBed1");
+    const auto wallNow = std::chrono::system_clock::now();
+
+    runBenchmark(filter, "Telemetry+toJson", [&] {
+        Telemetry telemetry(deviceId, 72.4, 97.8, 0.0, BedInclinationState::FLAT);
+        std::string payload = telemetry.toJson();
+        doNotOptimize(payload);
+    });
+
+    TelemetryWriter writer;
+    TelemetrySample sample{deviceId, wallNow, 72.4, 97.8, 0.0, BedInclinationState::FLAT};
+    runBenchmark(filter, "TelemetryWriter::write", [&] {
+        std::string_view payload = writer.write(sample);
+        doNotOptimize(payload);
+    });
+
+    runBenchmark(filter, "getCurrentTimestampLocal", [] {
+        std::string timestamp = getCurrentTimestampLocal();
+        doNotOptimize(timestamp);
+    });
+
+    char timestampBuffer[TIMESTAMP_BUFFER_BYTES];
+    runBenchmark(filter, "formatTimestampLocal", [&] {
+        size_t length = formatTimestampLocal(std::chrono::system_clock::now(), timestampBuffer, sizeof(timestampBuffer));
+        doNotOptimize(length);
+    });
+
+    // Advance simulated time by one sample interval per step so every state transition is exercised
+    auto steadyNow = std::chrono::steady_clock::now();
+    BedSimulator simulator(mixSeed(1, 1), steadyNow);
+    runBenchmark(filter, "BedSimulator::step", [&] {
+        steadyNow += std::chrono::seconds(DATA_SEND_INTERVAL_SECONDS);
+        BedTransition transition = simulator.step(steadyNow, false);
+        doNotOptimize(transition);
+    });
+
+    std::string topic = TOPIC_PREFIX + std::string("1/data");
+    mqtt::string_ref topicRef(topic);
+    std::string_view payload = writer.write(sample);
+    runBenchmark(filter, "mqtt::make_message", [&] {
+        mqtt::message_ptr message = mqtt::make_message(topicRef, payload.data(), payload.size(), QOS, false);
+        doNotOptimize(message);
+    });
+
+    std::vector<uint32_t> keys(1024);
+    std::vector<uint32_t> counters(keys.size(), 0);
+    std::vector<double> heartRate(keys.size());
+    std::vector<double> spo2(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) keys[i] = mixSeed(1, i);
+    runBenchmark(filter, "fillVitals (1024 beds)", [&] {
+        for (uint32_t& counter : counters) ++counter;
+        fillVitals(keys.data(), counters.data(), keys.size(), heartRate.data(), spo2.data());
+        doNotOptimize(heartRate.data());
+    });
+
+    WaveformWriter waveformWriter;
+    WaveformState waveformState;
+    runBenchmark(filter, "WaveformWriter::write (1 s frame)", [&] {
+        std::string_view frame = waveformWriter.write(waveformState, 1, wallNow, 72.0);
+        doNotOptimize(frame);
+    });
+
+    return 0;
+}
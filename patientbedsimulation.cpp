@@ -32,6 +32,39 @@ SOFTWARE.
 #include <thread>
 #include <iomanip>
 #include <sstream>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <algorithm>
+#include <ctime>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string_view>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cctype>
+#include <functional>
+#include <optional>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <zlib.h>
 #include "mqtt/async_client.h" // Paho MQTT C++
 #include <nlohmann/json.hpp> // For JSON manipulation
 
@@ -39,17 +72,114 @@ SOFTWARE.
 const std::string SERVER_ADDRESS("ssl://a22bv8r2s2kek2-ats.iot.eu-north-1.amazonaws.com:8883"); // Your AWS IoT Endpoint
 const std::string CLIENT_ID_PREFIX("PatientBed");
 const std::string TOPIC_PREFIX("PatientBed/");
-const int QOS = 1;
+const std::string GATEWAY_CLIENT_ID_PREFIX("PatientBedGateway");
+const int QOS = 1; // Default for the data and state streams; see --qos
 const long TIMEOUT = 10000L; // Milliseconds
+const int MAX_INFLIGHT_LIMIT = 65535; // Paho's upper bound for unacknowledged messages
 
 // --- Certificate Paths ---
 const std::string CA_CERT_PATH("./certs/AmazonRootCA1.pem");
 const std::string CLIENT_CERT_PATH_PREFIX("./certs/device_");
 const std::string CLIENT_KEY_PATH_PREFIX("./certs/device_");
+const std::string GATEWAY_CERT_PATH_PREFIX("./certs/gateway_");
+const std::string CERT_BUNDLE_SECTION_PREFIX("# "); // --cert-bundle: "# device <n>" or "# gateway <n>" starts a section
 
 // --- Simulation Parameters ---
 const int DATA_SEND_INTERVAL_SECONDS = 5;
 
+// --- Fleet Parameters ---
+const int MAX_FLEET_BEDS = 100000;
+const int DEFAULT_MAX_WORKER_THREADS = 8;
+const double DEFAULT_CONNECT_RATE = 100.0;        // Connects/s at startup; AWS IoT allows 500/s per account
+const int DEFAULT_CONNECT_CONCURRENCY = 64;       // TLS handshakes in flight at startup
+const int CONNECT_BURST = 10;                     // Connects the rate limiter lets through back-to-back
+const int CONNECT_TIMEOUT_SECONDS = 30;
+const int CONNECT_PROGRESS_SECONDS = 5;
+const double DEFAULT_CONNECTION_PUBLISH_RATE = 100.0; // Publishes/s per connection: AWS IoT's per-connection limit
+const double PUBLISH_BURST_SECONDS = 1.0;          // Publish bucket depth, in seconds at the configured rate
+const size_t MAX_HELD_BATCHES = 4;                 // A throttled batch grows to at most this many batches of samples
+const size_t BED_SIMULATOR_TARGET_BYTES = 24; // Inclination state machine per bed, excluding its MQTT connection
+const size_t TELEMETRY_BUFFER_BYTES = 512;    // Initial per-worker serializer buffer
+const size_t TIMESTAMP_BUFFER_BYTES = 40;
+const int DEFAULT_STATE_HEARTBEAT_SECONDS = 300; // Re-send inclination/bedState at least this often in on-change mode
+const int DEFAULT_SPOOL_RECORDS_PER_BED = 720;    // One hour of samples per bed while disconnected
+const int DEFAULT_REPLAY_BURST = 10;              // Buffered samples replayed per bed per tick after reconnecting
+const int SPOOL_CHECKPOINT_SECONDS = 10;
+const int SCHEDULER_TICK_MS = 10;                 // Timer wheel resolution
+const int TIMER_WHEEL_SLOT_BITS = 8;              // 256 slots per level
+const int TIMER_WHEEL_LEVELS = 4;                 // 10 ms x 2^32 ticks: far beyond any bed deadline
+const uint64_t VITALS_STREAM_SEED = 0x564954414C53ull; // Separates vitals keys from state machine seeds
+const uint64_t PHASE_SPREAD_SEED = 0x5048415345ull;  // Fixed so bed phases are identical across runs and hosts
+const int PUBLISH_RATE_BIN_MS = 100;
+const int PUBLISH_RATE_REPORT_SECONDS = 60;
+const size_t MAX_QUEUED_BATCHES = 64;             // Per worker; the scheduler waits when a worker falls this far behind
+const int MAX_BATCH_SIZE = 500;               // Keeps batched payloads under AWS IoT's 128 KB message limit
+const char DEFAULT_AGGREGATE_WINDOWS[] = "60,300"; // --aggregate-only without --aggregate: 1 and 5 minute summaries
+const size_t MAX_AGGREGATE_WINDOWS = 4;
+const long MAX_AGGREGATE_WINDOW_SECONDS = 86400;
+
+// --- Waveform Parameters ---
+const int WAVEFORM_QOS = 0;                   // Default: high-rate frames are fire-and-forget
+const int WAVEFORM_FRAME_SECONDS = 1;
+const int ECG_SAMPLE_RATE_HZ = 250;
+const int PLETH_SAMPLE_RATE_HZ = 100;
+const int ECG_SAMPLES_PER_FRAME = ECG_SAMPLE_RATE_HZ * WAVEFORM_FRAME_SECONDS;
+const int PLETH_SAMPLES_PER_FRAME = PLETH_SAMPLE_RATE_HZ * WAVEFORM_FRAME_SECONDS;
+const int WAVEFORM_TEMPLATE_BITS = 10;        // 1024 template entries per beat
+const int WAVEFORM_TEMPLATE_SAMPLES = 1 << WAVEFORM_TEMPLATE_BITS;
+const double ECG_MICROVOLTS_PER_COUNT = 5.0;
+const double PLETH_FULL_SCALE_COUNTS = 4000.0;
+const char WAVEFORM_FRAME_MAGIC[] = "PBWF";
+const int WAVEFORM_FRAME_VERSION = 1;
+const float WAVEFORM_INITIAL_HEART_RATE = 70.0f; // Until the bed's first vitals sample
+const size_t WAVEFORM_HEADER_BYTES = 32;
+
+// --- Metrics ---
+const size_t METRIC_HISTOGRAM_BUCKETS = 24; // le 1 us, 2 us, ... 4.2 s, +Inf
+
+// --- Load Test ---
+const int DEFAULT_LOAD_STEP_SECONDS = 60;
+const int DEFAULT_LOAD_TEST_INFLIGHT = 100;        // Per bed when --max-inflight is not given
+const int LOAD_TEST_HISTOGRAM_SUB_BUCKET_BITS = 7; // 128 sub-buckets per power of two: <1% error
+const int LOAD_TEST_DRAIN_POLL_MS = 10;
+
+// --- MQTT v5 ---
+const int DEFAULT_MESSAGE_EXPIRY_SECONDS = 60; // A sample nobody received within a minute has been superseded; 0 = never expire
+const int MAX_PUBLISH_RETRIES = 3;             // Per message, for retryable PUBACK reason codes
+const char WAVEFORM_CONTENT_TYPE[] = "application/octet-stream";
+
+// --- InfluxDB Sink ---
+const char INFLUX_MEASUREMENT[] = "mqtt_consumer"; // Telegraf's MQTT consumer measurement: the Grafana queries keep working
+const int DEFAULT_INFLUX_PORT = 8086;
+const size_t DEFAULT_INFLUX_BATCH_LINES = 5000;    // InfluxDB's recommended write size
+const int DEFAULT_INFLUX_FLUSH_MS = 1000;
+const size_t INFLUX_MAX_PENDING_BATCHES = 10;      // Lines are dropped (and counted) beyond this many unsent batches
+const size_t INFLUX_LINE_BYTES = 128;              // Typical line, for reserving buffers
+const int INFLUX_GZIP_LEVEL = 1;                   // Fastest level: still ~4x on line protocol
+const int INFLUX_TIMEOUT_SECONDS = 10;
+const int INFLUX_MAX_ATTEMPTS = 3;                 // Per batch, for connection failures, 429 and 503
+
+// --- Command Channel ---
+const double MAX_COMMAND_INCLINATION_DEGREES = 80.0; // Commands outside [0, this] are rejected
+const double DRIVER_COMMAND_INCLINATION_DEGREES = 45.0; // --command-rate alternates beds between this and FLAT
+const char GATEWAY_COMMAND_TOPIC[] = "PatientBed/+/cmd"; // A gateway subscribes once for all its beds
+
+// --- Telemetry Trace ---
+const size_t TRACE_BLOCK_RECORDS = 4096; // Records per columnar block of a --record trace (100 KB per block)
+
+// --- Distributed Load ---
+const int COORDINATOR_START_LEAD_MS = 2000;           // START names an epoch this far ahead so every agent receives it in time
+const int COORDINATOR_REPORT_SECONDS = 10;            // Agents send a metrics snapshot this often
+const int COORDINATOR_HANDSHAKE_TIMEOUT_SECONDS = 10; // For HELLO after an agent connects
+const size_t COORDINATOR_MAX_REPORT_BYTES = 16 << 20;
+
+// --- Logging ---
+const size_t LOG_QUEUE_CAPACITY = 8192;        // Lines; must be a power of two. Lines are dropped (and counted) beyond this
+const size_t LOG_MESSAGE_BYTES = 232;          // Longer lines are truncated; keeps a queue slot at 256 bytes
+const int LOG_WRITER_IDLE_MS = 5;              // Writer poll interval when nothing is queued
+const int LOG_RATE_LIMIT_LINES = 5;            // Per rate-limited call site per window
+const int LOG_RATE_LIMIT_WINDOW_SECONDS = 10;
+
 // --- Inclination Parameters ---
 const double MEAL_INCLINATION_DEGREES = 60.0;
 const int MEAL_INCLINATION_DURATION_MINUTES = 30;
@@ -67,36 +197,647 @@ const std::vector<std::pair<int, int>> meal_start_times = {{8, 0}, {12, 0}, {18,
 using json = nlohmann::json;
 
 // Bed State
-enum class BedInclinationState {
+enum class BedInclinationState : uint8_t {
     FLAT,
     INCLINED
 };
 
+// Payload Encoding
+enum class PayloadEncoding {
+    JSON,        // Compact JSON (default)
+    JSON_PRETTY, // JSON indented by 4 spaces, as originally published
+    CBOR,
+    MSGPACK
+};
+
+// What happens to a sample when a publish-rate bucket is empty
+enum class ThrottlePolicy {
+    COALESCE, // Hold the newest sample per bed and send it once a token is available (default)
+    DROP      // Drop it
+};
+
+/**
+ * @brief Name of an encoding as accepted by --encoding.
+ * @param encoding Payload encoding.
+ * @return const char* Encoding name.
+ */
+const char* encodingName(PayloadEncoding encoding) {
+    switch (encoding) {
+    case PayloadEncoding::JSON: return "json";
+    case PayloadEncoding::JSON_PRETTY: return "json-pretty";
+    case PayloadEncoding::CBOR: return "cbor";
+    case PayloadEncoding::MSGPACK: return "msgpack";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief MIME type of an encoding, sent as the MQTT v5 content-type property.
+ * @param encoding Payload encoding.
+ * @return const char* Content type.
+ */
+const char* contentType(PayloadEncoding encoding) {
+    switch (encoding) {
+    case PayloadEncoding::JSON:
+    case PayloadEncoding::JSON_PRETTY: return "application/json";
+    case PayloadEncoding::CBOR: return "application/cbor";
+    case PayloadEncoding::MSGPACK: return "application/msgpack";
+    }
+    return "application/octet-stream";
+}
+
+// Telemetry Stream: one topic and QoS per kind of message
+enum class TelemetryStream : uint8_t {
+    DATA,     // PatientBed/<n>/data: vitals and state in one document (default layout)
+    VITALS,   // PatientBed/<n>/vitals with --split-streams
+    STATE,    // PatientBed/<n>/state with --split-streams: transitions and heartbeats
+    WAVEFORM, // PatientBed/<n>/waveform with --waveform
+    SUMMARY,  // PatientBed/<n>/summary with --aggregate: windowed vitals summaries
+    ACK       // PatientBed/<n>/cmd/ack with --commands: one per command received on PatientBed/<n>/cmd
+};
+const size_t TELEMETRY_STREAM_COUNT = 6;
+const int VITALS_QOS = 0; // Default: a lost sample is replaced by the next one
+const int SUMMARY_QOS = 1; // Default: a summary stands for a whole window of samples
+const int ACK_QOS = 1;     // Default: a lost ack looks like a lost command to the sender
+
+/**
+ * @brief Name of a stream as used in its topic and by --qos.
+ * @param stream Telemetry stream.
+ * @return const char* Stream name.
+ */
+const char* streamName(TelemetryStream stream) {
+    switch (stream) {
+    case TelemetryStream::DATA: return "data";
+    case TelemetryStream::VITALS: return "vitals";
+    case TelemetryStream::STATE: return "state";
+    case TelemetryStream::WAVEFORM: return "waveform";
+    case TelemetryStream::SUMMARY: return "summary";
+    case TelemetryStream::ACK: return "ack";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Parse a --qos value such as "vitals=0,state=1" into per-stream QoS levels.
+ * @param text Comma-separated stream=qos pairs; QoS 0 or 1 (AWS IoT does not support QoS 2).
+ * @param qos Per-stream QoS, indexed by TelemetryStream; updated for each listed stream.
+ * @return true if every pair names a stream and a valid QoS.
+ */
+bool parseStreamQos(const std::string& text, std::array<int, TELEMETRY_STREAM_COUNT>& qos) {
+    std::stringstream list(text);
+    std::string item;
+    bool any = false;
+    while (std::getline(list, item, ',')) {
+        size_t equals = item.find('=');
+        if (equals == std::string::npos) return false;
+        std::string name = item.substr(0, equals);
+        std::string level = item.substr(equals + 1);
+        if (level != "0" && level != "1") return false;
+        bool known = false;
+        for (size_t i = 0; i < TELEMETRY_STREAM_COUNT; ++i) {
+            if (name == streamName(static_cast<TelemetryStream>(i))) {
+                qos[i] = level[0] - '0';
+                known = true;
+            }
+        }
+        if (!known) return false;
+        any = true;
+    }
+    return any;
+}
+
+/**
+ * @brief Parse an --encoding value.
+ * @param text Encoding name.
+ * @param encoding Receives the encoding.
+ * @return true if the name is known.
+ */
+bool parseEncoding(const std::string& text, PayloadEncoding& encoding) {
+    for (PayloadEncoding candidate : {PayloadEncoding::JSON, PayloadEncoding::JSON_PRETTY, PayloadEncoding::CBOR, PayloadEncoding::MSGPACK}) {
+        if (text == encodingName(candidate)) {
+            encoding = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Timestamp Style
+enum class TimestampStyle {
+    ISO8601_BASIC, // 2025-01-31T08:00:05+0530 (strftime %z, as originally published)
+    RFC3339_MILLIS // 2025-01-31T08:00:05.123+05:30
+};
+
+/**
+ * @brief Thread-local local-time formatter that caches everything except the seconds.
+ * The date, hour, minute and UTC offset are rebuilt with localtime_r only when the minute
+ * changes; each call copies the cached prefix and patches in the seconds (and milliseconds).
+ */
+class TimestampFormatter {
+    static std::atomic<TimestampStyle> style_;
+
+    int64_t cachedMinute_ = INT64_MIN;
+    char prefix_[24];        // "YYYY-MM-DDTHH:MM:"
+    size_t prefixLength_ = 0;
+    char offsetBasic_[8];    // "+HHMM"
+    char offsetExtended_[8]; // "+HH:MM"
+
+    void refresh(int64_t epochMinute, std::time_t itt) {
+        std::tm tm_local{};
+        localtime_r(&itt, &tm_local); // Uses system's configured local timezone; reentrant
+        prefixLength_ = std::strftime(prefix_, sizeof(prefix_), "%Y-%m-%dT%H:%M:", &tm_local);
+        long offsetMinutes = tm_local.tm_gmtoff / 60;
+        char sign = offsetMinutes < 0 ? '-' : '+';
+        int offsetHours = static_cast<int>(std::labs(offsetMinutes) / 60 % 100);
+        int offsetRemainder = static_cast<int>(std::labs(offsetMinutes) % 60);
+        std::snprintf(offsetBasic_, sizeof(offsetBasic_), "%c%02d%02d", sign, offsetHours, offsetRemainder);
+        std::snprintf(offsetExtended_, sizeof(offsetExtended_), "%c%02d:%02d", sign, offsetHours, offsetRemainder);
+        cachedMinute_ = epochMinute;
+    }
+
+public:
+    /**
+     * @brief Select the process-wide timestamp style.
+     * @param style Timestamp style.
+     */
+    static void setStyle(TimestampStyle style) { style_.store(style, std::memory_order_relaxed); }
+    static TimestampStyle style() { return style_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Formatter owned by the calling thread.
+     * @return TimestampFormatter& Thread-local instance.
+     */
+    static TimestampFormatter& local() {
+        thread_local TimestampFormatter formatter;
+        return formatter;
+    }
+
+    /**
+     * @brief Format a time point in the configured style.
+     * @param now Time to format.
+     * @param buf Output buffer (TIMESTAMP_BUFFER_BYTES is sufficient).
+     * @param size Size of buf.
+     * @return size_t Number of characters written, excluding the terminator.
+     */
+    size_t format(std::chrono::system_clock::time_point now, char* buf, size_t size) {
+        int64_t epochMillis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+        int64_t epochSeconds = epochMillis / 1000 - (epochMillis % 1000 < 0 ? 1 : 0);
+        int64_t epochMinute = epochSeconds / 60 - (epochSeconds % 60 < 0 ? 1 : 0);
+        if (epochMinute != cachedMinute_) {
+            refresh(epochMinute, static_cast<std::time_t>(epochSeconds));
+        }
+        int second = static_cast<int>(epochSeconds - epochMinute * 60);
+        int millis = static_cast<int>(epochMillis - epochSeconds * 1000);
+
+        char out[TIMESTAMP_BUFFER_BYTES];
+        std::memcpy(out, prefix_, prefixLength_);
+        size_t length = prefixLength_;
+        out[length++] = static_cast<char>('0' + second / 10);
+        out[length++] = static_cast<char>('0' + second % 10);
+        const char* offset = offsetBasic_;
+        if (style() == TimestampStyle::RFC3339_MILLIS) {
+            out[length++] = '.';
+            out[length++] = static_cast<char>('0' + millis / 100);
+            out[length++] = static_cast<char>('0' + millis / 10 % 10);
+            out[length++] = static_cast<char>('0' + millis % 10);
+            offset = offsetExtended_;
+        }
+        size_t offsetLength = std::strlen(offset);
+        std::memcpy(out + length, offset, offsetLength);
+        length += offsetLength;
+
+        if (size == 0) return 0;
+        length = std::min(length, size - 1);
+        std::memcpy(buf, out, length);
+        buf[length] = '\0';
+        return length;
+    }
+};
+
+std::atomic<TimestampStyle> TimestampFormatter::style_{TimestampStyle::ISO8601_BASIC};
+
+/**
+ * @brief Format a time point in local system time in ISO 8601 format with offset, without allocating.
+ * Thread-safe; see TimestampFormatter for the caching and the RFC 3339 option.
+ * @param now Time to format.
+ * @param buf Output buffer (TIMESTAMP_BUFFER_BYTES is sufficient).
+ * @param size Size of buf.
+ * @return size_t Number of characters written, excluding the terminator.
+ */
+size_t formatTimestampLocal(std::chrono::system_clock::time_point now, char* buf, size_t size) {
+    return TimestampFormatter::local().format(now, buf, size);
+}
+
+// --- Simulation Clock ---
+
+/**
+ * @brief Process-wide clock used by the state machine, the sampling loop and timestamps.
+ * REAL reads the system clocks. SCALED runs virtual time at N x real time from a chosen start.
+ * AS_FAST_AS_POSSIBLE never sleeps: each thread's virtual time jumps to the deadline it waits
+ * for, which keeps every worker's timeline deterministic regardless of scheduling.
+ * Configure once before starting threads.
+ */
+class SimClock {
+public:
+    enum class Mode {
+        REAL,
+        SCALED,
+        AS_FAST_AS_POSSIBLE
+    };
+
+    /**
+     * @brief Select the clock.
+     * @param mode Clock mode.
+     * @param speed Virtual seconds per real second (SCALED only).
+     * @param wallStart Virtual wall-clock time at which the simulation starts.
+     */
+    static void configure(Mode mode, double speed, std::chrono::system_clock::time_point wallStart) {
+        mode_ = mode;
+        speed_ = speed;
+        realEpoch_ = std::chrono::steady_clock::now();
+        steadyEpoch_ = realEpoch_;
+        wallEpoch_ = wallStart;
+        latestOffset_.store(0, std::memory_order_relaxed);
+    }
+
+    static Mode mode() { return mode_; }
+
+    /**
+     * @brief Current monotonic time, used for state durations and scheduling.
+     */
+    static std::chrono::steady_clock::time_point steadyNow() {
+        if (mode_ == Mode::REAL) return std::chrono::steady_clock::now();
+        return steadyEpoch_ + virtualOffset();
+    }
+
+    /**
+     * @brief Current wall-clock time, used for meal slots and timestamps.
+     */
+    static std::chrono::system_clock::time_point wallNow() {
+        if (mode_ == Mode::REAL) return std::chrono::system_clock::now();
+        return wallEpoch_ + std::chrono::duration_cast<std::chrono::system_clock::duration>(virtualOffset());
+    }
+
+    /**
+     * @brief Wall-clock time corresponding to a steadyNow() time point.
+     * @param time Monotonic time point from this clock.
+     */
+    static std::chrono::system_clock::time_point toWall(std::chrono::steady_clock::time_point time) {
+        if (mode_ == Mode::REAL) {
+            return std::chrono::system_clock::now() + std::chrono::duration_cast<std::chrono::system_clock::duration>(time - std::chrono::steady_clock::now());
+        }
+        return wallEpoch_ + std::chrono::duration_cast<std::chrono::system_clock::duration>(time - steadyEpoch_);
+    }
+
+    /**
+     * @brief Block the calling thread until the clock reaches deadline.
+     * @param deadline Monotonic time point from this clock.
+     */
+    static void sleepUntil(std::chrono::steady_clock::time_point deadline) {
+        switch (mode_) {
+        case Mode::REAL:
+            std::this_thread::sleep_until(deadline);
+            break;
+        case Mode::SCALED: {
+            auto realDelay = std::chrono::duration_cast<std::chrono::steady_clock::duration>((deadline - steadyEpoch_) / speed_);
+            std::this_thread::sleep_until(realEpoch_ + realDelay);
+            break;
+        }
+        case Mode::AS_FAST_AS_POSSIBLE: {
+            int64_t offset = (deadline - steadyEpoch_).count();
+            if (offset > threadOffset_) threadOffset_ = offset;
+            int64_t latest = latestOffset_.load(std::memory_order_relaxed);
+            while (offset > latest && !latestOffset_.compare_exchange_weak(latest, offset, std::memory_order_relaxed)) {
+            }
+            break;
+        }
+        }
+    }
+
+private:
+    static std::chrono::steady_clock::duration virtualOffset() {
+        if (mode_ == Mode::SCALED) {
+            return std::chrono::duration_cast<std::chrono::steady_clock::duration>((std::chrono::steady_clock::now() - realEpoch_) * speed_);
+        }
+        // Threads that have never waited (e.g. Paho callbacks) see the furthest any worker has got
+        int64_t offset = threadOffset_ >= 0 ? threadOffset_ : latestOffset_.load(std::memory_order_relaxed);
+        return std::chrono::steady_clock::duration(offset);
+    }
+
+    static Mode mode_;
+    static double speed_;
+    static std::chrono::steady_clock::time_point realEpoch_;
+    static std::chrono::steady_clock::time_point steadyEpoch_;
+    static std::chrono::system_clock::time_point wallEpoch_;
+    static std::atomic<int64_t> latestOffset_;
+    static thread_local int64_t threadOffset_;
+};
+
+SimClock::Mode SimClock::mode_ = SimClock::Mode::REAL;
+double SimClock::speed_ = 1.0;
+std::chrono::steady_clock::time_point SimClock::realEpoch_;
+std::chrono::steady_clock::time_point SimClock::steadyEpoch_;
+std::chrono::system_clock::time_point SimClock::wallEpoch_;
+std::atomic<int64_t> SimClock::latestOffset_{0};
+thread_local int64_t SimClock::threadOffset_ = -1;
+
+/**
+ * @brief Derive an independent 32-bit seed for one stream (e.g. one bed) from a base seed.
+ * @param seed Base seed.
+ * @param stream Stream number.
+ * @return uint32_t Mixed seed (SplitMix64 finalizer).
+ */
+uint32_t mixSeed(uint64_t seed, uint64_t stream) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull * (stream + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return static_cast<uint32_t>((z ^ (z >> 31)) >> 32);
+}
+
 /**
  * @brief Get current timestamp in local system time in ISO 8601 format with offset.
  * @return std::string Timestamp string.
  */
 std::string getCurrentTimestampLocal() {
-    auto now = std::chrono::system_clock::now();
-    auto itt = std::chrono::system_clock::to_time_t(now);
-    std::tm tm_local = *std::localtime(&itt); // Uses system's configured local timezone
+    char buf[TIMESTAMP_BUFFER_BYTES];
+    size_t length = formatTimestampLocal(SimClock::wallNow(), buf, sizeof(buf));
+    return std::string(buf, length);
+}
 
-    char buf[80];
-    // Attempt to format with timezone offset (%z).
-    // The output of %z can vary (e.g., +0530 on Linux, may be different on other systems/compilers).
-    // ISO 8601 prefers +HH:MM, but +HHMM is also valid.
-    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", &tm_local);
-    
-    std::string timed_str = buf;
-    // Optional: To try and force a colon in the timezone offset if %z gives +HHMM
-    // This part is a bit more complex if %z format isn't consistent or if it's empty
-    // For simplicity, we'll use what strftime with %z provides.
-    // If more robust ISO 8601 timezone formatting is needed, a dedicated date-time library
-    // like Howard Hinnant's 'tz' or C++20 chrono features would be better.
+// --- Logging ---
 
-    return timed_str;
+// Log severity; WARN and ERROR go to stderr, the rest to stdout
+enum class LogLevel : uint8_t {
+    DEBUG,
+    INFO,
+    WARN,
+    ERROR
+};
+
+/**
+ * @brief Parse a --log-level value.
+ * @param text "debug", "info", "warn" or "error".
+ * @param level Receives the parsed level.
+ * @return true if text names a level.
+ */
+bool parseLogLevel(const std::string& text, LogLevel& level) {
+    if (text == "debug") level = LogLevel::DEBUG;
+    else if (text == "info") level = LogLevel::INFO;
+    else if (text == "warn") level = LogLevel::WARN;
+    else if (text == "error") level = LogLevel::ERROR;
+    else return false;
+    return true;
 }
 
+/**
+ * @brief Process-wide asynchronous logger.
+ * Producers claim a slot in a bounded lock-free MPSC ring (Vyukov's per-slot sequence scheme),
+ * copy the message and its capture time in, and return without any syscall. A background thread
+ * formats the timestamp prefixes and writes whatever is queued with one write and one flush per
+ * stream per pass. When the ring is full new lines are dropped and counted rather than blocking
+ * a publishing thread.
+ */
+class AsyncLogger {
+public:
+    static AsyncLogger& instance() {
+        static AsyncLogger logger;
+        return logger;
+    }
+
+    ~AsyncLogger() {
+        running_.store(false, std::memory_order_release);
+        if (writer_.joinable()) writer_.join();
+    }
+
+    void setLevel(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+    bool enabled(LogLevel level) const { return level >= level_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Queue one line. Safe from any thread; never blocks.
+     * @param level Severity, which also selects the stream.
+     * @param time Capture time for the "[timestamp]" prefix.
+     * @param text Message without prefix or newline; truncated to LOG_MESSAGE_BYTES.
+     * @param length Length of text.
+     */
+    void push(LogLevel level, std::chrono::system_clock::time_point time, const char* text, size_t length) {
+        uint64_t position = head_.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots_[position & (LOG_QUEUE_CAPACITY - 1)];
+            uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+            int64_t lag = static_cast<int64_t>(sequence - position);
+            if (lag == 0) {
+                if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            } else if (lag < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed); // The writer is a full ring behind
+                return;
+            } else {
+                position = head_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->level = level;
+        slot->time = time;
+        slot->length = static_cast<uint16_t>(std::min(length, LOG_MESSAGE_BYTES));
+        std::memcpy(slot->text, text, slot->length);
+        slot->sequence.store(position + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Wait until every line queued before the call has been written and flushed.
+     */
+    void flush() {
+        uint64_t target = head_.load(std::memory_order_acquire);
+        while (written_.load(std::memory_order_acquire) < target && running_.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        LogLevel level;
+        uint16_t length;
+        std::chrono::system_clock::time_point time;
+        char text[LOG_MESSAGE_BYTES];
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<uint64_t> head_{0};    // Next position producers claim
+    alignas(64) std::atomic<uint64_t> written_{0}; // Positions written and flushed by the writer
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<LogLevel> level_{LogLevel::INFO};
+    std::atomic<bool> running_{true};
+    std::thread writer_;
+
+    AsyncLogger() : slots_(new Slot[LOG_QUEUE_CAPACITY]) {
+        for (size_t i = 0; i < LOG_QUEUE_CAPACITY; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        writer_ = std::thread(&AsyncLogger::run, this);
+    }
+
+    static FILE* streamFor(LogLevel level) { return level >= LogLevel::WARN ? stderr : stdout; }
+
+    /**
+     * @brief Append "[timestamp] text\n" to a pending write, switching streams in order.
+     */
+    static void appendLine(std::string& pending, FILE*& pendingStream, FILE* stream,
+                           std::chrono::system_clock::time_point time, const char* text, size_t length) {
+        if (stream != pendingStream) {
+            if (!pending.empty()) std::fwrite(pending.data(), 1, pending.size(), pendingStream);
+            pending.clear();
+            pendingStream = stream;
+        }
+        char timestamp[TIMESTAMP_BUFFER_BYTES];
+        pending.push_back('[');
+        pending.append(timestamp, formatTimestampLocal(time, timestamp, sizeof(timestamp)));
+        pending.append("] ", 2);
+        pending.append(text, length);
+        pending.push_back('\n');
+    }
+
+    void run() {
+        std::string pending;
+        pending.reserve(LOG_QUEUE_CAPACITY * 64);
+        uint64_t tail = 0;
+        uint64_t reportedDrops = 0;
+        for (;;) {
+            bool stopping = !running_.load(std::memory_order_acquire); // Checked first so the final pass drains everything
+            FILE* pendingStream = stdout;
+            uint64_t start = tail;
+            for (;;) {
+                Slot& slot = slots_[tail & (LOG_QUEUE_CAPACITY - 1)];
+                if (slot.sequence.load(std::memory_order_acquire) != tail + 1) break;
+                appendLine(pending, pendingStream, streamFor(slot.level), slot.time, slot.text, slot.length);
+                slot.sequence.store(tail + LOG_QUEUE_CAPACITY, std::memory_order_release);
+                ++tail;
+            }
+            uint64_t drops = dropped_.load(std::memory_order_relaxed);
+            if (drops != reportedDrops) {
+                char text[96];
+                int length = std::snprintf(text, sizeof(text), "Logger dropped %llu line(s): writer fell behind",
+                                           static_cast<unsigned long long>(drops - reportedDrops));
+                appendLine(pending, pendingStream, stderr, SimClock::wallNow(), text, static_cast<size_t>(length));
+                reportedDrops = drops;
+            }
+            if (!pending.empty()) {
+                std::fwrite(pending.data(), 1, pending.size(), pendingStream);
+                pending.clear();
+            }
+            if (tail != start) {
+                std::fflush(stdout);
+                std::fflush(stderr);
+                written_.store(tail, std::memory_order_release);
+            }
+            if (stopping) return;
+            if (tail == start) std::this_thread::sleep_for(std::chrono::milliseconds(LOG_WRITER_IDLE_MS));
+        }
+    }
+};
+
+static_assert((LOG_QUEUE_CAPACITY & (LOG_QUEUE_CAPACITY - 1)) == 0, "LOG_QUEUE_CAPACITY must be a power of two");
+
+/**
+ * @brief Per-call-site rate limit for messages that repeat across beds (e.g. "not connected").
+ * Allows LOG_RATE_LIMIT_LINES lines per LOG_RATE_LIMIT_WINDOW_SECONDS of real time and counts
+ * the rest; the next allowed line reports how many were suppressed. Approximate under contention.
+ */
+class LogThrottle {
+    std::atomic<int64_t> windowStartMs_{INT64_MIN / 2};
+    std::atomic<int> lines_{0};
+    std::atomic<uint64_t> suppressed_{0};
+
+public:
+    /**
+     * @brief Decide whether to emit a line.
+     * @param suppressed Receives the number of lines suppressed since the last allowed one.
+     * @return true to log.
+     */
+    bool allow(uint64_t& suppressed) {
+        int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t windowStartMs = windowStartMs_.load(std::memory_order_relaxed);
+        if (nowMs - windowStartMs >= LOG_RATE_LIMIT_WINDOW_SECONDS * 1000LL &&
+            windowStartMs_.compare_exchange_strong(windowStartMs, nowMs, std::memory_order_relaxed)) {
+            lines_.store(0, std::memory_order_relaxed);
+        }
+        if (lines_.fetch_add(1, std::memory_order_relaxed) < LOG_RATE_LIMIT_LINES) {
+            suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+        suppressed_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+};
+
+/**
+ * @brief One log line, built with operator<< into a fixed buffer and queued on destruction.
+ * Nothing is formatted when the level is disabled or the throttle suppresses the line.
+ * Usage: LogLine(LogLevel::INFO) << "Bed " << n << " set to FLAT after meal.";
+ */
+class LogLine {
+    // Bounded streambuf: output past the end is discarded (the message is truncated)
+    class FixedBuffer : public std::streambuf {
+    public:
+        FixedBuffer(char* begin, size_t size) { setp(begin, begin + size); }
+        size_t size() const { return static_cast<size_t>(pptr() - pbase()); }
+    };
+
+    LogLevel level_;
+    uint64_t suppressed_ = 0; // Before active_: the throttle fills it in active_'s initializer
+    bool active_;
+    std::chrono::system_clock::time_point time_;
+    char text_[LOG_MESSAGE_BYTES];
+    FixedBuffer buffer_{text_, sizeof(text_)};
+    std::optional<std::ostream> stream_;
+
+public:
+    explicit LogLine(LogLevel level) : level_(level), active_(AsyncLogger::instance().enabled(level)) {
+        start();
+    }
+
+    LogLine(LogLevel level, LogThrottle& throttle)
+        : level_(level), active_(AsyncLogger::instance().enabled(level) && throttle.allow(suppressed_)) {
+        start();
+    }
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    ~LogLine() {
+        if (!active_) return;
+        if (suppressed_ > 0) *stream_ << " (" << suppressed_ << " similar line(s) suppressed)";
+        AsyncLogger::instance().push(level_, time_, text_, buffer_.size());
+    }
+
+    template <typename T>
+    LogLine& operator<<(const T& value) {
+        if (active_) *stream_ << value;
+        return *this;
+    }
+
+private:
+    void start() {
+        if (!active_) return;
+        time_ = SimClock::wallNow(); // Capture time, not write time; per-thread in fast mode
+        stream_.emplace(&buffer_);
+    }
+};
+
+/**
+ * @brief Fixed-schema telemetry sample that borrows its device ID instead of copying it.
+ */
+struct TelemetrySample {
+    std::string_view deviceId;
+    std::chrono::system_clock::time_point time;
+    double heartRate;
+    double spo2;
+    double inclination;
+    BedInclinationState state;
+    bool includeState = true;  // false = vitals only; inclination and bedState are omitted
+    bool includeVitals = true; // false = state only; heartRate and spo2 are omitted
+};
+
 /**
  * @brief Telemetry class holds patient bed telemetry data and serializes it to JSON.
  */
@@ -108,6 +849,8 @@ public:
     double spo2;
     double inclination;
     std::string bedState; 
+    bool includeState = true;
+    bool includeVitals = true;
 
     /**
      * @brief Construct a new Telemetry object.
@@ -117,203 +860,5915 @@ public:
      * @param incl Bed inclination.
      * @param state Bed state (FLAT/INCLINED).
      */
-    Telemetry(std::string id, double hr, double oxygen, double incl, BedInclinationState state)
+    Telemetry(const std::string& id, double hr, double oxygen, double incl, BedInclinationState state)
         : deviceId(id), heartRate(hr), spo2(oxygen), inclination(incl) {
         timestamp = getCurrentTimestampLocal(); // Use local system timestamp
         bedState = (state == BedInclinationState::FLAT) ? "FLAT" : "INCLINED";
     }
 
     /**
-     * @brief Serialize telemetry data to JSON string.
-     * @return std::string JSON representation.
+     * @brief Construct a Telemetry object from a sample, keeping the sample's own timestamp.
+     * @param sample Sample to copy.
      */
-    std::string toJson() const {
+    explicit Telemetry(const TelemetrySample& sample)
+        : deviceId(sample.deviceId), heartRate(sample.heartRate), spo2(sample.spo2), inclination(sample.inclination) {
+        char buf[TIMESTAMP_BUFFER_BYTES];
+        timestamp.assign(buf, formatTimestampLocal(sample.time, buf, sizeof(buf)));
+        bedState = (sample.state == BedInclinationState::FLAT) ? "FLAT" : "INCLINED";
+        includeState = sample.includeState;
+        includeVitals = sample.includeVitals;
+    }
+
+    /**
+     * @brief Build the JSON document for this telemetry sample.
+     * @return json JSON object.
+     */
+    json toJsonObject() const {
         json j;
         j["deviceId"] = deviceId;
         j["timestamp"] = timestamp;
-        j["heartRate"] = heartRate;
-        j["spo2"] = spo2;
-        j["inclination"] = inclination;
-        j["bedState"] = bedState;
-        return j.dump(4);
+        if (includeVitals) {
+            j["heartRate"] = heartRate;
+            j["spo2"] = spo2;
+        }
+        if (includeState) {
+            j["inclination"] = inclination;
+            j["bedState"] = bedState;
+        }
+        return j;
     }
-};
 
-/**
- * @brief MQTT callback handler for connection events and message delivery.
- */
-class callback : public virtual mqtt::callback {
-    mqtt::async_client& cli_;
-    void connected(const std::string& cause) override {
-        std::cout << "\n[" << getCurrentTimestampLocal() << "] Connection success" << std::endl;
-    }
-    void connection_lost(const std::string& cause) override {
-        std::cerr << "\n[" << getCurrentTimestampLocal() << "] Connection lost: " << cause << std::endl;
-    }
-    void message_arrived(mqtt::const_message_ptr msg) override {
-        std::cout << "Message arrived on topic: " << msg->get_topic() << std::endl;
-        std::cout << "\tPayload: " << msg->to_string() << std::endl;
+    /**
+     * @brief Serialize telemetry data to a compact JSON string.
+     * @return std::string JSON representation.
+     */
+    std::string toJson() const {
+        return toJsonObject().dump();
     }
-    void delivery_complete(mqtt::delivery_token_ptr tok) override { /* Optional */ }
-public:
+
     /**
-     * @brief Construct a new callback object.
-     * @param client Reference to MQTT async client.
+     * @brief Serialize telemetry data with the given encoding.
+     * @param encoding Payload encoding; CBOR and MessagePack produce binary payloads.
+     * @return std::string Encoded payload bytes.
      */
-    callback(mqtt::async_client& client) : cli_(client) {}
+    std::string encode(PayloadEncoding encoding) const {
+        switch (encoding) {
+        case PayloadEncoding::JSON_PRETTY:
+            return toJsonObject().dump(4);
+        case PayloadEncoding::CBOR: {
+            std::vector<std::uint8_t> bytes = json::to_cbor(toJsonObject());
+            return std::string(bytes.begin(), bytes.end());
+        }
+        case PayloadEncoding::MSGPACK: {
+            std::vector<std::uint8_t> bytes = json::to_msgpack(toJsonObject());
+            return std::string(bytes.begin(), bytes.end());
+        }
+        case PayloadEncoding::JSON:
+            break;
+        }
+        return toJson();
+    }
 };
 
 /**
- * @brief Main function for Patient Bed Simulator.
- * Connects to MQTT, simulates telemetry, and publishes data at intervals.
+ * @brief Formats TelemetrySample as compact JSON into a reusable buffer.
+ * Produces the same document as Telemetry::toJson() without building a json tree; once the
+ * buffer has grown to fit a payload, formatting a sample performs no heap allocation.
  */
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <device_instance_number (e.g., 1 or 2)>" << std::endl;
-        return 1;
-    }
-
-    std::string deviceInstanceNumStr = argv[1];
-    std::string clientId = CLIENT_ID_PREFIX + deviceInstanceNumStr;
-    std::string topic = TOPIC_PREFIX + deviceInstanceNumStr + "/data";
-    std::string clientCertPath = CLIENT_CERT_PATH_PREFIX + deviceInstanceNumStr + ".pem.crt";
-    std::string clientKeyPath = CLIENT_KEY_PATH_PREFIX + deviceInstanceNumStr + ".private.key";
-
-    std::cout << "[" << getCurrentTimestampLocal() << "] Starting Patient Bed Simulator: " << clientId << std::endl;
-    std::cout << "[" << getCurrentTimestampLocal() << "] Publishing to topic: " << topic << std::endl;
-    
-    mqtt::async_client client(SERVER_ADDRESS, clientId);
-    callback cb(client);
-    client.set_callback(cb);
-    mqtt::ssl_options ssl_opts;
-    ssl_opts.set_trust_store(CA_CERT_PATH);
-    ssl_opts.set_key_store(clientCertPath);
-    ssl_opts.set_private_key(clientKeyPath);
-    mqtt::connect_options conn_opts;
-    conn_opts.set_keep_alive_interval(60);
-    conn_opts.set_clean_session(true);
-    conn_opts.set_ssl(ssl_opts);
-    conn_opts.set_automatic_reconnect(true);
-
-    std::cout << "[" << getCurrentTimestampLocal() << "] Connecting to MQTT broker at " << SERVER_ADDRESS << "..." << std::endl;
-    try {
-        client.connect(conn_opts)->wait();
-    } catch (const mqtt::exception& exc) {
-        std::cerr << "[" << getCurrentTimestampLocal() << "] Error connecting: " << exc.what() << std::endl;
-        return 1;
-    }
-
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<> heart_rate_dist(55.0, 85.0);
-    std::uniform_real_distribution<> spo2_dist(95.0, 99.5);
-    std::uniform_real_distribution<> probability_dist(0.0, 1.0);
-    std::uniform_int_distribution<> minor_incline_duration_rand_addon(0, MINOR_INCLINATION_DURATION_RAND_ADD_MINUTES -1);
-    std::uniform_int_distribution<> flat_duration_rand_addon(0, FLAT_STATE_RAND_ADD_MINUTES -1);
-
-    BedInclinationState currentInclinationState = BedInclinationState::FLAT;
-    double currentInclination = 0.0;
-    auto lastNonMealStateChangeTime = std::chrono::steady_clock::now();
-    int currentNonMealStateDurationSeconds = (FLAT_STATE_BASE_DURATION_MINUTES + flat_duration_rand_addon(gen)) * 60;
-    bool inMealInclineOverride = false;
-
-    while (true) {
-        double hr = heart_rate_dist(gen);
-        double spo2 = spo2_dist(gen);
+class TelemetryWriter {
+    std::string buffer_;
 
-        // --- Inclination Logic using Local System Time ---
-        auto now_for_time_check = std::chrono::system_clock::now();
-        time_t itt_for_check = std::chrono::system_clock::to_time_t(now_for_time_check);
-        std::tm current_local_tm_struct = *std::localtime(&itt_for_check); // Uses system's local timezone
-
-        int current_hour_local = current_local_tm_struct.tm_hour;
-        int current_minute_local = current_local_tm_struct.tm_min;
-
-        bool is_currently_meal_time_slot = false;
-        for (const auto& meal_time : meal_start_times) { // Uses local meal times
-            int meal_start_hour = meal_time.first;
-            int meal_start_minute = meal_time.second;
-            
-            int current_total_minutes_from_midnight = current_hour_local * 60 + current_minute_local;
-            int meal_start_total_minutes_from_midnight = meal_start_hour * 60 + meal_start_minute;
-            int meal_end_total_minutes_from_midnight = meal_start_total_minutes_from_midnight + MEAL_INCLINATION_DURATION_MINUTES;
-
-            if (current_total_minutes_from_midnight >= meal_start_total_minutes_from_midnight &&
-                current_total_minutes_from_midnight < meal_end_total_minutes_from_midnight) {
-                is_currently_meal_time_slot = true;
-                break;
+    void appendString(std::string_view text) {
+        buffer_ += '"';
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                buffer_ += '\\';
+                buffer_ += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned int>(c));
+                buffer_ += escaped;
+            } else {
+                buffer_ += c;
             }
         }
+        buffer_ += '"';
+    }
 
-        auto now_steady = std::chrono::steady_clock::now();
-
-        if (is_currently_meal_time_slot) {
-            if (!inMealInclineOverride) {
-                 std::cout << "[" << getCurrentTimestampLocal() << "] Bed " << deviceInstanceNumStr << " INCLINED for meal to " << MEAL_INCLINATION_DEGREES << " degrees." << std::endl;
-            }
-            currentInclination = MEAL_INCLINATION_DEGREES;
-            currentInclinationState = BedInclinationState::INCLINED;
-            inMealInclineOverride = true;
-        } else { 
-            if (inMealInclineOverride) { 
-                currentInclination = 0.0;
-                currentInclinationState = BedInclinationState::FLAT;
-                currentNonMealStateDurationSeconds = (FLAT_STATE_BASE_DURATION_MINUTES + flat_duration_rand_addon(gen)) * 60;
-                lastNonMealStateChangeTime = now_steady;
-                inMealInclineOverride = false;
-                std::cout << "[" << getCurrentTimestampLocal() << "] Bed " << deviceInstanceNumStr << " set to FLAT after meal." << std::endl;
-            } else { 
-                auto elapsedSinceLastNonMealChange_seconds = std::chrono::duration_cast<std::chrono::seconds>(now_steady - lastNonMealStateChangeTime).count();
-
-                if (elapsedSinceLastNonMealChange_seconds >= currentNonMealStateDurationSeconds) {
-                    if (currentInclinationState == BedInclinationState::FLAT) {
-                        if (probability_dist(gen) < PROBABILITY_MINOR_INCLINE) {
-                            currentInclination = MINOR_INCLINATION_DEGREES;
-                            currentInclinationState = BedInclinationState::INCLINED;
-                            currentNonMealStateDurationSeconds = (MINOR_INCLINATION_DURATION_BASE_MINUTES + minor_incline_duration_rand_addon(gen)) * 60;
-                            std::cout << "[" << getCurrentTimestampLocal() << "] Bed " << deviceInstanceNumStr << " INCLINED (minor) to " << currentInclination << " degrees." << std::endl;
-                        } else {
-                            currentInclination = 0.0; 
-                            currentInclinationState = BedInclinationState::FLAT;
-                            currentNonMealStateDurationSeconds = (FLAT_STATE_BASE_DURATION_MINUTES + flat_duration_rand_addon(gen)) * 60;
-                        }
-                    } else { 
-                        currentInclination = 0.0;
-                        currentInclinationState = BedInclinationState::FLAT;
-                        currentNonMealStateDurationSeconds = (FLAT_STATE_BASE_DURATION_MINUTES + flat_duration_rand_addon(gen)) * 60;
-                        std::cout << "[" << getCurrentTimestampLocal() << "] Bed " << deviceInstanceNumStr << " set to FLAT after minor incline." << std::endl;
-                    }
-                    lastNonMealStateChangeTime = now_steady;
-                }
-            }
+    void appendDouble(double value) {
+        char digits[32];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer_.append(digits, result.ptr);
+        // Match nlohmann's output, which always marks floating-point values with a fraction
+        if (std::find_if(digits, result.ptr, [](char c) { return c == '.' || c == 'e'; }) == result.ptr) {
+            buffer_ += ".0";
         }
-        // --- End of Inclination Logic ---
-
-        Telemetry telemetryData(clientId, hr, spo2, currentInclination, currentInclinationState);
-        std::string payload = telemetryData.toJson();
+    }
 
-        mqtt::message_ptr pubmsg = mqtt::make_message(topic, payload);
-        pubmsg->set_qos(QOS);
+    void appendTimestamp(std::chrono::system_clock::time_point time) {
+        char timestamp[TIMESTAMP_BUFFER_BYTES];
+        size_t length = formatTimestampLocal(time, timestamp, sizeof(timestamp));
+        appendString(std::string_view(timestamp, length));
+    }
 
-        try {
-            if (!client.is_connected()) {
-                 std::cerr << "[" << getCurrentTimestampLocal() << "] Client not connected. Retrying connection by Paho..." << std::endl;
-            }
-            client.publish(pubmsg)->wait();
-        } catch (const mqtt::exception& exc) {
-            std::cerr << "[" << getCurrentTimestampLocal() << "] Error publishing: " << exc.what() << std::endl;
-        }
+public:
+    /**
+     * @brief Construct a writer.
+     * @param capacity Initial buffer capacity in bytes.
+     */
+    explicit TelemetryWriter(size_t capacity = TELEMETRY_BUFFER_BYTES) { buffer_.reserve(capacity); }
 
-        std::this_thread::sleep_for(std::chrono::seconds(DATA_SEND_INTERVAL_SECONDS));
+    /**
+     * @brief Format one sample, replacing the previous contents of the buffer.
+     * @param sample Sample to serialize.
+     * @return std::string_view JSON payload, valid until the next write.
+     */
+    std::string_view write(const TelemetrySample& sample) {
+        buffer_.clear();
+        appendObject(sample);
+        return buffer_;
     }
 
-    try {
-        std::cout << "\n[" << getCurrentTimestampLocal() << "] Disconnecting..." << std::endl;
-        client.disconnect()->wait();
-        std::cout << "[" << getCurrentTimestampLocal() << "] Disconnected." << std::endl;
-    } catch (const mqtt::exception& exc) {
-        std::cerr << "[" << getCurrentTimestampLocal() << "] Error disconnecting: " << exc.what() << std::endl;
+    /**
+     * @brief Format several samples as one JSON array, replacing the previous contents of the buffer.
+     * @param samples Samples to serialize.
+     * @return std::string_view JSON array payload, valid until the next write.
+     */
+    std::string_view writeArray(const std::vector<TelemetrySample>& samples) {
+        buffer_.clear();
+        buffer_ += '[';
+        for (size_t i = 0; i < samples.size(); ++i) {
+            if (i > 0) buffer_ += ',';
+            appendObject(samples[i]);
+        }
+        buffer_ += ']';
+        return buffer_;
+    }
+
+private:
+    void appendObject(const TelemetrySample& sample) {
+        // Keys in the order nlohmann::json emits them (sorted)
+        buffer_ += '{';
+        if (sample.includeState) {
+            buffer_ += "\"bedState\":";
+            appendString(sample.state == BedInclinationState::FLAT ? "FLAT" : "INCLINED");
+            buffer_ += ',';
+        }
+        buffer_ += "\"deviceId\":";
+        appendString(sample.deviceId);
+        if (sample.includeVitals) {
+            buffer_ += ",\"heartRate\":";
+            appendDouble(sample.heartRate);
+        }
+        if (sample.includeState) {
+            buffer_ += ",\"inclination\":";
+            appendDouble(sample.inclination);
+        }
+        if (sample.includeVitals) {
+            buffer_ += ",\"spo2\":";
+            appendDouble(sample.spo2);
+        }
+        buffer_ += ",\"timestamp\":";
+        appendTimestamp(sample.time);
+        buffer_ += '}';
+    }
+};
+
+/**
+ * @brief Samples of one bed waiting to be published together as a single array payload.
+ */
+class TelemetryBatch {
+    std::vector<TelemetrySample> samples_;
+    std::chrono::steady_clock::time_point firstSampleTime_;
+public:
+    /**
+     * @brief Construct a batch.
+     * @param capacity Samples per published message; storage is reserved up front.
+     */
+    explicit TelemetryBatch(size_t capacity) { samples_.reserve(capacity); }
+
+    /**
+     * @brief Add a sample.
+     * @param sample Sample to queue.
+     * @param now Current steady time, used for the batch window.
+     */
+    void add(const TelemetrySample& sample, std::chrono::steady_clock::time_point now) {
+        if (samples_.empty()) firstSampleTime_ = now;
+        samples_.push_back(sample);
+    }
+
+    /**
+     * @brief Whether the batch should be published.
+     * @param maxSize Samples per message.
+     * @param window Maximum age of the oldest sample (zero = no window).
+     * @param now Current steady time.
+     */
+    bool due(size_t maxSize, std::chrono::milliseconds window, std::chrono::steady_clock::time_point now) const {
+        if (samples_.empty()) return false;
+        if (samples_.size() >= maxSize) return true;
+        return window.count() > 0 && now - firstSampleTime_ >= window;
+    }
+
+    const std::vector<TelemetrySample>& samples() const { return samples_; }
+    void clear() { samples_.clear(); }
+
+    /**
+     * @brief Discard the oldest count samples.
+     */
+    void dropOldest(size_t count) {
+        samples_.erase(samples_.begin(), samples_.begin() + std::min(count, samples_.size()));
+    }
+};
+
+/**
+ * @brief Encode a JSON document with the given encoding.
+ * @param document Document to encode.
+ * @param encoding Payload encoding; CBOR and MessagePack produce binary payloads.
+ * @return std::string Encoded payload bytes.
+ */
+std::string encodeDocument(const json& document, PayloadEncoding encoding) {
+    switch (encoding) {
+    case PayloadEncoding::JSON_PRETTY:
+        return document.dump(4);
+    case PayloadEncoding::CBOR: {
+        std::vector<std::uint8_t> bytes = json::to_cbor(document);
+        return std::string(bytes.begin(), bytes.end());
+    }
+    case PayloadEncoding::MSGPACK: {
+        std::vector<std::uint8_t> bytes = json::to_msgpack(document);
+        return std::string(bytes.begin(), bytes.end());
+    }
+    case PayloadEncoding::JSON:
+        break;
+    }
+    return document.dump();
+}
+
+/**
+ * @brief Decode a payload produced by encodeDocument().
+ * @param payload Payload bytes.
+ * @param encoding Payload encoding.
+ * @param document Receives the document.
+ * @return true if the payload was well formed.
+ */
+bool decodeDocument(std::string_view payload, PayloadEncoding encoding, json& document) {
+    try {
+        switch (encoding) {
+        case PayloadEncoding::CBOR:
+            document = json::from_cbor(payload.begin(), payload.end());
+            return true;
+        case PayloadEncoding::MSGPACK:
+            document = json::from_msgpack(payload.begin(), payload.end());
+            return true;
+        case PayloadEncoding::JSON:
+        case PayloadEncoding::JSON_PRETTY:
+            break;
+        }
+        document = json::parse(payload.begin(), payload.end());
+        return true;
+    } catch (const json::exception&) {
+        return false;
+    }
+}
+
+/**
+ * @brief Encode a batch of samples as one array payload with the given (non-fast-path) encoding.
+ * @param samples Samples to encode.
+ * @param encoding Payload encoding.
+ * @return std::string Encoded array.
+ */
+std::string encodeBatch(const std::vector<TelemetrySample>& samples, PayloadEncoding encoding) {
+    json array = json::array();
+    for (const TelemetrySample& sample : samples) {
+        array.push_back(Telemetry(sample).toJsonObject());
+    }
+    return encodeDocument(array, encoding);
+}
+
+// --- Edge Aggregation ---
+
+/**
+ * @brief Running min/max/mean/last of one vital.
+ */
+struct RunningStats {
+    double min;
+    double max;
+    double sum;
+    double last;
+
+    void reset(double value) { min = max = sum = last = value; }
+
+    void add(double value) {
+        min = std::min(min, value);
+        max = std::max(max, value);
+        sum += value;
+        last = value;
+    }
+
+    json toJsonObject(uint32_t count) const {
+        return json{{"min", min}, {"max", max}, {"mean", sum / count}, {"last", last}};
+    }
+};
+
+/**
+ * @brief One bed's vitals over one tumbling window aligned to the wall clock (--aggregate).
+ * Adding a sample is O(1); the window's summary is published when the first sample of the next window arrives.
+ */
+struct WindowAggregate {
+    int64_t windowStart = 0; // Epoch seconds
+    uint32_t count = 0;      // 0 = nothing in the window yet
+    RunningStats heartRate;
+    RunningStats spo2;
+    double inclination = 0.0; // Last
+    BedInclinationState state = BedInclinationState::FLAT;
+
+    void add(int64_t start, const TelemetrySample& sample) {
+        if (count == 0) {
+            windowStart = start;
+            heartRate.reset(sample.heartRate);
+            spo2.reset(sample.spo2);
+        } else {
+            heartRate.add(sample.heartRate);
+            spo2.add(sample.spo2);
+        }
+        ++count;
+        inclination = sample.inclination;
+        state = sample.state;
+    }
+
+    /**
+     * @brief Summary document: the window's bounds, sample count, vitals statistics and last bed state.
+     * @param deviceId Device ID.
+     * @param length Window length.
+     * @param partial The run ended before the window closed: "partial" is set and "end" is still the window's end.
+     */
+    json toJsonObject(std::string_view deviceId, std::chrono::seconds length, bool partial = false) const {
+        char start[TIMESTAMP_BUFFER_BYTES];
+        char end[TIMESTAMP_BUFFER_BYTES];
+        auto startTime = std::chrono::system_clock::time_point(std::chrono::seconds(windowStart));
+        json j;
+        j["deviceId"] = deviceId;
+        j["window"] = length.count();
+        j["start"] = std::string(start, formatTimestampLocal(startTime, start, sizeof(start)));
+        j["end"] = std::string(end, formatTimestampLocal(startTime + length, end, sizeof(end)));
+        j["samples"] = count;
+        j["heartRate"] = heartRate.toJsonObject(count);
+        j["spo2"] = spo2.toJsonObject(count);
+        j["inclination"] = inclination;
+        j["bedState"] = state == BedInclinationState::FLAT ? "FLAT" : "INCLINED";
+        if (partial) j["partial"] = true;
+        return j;
+    }
+};
+
+/**
+ * @brief Parse an --aggregate value: comma-separated window lengths in seconds, such as "60,300".
+ * @param text Window list.
+ * @param windows Receives the windows.
+ * @return true if every length is valid and there are at most MAX_AGGREGATE_WINDOWS.
+ */
+bool parseAggregateWindows(const std::string& text, std::vector<std::chrono::seconds>& windows) {
+    std::stringstream list(text);
+    std::string item;
+    windows.clear();
+    while (std::getline(list, item, ',')) {
+        size_t pos = 0;
+        long seconds = std::stol(item, &pos);
+        if (pos != item.size() || seconds < DATA_SEND_INTERVAL_SECONDS || seconds > MAX_AGGREGATE_WINDOW_SECONDS) return false;
+        windows.emplace_back(seconds);
+    }
+    return !windows.empty() && windows.size() <= MAX_AGGREGATE_WINDOWS;
+}
+
+// --- Store-and-Forward Spool ---
+
+/**
+ * @brief Fixed-width sample record stored in the spool file.
+ */
+struct SpoolRecord {
+    int64_t epochMillis;
+    double heartRate;
+    double spo2;
+    double inclination;
+    uint8_t state;
+    uint8_t includeState;
+    uint8_t reserved[6];
+};
+
+/**
+ * @brief Spool file header; followed by one SpoolRingHeader per bed and then the records.
+ */
+struct SpoolFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    int32_t firstBed;
+    uint32_t bedCount;
+    uint64_t recordsPerBed;
+};
+
+/**
+ * @brief Read/write positions of one bed's ring. Both only grow; slot = position % capacity.
+ */
+struct SpoolRingHeader {
+    uint64_t head; // Next record to write
+    uint64_t tail; // Next record to replay
+};
+
+/**
+ * @brief One bed's view of the spool. Appending and popping are O(1) and touch only the mapping;
+ * a ring is used by a single worker thread.
+ */
+class SpoolRing {
+    SpoolRingHeader* header_ = nullptr;
+    SpoolRecord* records_ = nullptr;
+    uint64_t capacity_ = 0;
+public:
+    SpoolRing() = default;
+    SpoolRing(SpoolRingHeader* header, SpoolRecord* records, uint64_t capacity)
+        : header_(header), records_(records), capacity_(capacity) {}
+
+    bool valid() const { return header_ != nullptr; }
+    uint64_t size() const { return header_->head - header_->tail; }
+    bool empty() const { return header_->head == header_->tail; }
+
+    /**
+     * @brief Append a sample, overwriting the oldest record when the ring is full.
+     * @return false if an old record was overwritten.
+     */
+    bool append(const TelemetrySample& sample) {
+        SpoolRecord& record = records_[header_->head % capacity_];
+        record.epochMillis = std::chrono::duration_cast<std::chrono::milliseconds>(sample.time.time_since_epoch()).count();
+        record.heartRate = sample.heartRate;
+        record.spo2 = sample.spo2;
+        record.inclination = sample.inclination;
+        record.state = static_cast<uint8_t>(sample.state);
+        record.includeState = sample.includeState ? 1 : 0;
+        ++header_->head;
+        if (size() > capacity_) {
+            ++header_->tail;
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t written() const { return header_->head; }
+
+    /**
+     * @brief Read a buffered record without removing it.
+     * @param offset Position from the oldest record (must be < size()).
+     * @param deviceId Device ID for the returned sample.
+     * @return TelemetrySample Buffered sample.
+     */
+    TelemetrySample at(uint64_t offset, std::string_view deviceId) const {
+        const SpoolRecord& record = records_[(header_->tail + offset) % capacity_];
+        TelemetrySample sample{deviceId,
+                               std::chrono::system_clock::time_point(std::chrono::milliseconds(record.epochMillis)),
+                               record.heartRate, record.spo2, record.inclination,
+                               static_cast<BedInclinationState>(record.state)};
+        sample.includeState = record.includeState != 0;
+        return sample;
+    }
+
+    /**
+     * @brief Remove the oldest records once they have been published.
+     * @param count Records to remove (must be <= size()).
+     */
+    void pop(uint64_t count) { header_->tail += count; }
+};
+
+/**
+ * @brief Memory-mapped, fixed-size on-disk spool holding one ring per bed.
+ * Survives restarts when reopened with the same bed range and capacity; persistence relies on
+ * periodic msync checkpoints rather than a sync per record.
+ */
+class SpoolFile {
+    void* mapping_ = MAP_FAILED;
+    size_t mappingSize_ = 0;
+    int fd_ = -1;
+    SpoolFileHeader* header_ = nullptr;
+    std::atomic<bool> stopping_{false};
+    std::thread checkpointThread_;
+
+    static constexpr char MAGIC[8] = {'P', 'B', 'S', 'P', 'O', 'O', 'L', '1'};
+
+public:
+    SpoolFile() = default;
+    SpoolFile(const SpoolFile&) = delete;
+    SpoolFile& operator=(const SpoolFile&) = delete;
+
+    ~SpoolFile() {
+        stopping_ = true;
+        if (checkpointThread_.joinable()) checkpointThread_.join();
+        if (mapping_ != MAP_FAILED) {
+            msync(mapping_, mappingSize_, MS_SYNC);
+            munmap(mapping_, mappingSize_);
+        }
+        if (fd_ >= 0) close(fd_);
+    }
+
+    /**
+     * @brief Open or create the spool. An existing file with a different layout is reset.
+     * @param path File path.
+     * @param firstBed First instance number of the fleet.
+     * @param bedCount Number of beds.
+     * @param recordsPerBed Ring capacity per bed.
+     * @return true on success.
+     */
+    bool open(const std::string& path, int firstBed, int bedCount, uint64_t recordsPerBed) {
+        mappingSize_ = sizeof(SpoolFileHeader) + bedCount * sizeof(SpoolRingHeader) + bedCount * recordsPerBed * sizeof(SpoolRecord);
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd_ < 0) {
+            LogLine(LogLevel::ERROR) << "Error opening spool " << path << ": " << std::strerror(errno);
+            return false;
+        }
+        struct stat st{};
+        bool reuse = fstat(fd_, &st) == 0 && static_cast<size_t>(st.st_size) == mappingSize_;
+        if (!reuse && ftruncate(fd_, static_cast<off_t>(mappingSize_)) != 0) {
+            LogLine(LogLevel::ERROR) << "Error sizing spool " << path << ": " << std::strerror(errno);
+            return false;
+        }
+        mapping_ = mmap(nullptr, mappingSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (mapping_ == MAP_FAILED) {
+            LogLine(LogLevel::ERROR) << "Error mapping spool " << path << ": " << std::strerror(errno);
+            return false;
+        }
+        header_ = static_cast<SpoolFileHeader*>(mapping_);
+        reuse = reuse && std::memcmp(header_->magic, MAGIC, sizeof(MAGIC)) == 0 && header_->version == 1 &&
+                header_->recordSize == sizeof(SpoolRecord) && header_->firstBed == firstBed &&
+                header_->bedCount == static_cast<uint32_t>(bedCount) && header_->recordsPerBed == recordsPerBed;
+        if (!reuse) {
+            std::memset(mapping_, 0, sizeof(SpoolFileHeader) + bedCount * sizeof(SpoolRingHeader));
+            std::memcpy(header_->magic, MAGIC, sizeof(MAGIC));
+            header_->version = 1;
+            header_->recordSize = sizeof(SpoolRecord);
+            header_->firstBed = firstBed;
+            header_->bedCount = static_cast<uint32_t>(bedCount);
+            header_->recordsPerBed = recordsPerBed;
+        }
+        uint64_t buffered = 0;
+        for (int slot = 0; slot < bedCount; ++slot) {
+            buffered += ring(firstBed + slot).size();
+        }
+        LogLine(LogLevel::INFO) << "Spool " << path << ": " << recordsPerBed << " records per bed, "
+                  << buffered << " buffered from a previous run";
+        return true;
+    }
+
+    /**
+     * @brief Ring for a bed.
+     * @param instanceNumber Device instance number within the opened range.
+     */
+    SpoolRing ring(int instanceNumber) {
+        auto* base = static_cast<char*>(mapping_);
+        size_t slot = static_cast<size_t>(instanceNumber - header_->firstBed);
+        auto* ringHeaders = reinterpret_cast<SpoolRingHeader*>(base + sizeof(SpoolFileHeader));
+        auto* records = reinterpret_cast<SpoolRecord*>(base + sizeof(SpoolFileHeader) + header_->bedCount * sizeof(SpoolRingHeader));
+        return SpoolRing(&ringHeaders[slot], records + slot * header_->recordsPerBed, header_->recordsPerBed);
+    }
+
+    /**
+     * @brief Flush the mapping to disk every interval on a background thread.
+     * @param interval Checkpoint interval.
+     */
+    void startCheckpoints(std::chrono::seconds interval) {
+        checkpointThread_ = std::thread([this, interval] {
+            auto next = std::chrono::steady_clock::now() + interval;
+            while (!stopping_) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                if (std::chrono::steady_clock::now() >= next) {
+                    msync(mapping_, mappingSize_, MS_ASYNC);
+                    next += interval;
+                }
+            }
+        });
+    }
+};
+
+constexpr char SpoolFile::MAGIC[8];
+
+// --- Telemetry Trace ---
+
+/**
+ * @brief One sample as captured for a trace, before it is laid out in columns.
+ */
+struct TraceRecord {
+    int64_t epochNanos;
+    float heartRate;
+    float spo2;
+    float inclination;
+    uint32_t device; // Index into the trace's device table
+    uint8_t state;
+};
+
+/**
+ * @brief Trace file header; followed by fixed-size column blocks and then the device table.
+ * A block holds TRACE_BLOCK_RECORDS records as five columns: int64 epoch-ns timestamps, float
+ * heart rate, SpO2 and inclination, uint32 device index, uint8 state. The last block is zero-padded.
+ */
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t blockRecords;
+    uint64_t recordCount;
+    uint64_t blockCount;
+    uint32_t deviceCount; // int32 instance numbers after the last block
+    uint32_t reserved;
+    int64_t startNanos;   // Earliest timestamp in the trace
+    uint8_t padding[16];  // Keeps the blocks 64-byte aligned
+};
+
+constexpr char TRACE_MAGIC[8] = {'P', 'B', 'T', 'R', 'A', 'C', 'E', '1'};
+
+/**
+ * @brief Bytes of one column block.
+ */
+constexpr size_t traceBlockBytes(size_t records) {
+    return records * (sizeof(int64_t) + 3 * sizeof(float) + sizeof(uint32_t) + sizeof(uint8_t));
+}
+
+/**
+ * @brief Appends samples to a trace file (--record). Workers hand over their samples once per
+ * tick; the header and device table are written by close(), so an interrupted recording is unreadable.
+ */
+class TraceRecorder {
+    std::mutex mutex_;
+    int fd_ = -1;
+    std::string path_;
+    std::vector<char> block_ = std::vector<char>(traceBlockBytes(TRACE_BLOCK_RECORDS));
+    size_t inBlock_ = 0;
+    uint64_t records_ = 0;
+    uint64_t blocks_ = 0;
+    int64_t startNanos_ = std::numeric_limits<int64_t>::max();
+    std::unordered_map<int, uint32_t> deviceIndex_;
+    std::vector<int32_t> devices_;
+
+    template <typename T>
+    T* column(size_t offset) { return reinterpret_cast<T*>(block_.data() + offset * TRACE_BLOCK_RECORDS); }
+
+    bool writeAll(const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = ::write(fd_, bytes, size);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                LogLine(LogLevel::ERROR) << "Error writing trace " << path_ << ": " << std::strerror(errno) << ", recording stopped.";
+                ::close(fd_);
+                fd_ = -1;
+                return false;
+            }
+            bytes += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    void writeBlock() {
+        if (fd_ >= 0 && writeAll(block_.data(), block_.size())) ++blocks_;
+        std::fill(block_.begin(), block_.end(), 0);
+        inBlock_ = 0;
+    }
+
+public:
+    TraceRecorder() = default;
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    ~TraceRecorder() { close(); }
+
+    /**
+     * @brief Create (or truncate) the trace file.
+     * @param path File path.
+     * @return true on success.
+     */
+    bool open(const std::string& path) {
+        path_ = path;
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            LogLine(LogLevel::ERROR) << "Error opening trace " << path << ": " << std::strerror(errno);
+            return false;
+        }
+        TraceFileHeader header{}; // Placeholder until close()
+        if (!writeAll(&header, sizeof(header))) return false;
+        LogLine(LogLevel::INFO) << "Recording samples to " << path;
+        return true;
+    }
+
+    /**
+     * @brief Intern a bed in the device table.
+     * @param instanceNumber Device instance number.
+     * @return uint32_t Device index for TraceRecord::device.
+     */
+    uint32_t intern(int instanceNumber) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto inserted = deviceIndex_.emplace(instanceNumber, static_cast<uint32_t>(devices_.size()));
+        if (inserted.second) devices_.push_back(instanceNumber);
+        return inserted.first->second;
+    }
+
+    /**
+     * @brief Append records, writing every block that fills up.
+     * @param records Records in publish order.
+     * @param count Number of records.
+     */
+    void append(const TraceRecord* records, size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (fd_ < 0) return;
+        size_t offset = 0;
+        auto* epochNanos = column<int64_t>(offset);
+        auto* heartRate = column<float>(offset += sizeof(int64_t));
+        auto* spo2 = column<float>(offset += sizeof(float));
+        auto* inclination = column<float>(offset += sizeof(float));
+        auto* device = column<uint32_t>(offset += sizeof(float));
+        auto* state = column<uint8_t>(offset += sizeof(uint32_t));
+        for (size_t i = 0; i < count; ++i) {
+            const TraceRecord& record = records[i];
+            epochNanos[inBlock_] = record.epochNanos;
+            heartRate[inBlock_] = record.heartRate;
+            spo2[inBlock_] = record.spo2;
+            inclination[inBlock_] = record.inclination;
+            device[inBlock_] = record.device;
+            state[inBlock_] = record.state;
+            startNanos_ = std::min(startNanos_, record.epochNanos);
+            ++records_;
+            if (++inBlock_ == TRACE_BLOCK_RECORDS) {
+                writeBlock();
+                if (fd_ < 0) return;
+            }
+        }
+    }
+
+    /**
+     * @brief Write the partial last block, the device table and the header, and close the file.
+     */
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (fd_ < 0) return;
+        if (inBlock_ > 0) writeBlock();
+        if (fd_ < 0 || !writeAll(devices_.data(), devices_.size() * sizeof(int32_t))) return;
+        TraceFileHeader header{};
+        std::memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        header.version = 1;
+        header.blockRecords = static_cast<uint32_t>(TRACE_BLOCK_RECORDS);
+        header.recordCount = records_;
+        header.blockCount = blocks_;
+        header.deviceCount = static_cast<uint32_t>(devices_.size());
+        header.startNanos = records_ > 0 ? startNanos_ : 0;
+        if (pwrite(fd_, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+            LogLine(LogLevel::ERROR) << "Error writing trace " << path_ << ": " << std::strerror(errno);
+        } else {
+            LogLine(LogLevel::INFO) << "Recorded " << records_ << " samples of " << devices_.size() << " beds to " << path_;
+        }
+        ::close(fd_);
+        fd_ = -1;
+    }
+};
+
+/**
+ * @brief Columns of one trace block, pointing into the mapping.
+ */
+struct TraceBlock {
+    const int64_t* epochNanos;
+    const float* heartRate;
+    const float* spo2;
+    const float* inclination;
+    const uint32_t* device;
+    const uint8_t* state;
+    size_t count;
+};
+
+/**
+ * @brief Read-only memory mapping of a trace written by TraceRecorder (--replay).
+ * Records are read in place: replaying a sample costs a few loads, not a parse.
+ */
+class TraceFile {
+    void* mapping_ = MAP_FAILED;
+    size_t mappingSize_ = 0;
+    const TraceFileHeader* header_ = nullptr;
+    const int32_t* devices_ = nullptr;
+
+public:
+    TraceFile() = default;
+    TraceFile(const TraceFile&) = delete;
+    TraceFile& operator=(const TraceFile&) = delete;
+
+    ~TraceFile() {
+        if (mapping_ != MAP_FAILED) munmap(mapping_, mappingSize_);
+    }
+
+    /**
+     * @brief Map a trace and validate its layout.
+     * @param path File path.
+     * @return true on success.
+     */
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            LogLine(LogLevel::ERROR) << "Error opening trace " << path << ": " << std::strerror(errno);
+            return false;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TraceFileHeader)) {
+            LogLine(LogLevel::ERROR) << "Trace " << path << " is truncated or unreadable.";
+            ::close(fd);
+            return false;
+        }
+        mappingSize_ = static_cast<size_t>(st.st_size);
+        mapping_ = mmap(nullptr, mappingSize_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping_ == MAP_FAILED) {
+            LogLine(LogLevel::ERROR) << "Error mapping trace " << path << ": " << std::strerror(errno);
+            return false;
+        }
+        madvise(mapping_, mappingSize_, MADV_SEQUENTIAL);
+        header_ = static_cast<const TraceFileHeader*>(mapping_);
+        size_t expected = sizeof(TraceFileHeader) + header_->blockCount * traceBlockBytes(header_->blockRecords) +
+                          header_->deviceCount * sizeof(int32_t);
+        if (std::memcmp(header_->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || header_->version != 1 ||
+            header_->blockRecords != TRACE_BLOCK_RECORDS || header_->blockCount != (header_->recordCount + TRACE_BLOCK_RECORDS - 1) / TRACE_BLOCK_RECORDS ||
+            mappingSize_ != expected) {
+            LogLine(LogLevel::ERROR) << "Trace " << path << " is not a complete trace recording.";
+            return false;
+        }
+        devices_ = reinterpret_cast<const int32_t*>(static_cast<const char*>(mapping_) + expected - header_->deviceCount * sizeof(int32_t));
+        LogLine(LogLevel::INFO) << "Trace " << path << ": " << header_->recordCount << " samples of " << header_->deviceCount << " beds";
+        return true;
+    }
+
+    uint64_t recordCount() const { return header_->recordCount; }
+    uint64_t blockCount() const { return header_->blockCount; }
+    uint32_t deviceCount() const { return header_->deviceCount; }
+    int instanceNumber(uint32_t device) const { return devices_[device]; }
+
+    /**
+     * @brief Earliest recorded timestamp: replay time zero.
+     */
+    std::chrono::system_clock::time_point start() const {
+        return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(header_->startNanos)));
+    }
+
+    /**
+     * @brief Columns of one block.
+     * @param index Block index (< blockCount()).
+     */
+    TraceBlock block(uint64_t index) const {
+        const char* base = static_cast<const char*>(mapping_) + sizeof(TraceFileHeader) + index * traceBlockBytes(TRACE_BLOCK_RECORDS);
+        size_t offset = 0;
+        TraceBlock block{};
+        block.epochNanos = reinterpret_cast<const int64_t*>(base);
+        block.heartRate = reinterpret_cast<const float*>(base + (offset += sizeof(int64_t) * TRACE_BLOCK_RECORDS));
+        block.spo2 = reinterpret_cast<const float*>(base + (offset += sizeof(float) * TRACE_BLOCK_RECORDS));
+        block.inclination = reinterpret_cast<const float*>(base + (offset += sizeof(float) * TRACE_BLOCK_RECORDS));
+        block.device = reinterpret_cast<const uint32_t*>(base + (offset += sizeof(float) * TRACE_BLOCK_RECORDS));
+        block.state = reinterpret_cast<const uint8_t*>(base + (offset += sizeof(uint32_t) * TRACE_BLOCK_RECORDS));
+        block.count = std::min<uint64_t>(TRACE_BLOCK_RECORDS, header_->recordCount - index * TRACE_BLOCK_RECORDS);
+        return block;
+    }
+};
+
+/**
+ * @brief Print the encoded size of a representative sample for every encoding.
+ * @param deviceId Device ID used in the sample.
+ * @param selected Encoding in use.
+ */
+void reportEncodingSizes(const std::string& deviceId, PayloadEncoding selected) {
+    Telemetry sample(deviceId, 72.123456789012, 97.987654321098, MEAL_INCLINATION_DEGREES, BedInclinationState::INCLINED);
+    LogLine line(LogLevel::INFO);
+    line << "Payload bytes per message:";
+    for (PayloadEncoding encoding : {PayloadEncoding::JSON, PayloadEncoding::JSON_PRETTY, PayloadEncoding::CBOR, PayloadEncoding::MSGPACK}) {
+        line << " " << encodingName(encoding) << "=" << sample.encode(encoding).size()
+             << (encoding == selected ? " (selected)" : "");
+    }
+}
+
+/**
+ * @brief Monotonic counter read lazily by the metrics endpoint.
+ * add() is for a counter owned by one thread (no locked instruction); addShared() for counters
+ * updated from several threads, such as Paho callbacks.
+ */
+class MetricCounter {
+    std::atomic<uint64_t> value_{0};
+public:
+    void add(uint64_t n = 1) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void addShared(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+};
+
+/**
+ * @brief Latency histogram with power-of-two microsecond buckets (1 us .. ~4 s, then +Inf).
+ * Recording is one bit-width computation and one counter update.
+ */
+class LatencyHistogram {
+    MetricCounter buckets_[METRIC_HISTOGRAM_BUCKETS];
+    MetricCounter sumNanos_;
+
+    static size_t bucketOf(uint64_t nanos) {
+        uint64_t micros = (nanos + 999) / 1000;
+        size_t bucket = 0;
+        for (uint64_t rest = micros > 1 ? micros - 1 : 0; rest != 0; rest >>= 1) ++bucket; // Bit width: micros <= 2^bucket
+        return std::min(bucket, METRIC_HISTOGRAM_BUCKETS - 1);
+    }
+
+public:
+    void observe(std::chrono::nanoseconds elapsed) {
+        uint64_t nanos = static_cast<uint64_t>(std::max<int64_t>(0, elapsed.count()));
+        buckets_[bucketOf(nanos)].add();
+        sumNanos_.add(nanos);
+    }
+
+    void observeShared(std::chrono::nanoseconds elapsed) {
+        uint64_t nanos = static_cast<uint64_t>(std::max<int64_t>(0, elapsed.count()));
+        buckets_[bucketOf(nanos)].addShared();
+        sumNanos_.addShared(nanos);
+    }
+
+    /**
+     * @brief Add this histogram's buckets (non-cumulative) and sum into accumulators.
+     */
+    void accumulate(std::vector<uint64_t>& buckets, uint64_t& sumNanos) const {
+        buckets.resize(METRIC_HISTOGRAM_BUCKETS, 0);
+        for (size_t i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i) buckets[i] += buckets_[i].value();
+        sumNanos += sumNanos_.value();
+    }
+
+    /**
+     * @brief Upper bound of a bucket in seconds, for the Prometheus "le" label.
+     */
+    static double bucketBoundSeconds(size_t bucket) { return static_cast<double>(1ull << bucket) / 1e6; }
+};
+
+/**
+ * @brief Counters updated only by one worker thread.
+ */
+struct WorkerMetrics {
+    MetricCounter messagesPublished;
+    MetricCounter samplesPublished;
+    MetricCounter samplesDropped;  // Not published and not buffered, or overwritten in a full spool
+    MetricCounter samplesBuffered; // Written to the spool
+    MetricCounter samplesReplayed; // Published from the spool
+    MetricCounter statesPublished; // State events on the /state stream
+    MetricCounter summariesPublished; // Window summaries on the /summary stream
+    MetricCounter summariesDropped;   // Window summaries not sent: disconnected, throttled or failed
+    MetricCounter commandsApplied;    // --commands: commands that changed a bed's state machine
+    MetricCounter commandsRejected;   // Malformed, unknown or out-of-range commands (acked as rejected)
+    MetricCounter acksPublished;      // Command acks on the /cmd/ack stream
+    MetricCounter publishesThrottled; // Messages held back or dropped because a publish-rate bucket was empty
+    MetricCounter samplesCoalesced;   // Held samples replaced by a newer one before a token was available
+    MetricCounter waveformSamples;
+    MetricCounter waveformCpuNanos;
+    LatencyHistogram serialize;
+};
+
+/**
+ * @brief Process-wide counters updated from the scheduler and Paho callback threads.
+ */
+struct FleetMetrics {
+    MetricCounter connects;          // connected() callbacks, including automatic reconnects
+    MetricCounter connectionsLost;
+    MetricCounter loopOverruns;      // Scheduler ticks started more than one tick late
+    MetricCounter publishRetries;    // MQTT v5: failed PUBACKs queued for another attempt
+    MetricCounter publishFailures;   // MQTT v5: failed PUBACKs not retried (permanent reason code or retries exhausted)
+    LatencyHistogram publishToAck;   // Sampled: one message per bed per round trip
+    LatencyHistogram schedulerLag;   // How late each scheduler tick started
+    LatencyHistogram connectTime;    // Initial connect, from start to CONNACK
+    MetricCounter influxLinesWritten; // InfluxDB sink writer thread
+    MetricCounter influxLinesDropped; // Rejected by InfluxDB, unreachable, or queue full
+    LatencyHistogram influxWrite;    // One batch: compress, POST, response (including retries)
+    LatencyHistogram commandRoundTrip; // --command-rate: command sent to its ack received
+};
+
+FleetMetrics& fleetMetrics() {
+    static FleetMetrics metrics;
+    return metrics;
+}
+
+/**
+ * @brief Bounded window of QoS1 publishes awaiting PUBACK.
+ * A limit of 0 disables the window; publishes then block on their token as before.
+ * Each reservation is keyed by its message and tagged with the session it was made in, so acks or
+ * failures that arrive after reset() for the lost session's messages do not free the new session's
+ * slots. One probe message at a time is timed from acquire() to its own release() and recorded in
+ * the publish-to-ack histogram.
+ */
+class PublishWindow {
+    std::mutex mutex_;
+    std::condition_variable slotFreed_;
+    int inFlight_ = 0;
+    int limit_;
+    uint32_t generation_ = 0; // Incremented by reset(): one per session
+    std::unordered_map<const void*, uint32_t> reservations_; // Message -> generation it was reserved in
+    const void* probe_ = nullptr; // Message being timed, nullptr = no probe outstanding
+    std::chrono::steady_clock::time_point probeSentAt_;
+public:
+    /**
+     * @brief Construct a window.
+     * @param limit Maximum unacknowledged messages (0 = synchronous publishing).
+     */
+    explicit PublishWindow(int limit) : limit_(limit) {}
+
+    bool enabled() const { return limit_ > 0; }
+
+    /**
+     * @brief Reserve a slot for a message, blocking only while the window is full.
+     * @param message The message about to be published; its token's release() must pass the same pointer.
+     * @param timeout Maximum time to wait for a slot.
+     * @return true if a slot was reserved.
+     */
+    bool acquire(const mqtt::message* message, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!slotFreed_.wait_for(lock, timeout, [this] { return inFlight_ < limit_; })) {
+            return false;
+        }
+        ++inFlight_;
+        reservations_[message] = generation_;
+        if (probe_ == nullptr) {
+            probe_ = message;
+            probeSentAt_ = std::chrono::steady_clock::now();
+        }
+        return true;
+    }
+
+    /**
+     * @brief Return a message's slot once it is acknowledged (or failed to send).
+     * Messages without a reservation (QoS 0, or already released) are ignored, and so are those
+     * reserved before the last reset(), whose slots that reset already freed.
+     * @param message The message passed to acquire().
+     * @param acknowledged false when the message never reached Paho; cancels a pending probe.
+     */
+    void release(const mqtt::message* message, bool acknowledged = true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto reservation = reservations_.find(message);
+            if (reservation == reservations_.end()) return;
+            bool current = reservation->second == generation_;
+            reservations_.erase(reservation);
+            if (!current) return;
+            if (inFlight_ > 0) --inFlight_;
+            if (message == probe_) {
+                probe_ = nullptr;
+                if (acknowledged) fleetMetrics().publishToAck.observeShared(std::chrono::steady_clock::now() - probeSentAt_);
+            }
+        }
+        slotFreed_.notify_one();
+    }
+
+    /**
+     * @brief Drop all reservations, e.g. when the session is lost and pending acks will never arrive.
+     * Late completions for the lost session's messages are ignored by release().
+     */
+    void reset() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++generation_;
+            inFlight_ = 0;
+            probe_ = nullptr;
+            // Keep only the session just lost: Paho completes or frees older tokens long before the next loss
+            for (auto reservation = reservations_.begin(); reservation != reservations_.end();) {
+                reservation = generation_ - reservation->second > 1 ? reservations_.erase(reservation) : std::next(reservation);
+            }
+        }
+        slotFreed_.notify_all();
+    }
+
+    int inFlight() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return inFlight_;
+    }
+};
+
+/**
+ * @brief Lock-free token bucket for publish rates, kept as one atomic "theoretical arrival time"
+ * (GCRA) so every thread can draw from the same fleet-wide bucket without a mutex.
+ * A rate of 0 disables the limit. configure() must run before any thread draws from it.
+ */
+class RateLimiter {
+    std::atomic<int64_t> fullAt_{0}; // steady_clock nanoseconds at which the bucket is full again
+    int64_t interval_ = 0;           // Nanoseconds per token; 0 = unlimited
+    int64_t tolerance_ = 0;          // How far fullAt_ may run ahead of now: the burst beyond one token
+
+public:
+    /**
+     * @brief Set the refill rate and depth; the bucket starts full.
+     * @param rate Tokens per second (0 = unlimited).
+     * @param burst Capacity in tokens (at least 1).
+     */
+    void configure(double rate, double burst) {
+        interval_ = rate > 0.0 ? std::max<int64_t>(1, static_cast<int64_t>(1e9 / rate)) : 0;
+        tolerance_ = static_cast<int64_t>((std::max(burst, 1.0) - 1.0) * interval_);
+        fullAt_.store(0, std::memory_order_relaxed);
+    }
+
+    bool enabled() const { return interval_ > 0; }
+
+    /**
+     * @brief Take one token if available.
+     * @param now Current steady time.
+     * @return true if taken.
+     */
+    bool tryTake(std::chrono::steady_clock::time_point now) {
+        if (interval_ == 0) return true;
+        int64_t nowNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        int64_t fullAt = fullAt_.load(std::memory_order_relaxed);
+        while (true) {
+            int64_t base = std::max(fullAt, nowNanos);
+            if (base - nowNanos > tolerance_) return false;
+            if (fullAt_.compare_exchange_weak(fullAt, base + interval_, std::memory_order_relaxed)) return true;
+        }
+    }
+
+    /**
+     * @brief Return a token taken by tryTake() that was not used.
+     */
+    void refund() {
+        if (interval_ > 0) fullAt_.fetch_sub(interval_, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * @brief Publish bucket shared by every connection (--fleet-publish-rate): the account-wide quota.
+ */
+RateLimiter& fleetPublishLimit() {
+    static RateLimiter limit;
+    return limit;
+}
+
+/**
+ * @brief MQTT v5 outcome of a bed's QoS>0 publishes, from the PUBACK reason code.
+ * Releases the in-flight slot (delivery_complete skips tokens whose context this class owns).
+ * Transient failures (quota, server-side, lost connection) are queued for the bed's worker to
+ * republish; permanent ones (not authorized, invalid topic, too large) are counted and dropped.
+ */
+class PublishOutcome : public mqtt::iaction_listener {
+public:
+    struct Retry {
+        TelemetryStream stream;
+        int attempt;
+        std::string payload;
+    };
+
+private:
+    // Paho user contexts: one address per (stream, attempt), decoded from its offset
+    inline static char contexts_[TELEMETRY_STREAM_COUNT * (MAX_PUBLISH_RETRIES + 1)];
+
+    PublishWindow& window_;
+    const std::string& clientId_;
+    std::mutex mutex_;
+    std::vector<Retry> retries_;
+    std::atomic<bool> retriesPending_{false};
+    std::atomic<bool> aliasesInvalid_{false};
+
+    static bool retryable(int reasonCode) {
+        switch (reasonCode) {
+        case mqtt::ReasonCode::NOT_AUTHORIZED:
+        case mqtt::ReasonCode::TOPIC_NAME_INVALID:
+        case mqtt::ReasonCode::PACKET_TOO_LARGE:
+        case mqtt::ReasonCode::PAYLOAD_FORMAT_INVALID:
+            return false;
+        default:
+            return true; // Quota exceeded, unspecified/implementation-specific, invalid alias, or no PUBACK (connection lost)
+        }
+    }
+
+    static const mqtt::message* messageOf(const mqtt::token& tok) {
+        const auto* delivery = dynamic_cast<const mqtt::delivery_token*>(&tok);
+        return delivery ? delivery->get_message().get() : nullptr;
+    }
+
+    void on_success(const mqtt::token& tok) override { window_.release(messageOf(tok)); }
+
+    void on_failure(const mqtt::token& tok) override {
+        window_.release(messageOf(tok), false);
+        int reasonCode = tok.get_reason_code();
+        if (reasonCode == mqtt::ReasonCode::TOPIC_ALIAS_INVALID) {
+            aliasesInvalid_.store(true, std::memory_order_release); // Resend full topics before trusting aliases again
+        }
+        size_t offset = static_cast<size_t>(static_cast<const char*>(tok.get_user_context()) - contexts_);
+        TelemetryStream stream = static_cast<TelemetryStream>(offset / (MAX_PUBLISH_RETRIES + 1));
+        int attempt = static_cast<int>(offset % (MAX_PUBLISH_RETRIES + 1));
+        const auto* delivery = dynamic_cast<const mqtt::delivery_token*>(&tok);
+        bool retry = retryable(reasonCode) && attempt < MAX_PUBLISH_RETRIES && delivery && delivery->get_message();
+
+        static LogThrottle throttle; // A broker-side quota hits the whole fleet at once
+        LogLine(LogLevel::WARN, throttle) << "Publish on " << streamName(stream) << " for " << clientId_ << " failed: "
+                                          << mqtt::exception::reason_code_str(reasonCode) << (retry ? ", retrying" : ", dropped");
+        if (!retry) {
+            fleetMetrics().publishFailures.addShared();
+            return;
+        }
+        fleetMetrics().publishRetries.addShared();
+        std::lock_guard<std::mutex> lock(mutex_);
+        retries_.push_back({stream, attempt + 1, delivery->get_message()->get_payload_str()});
+        retriesPending_.store(true, std::memory_order_release);
+    }
+
+public:
+    /**
+     * @brief Construct an outcome handler.
+     * @param window Bed's in-flight window.
+     * @param clientId Bed's client ID, for log lines; must outlive this object.
+     */
+    PublishOutcome(PublishWindow& window, const std::string& clientId) : window_(window), clientId_(clientId) {}
+
+    static void* context(TelemetryStream stream, int attempt) {
+        return &contexts_[static_cast<size_t>(stream) * (MAX_PUBLISH_RETRIES + 1) + static_cast<size_t>(attempt)];
+    }
+
+    static bool owns(const void* context) {
+        auto address = reinterpret_cast<uintptr_t>(context);
+        auto begin = reinterpret_cast<uintptr_t>(contexts_);
+        return address >= begin && address < begin + sizeof(contexts_);
+    }
+
+    bool retriesPending() const { return retriesPending_.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Move queued retries into out (which is cleared first).
+     */
+    void takeRetries(std::vector<Retry>& out) {
+        out.clear();
+        std::lock_guard<std::mutex> lock(mutex_);
+        out.swap(retries_);
+        retriesPending_.store(false, std::memory_order_release);
+    }
+
+    /**
+     * @brief Whether the broker rejected a topic alias since the last call.
+     */
+    bool takeAliasesInvalid() { return aliasesInvalid_.exchange(false, std::memory_order_acq_rel); }
+};
+
+/**
+ * @brief MQTT callback handler for connection events and message delivery.
+ */
+class callback : public virtual mqtt::callback {
+    mqtt::async_client& cli_;
+    PublishWindow& window_;
+    std::function<void(const mqtt::const_message_ptr&)> messageHandler_;
+    std::atomic<uint32_t> connections_{0};
+    std::mutex subscriptionsMutex_;
+    std::vector<std::pair<std::string, int>> subscriptions_; // Topic filter and QoS, renewed on every reconnect
+    void connected(const std::string& cause) override {
+        static LogThrottle throttle; // A fleet (re)connects every bed at once
+        LogLine(LogLevel::INFO, throttle) << "Connection success";
+        fleetMetrics().connects.addShared();
+        if (connections_.fetch_add(1, std::memory_order_release) > 0) {
+            resubscribe(); // Clean session: the broker forgot them
+        }
+    }
+    void resubscribe() {
+        std::lock_guard<std::mutex> lock(subscriptionsMutex_);
+        for (const auto& subscription : subscriptions_) {
+            try {
+                cli_.subscribe(subscription.first, subscription.second);
+            } catch (const mqtt::exception& exc) {
+                static LogThrottle throttle;
+                LogLine(LogLevel::ERROR, throttle) << "Error resubscribing to " << subscription.first << ": " << exc.what();
+            }
+        }
+    }
+    void connection_lost(const std::string& cause) override {
+        fleetMetrics().connectionsLost.addShared();
+        static LogThrottle throttle;
+        LogLine(LogLevel::WARN, throttle) << "Connection lost: " << cause;
+        window_.reset(); // Clean session: outstanding PUBACKs will not arrive
+    }
+    void message_arrived(mqtt::const_message_ptr msg) override {
+        if (messageHandler_) {
+            messageHandler_(msg);
+            return;
+        }
+        LogLine(LogLevel::INFO) << "Message arrived on topic: " << msg->get_topic() << " payload: " << msg->to_string();
+    }
+    void delivery_complete(mqtt::delivery_token_ptr tok) override {
+        mqtt::const_message_ptr msg = tok ? tok->get_message() : nullptr;
+        if (tok && PublishOutcome::owns(tok->get_user_context())) return; // Released by PublishOutcome
+        if (window_.enabled() && msg) { // QoS 0 frames never held a window slot, so release() ignores them
+            window_.release(msg.get());
+        }
+    }
+public:
+    /**
+     * @brief Construct a new callback object.
+     * @param client Reference to MQTT async client.
+     * @param window In-flight window released as PUBACKs arrive.
+     */
+    callback(mqtt::async_client& client, PublishWindow& window) : cli_(client), window_(window) {}
+
+    /**
+     * @brief Route incoming messages to a handler instead of logging them (nullptr restores logging).
+     * Set before subscribing; Paho calls it from its own thread.
+     */
+    void setMessageHandler(std::function<void(const mqtt::const_message_ptr&)> handler) { messageHandler_ = std::move(handler); }
+
+    /**
+     * @brief Remember a subscription so it is renewed after an automatic reconnect.
+     */
+    void addSubscription(const std::string& topicFilter, int qos) {
+        std::lock_guard<std::mutex> lock(subscriptionsMutex_);
+        subscriptions_.emplace_back(topicFilter, qos);
+    }
+
+    /**
+     * @brief Successful connections so far; changes on every automatic reconnect.
+     */
+    uint32_t connections() const { return connections_.load(std::memory_order_acquire); }
+};
+
+/**
+ * @brief One load-test step: how many beds publish and how fast.
+ */
+struct LoadStep {
+    int beds;
+    double ratePerBed; // Messages per second per bed
+};
+
+/**
+ * @brief Parse a ramp such as "100x1,500x2,1000x5" (beds x messages/s per bed).
+ * @return true if every step is valid.
+ */
+bool parseRamp(const std::string& text, std::vector<LoadStep>& steps) {
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        LoadStep step{};
+        char separator = 0;
+        char trailing = 0;
+        if (std::sscanf(item.c_str(), "%d%c%lf%c", &step.beds, &separator, &step.ratePerBed, &trailing) != 3 ||
+            separator != 'x' || step.beds <= 0 || step.ratePerBed <= 0.0) {
+            return false;
+        }
+        steps.push_back(step);
+    }
+    return !steps.empty();
+}
+
+/**
+ * @brief Command-line options selecting which beds run in this process.
+ */
+struct SimulatorOptions {
+    int firstBed = 0;
+    int lastBed = 0;
+    int workerThreads = 0; // 0 = choose from hardware concurrency
+    int maxInflight = 0;   // 0 = wait for each PUBACK before continuing
+    PayloadEncoding encoding = PayloadEncoding::JSON;
+    TimestampStyle timestampStyle = TimestampStyle::ISO8601_BASIC;
+    LogLevel logLevel = LogLevel::INFO;
+    int batchSize = 1;                        // Samples per message; 1 = no batching
+    std::chrono::milliseconds batchWindow{0}; // Publish a partial batch once its oldest sample is this old
+
+    bool reportOnChange = false;              // Send inclination/bedState only on transitions and heartbeats
+    bool splitStreams = false;                // Vitals on /vitals, state events on /state, instead of /data
+    std::array<int, TELEMETRY_STREAM_COUNT> streamQos{QOS, VITALS_QOS, QOS, WAVEFORM_QOS, SUMMARY_QOS, ACK_QOS}; // Indexed by TelemetryStream
+    std::chrono::seconds stateHeartbeat{DEFAULT_STATE_HEARTBEAT_SECONDS};
+    std::vector<std::chrono::seconds> aggregateWindows; // Empty = no edge aggregation
+    bool aggregateOnly = false;               // Publish summaries instead of raw samples
+    bool commands = false;                    // Subscribe to PatientBed/<n>/cmd and ack on /cmd/ack
+    double commandRate = 0.0;                 // Commands/s sent to the fleet's own beds to measure round trips; 0 = none
+    std::string spoolPath;                    // Empty = no store-and-forward
+    std::string mealSchedulePath;             // Empty = built-in meal_start_times for every bed
+    int spoolRecordsPerBed = DEFAULT_SPOOL_RECORDS_PER_BED;
+    int replayBurst = DEFAULT_REPLAY_BURST;
+    std::string recordPath;                   // Empty = no trace recording
+    std::string tracePath;                    // --replay: publish a recorded trace instead of simulating
+    double traceSpeed = 1.0;                  // Replay speed-up; 0 = as fast as the publish pipeline allows
+    SimClock::Mode clockMode = SimClock::Mode::REAL;
+    double clockSpeed = 1.0;                  // Virtual seconds per real second in SCALED mode
+    bool startTimeSet = false;
+    std::chrono::system_clock::time_point startTime; // Virtual wall-clock start
+    std::chrono::seconds duration{0};         // Simulated run length; 0 = forever
+    bool seedSet = false;
+    uint64_t seed = 0;
+    std::vector<LoadStep> ramp;               // Non-empty = load-test mode
+    std::chrono::seconds stepDuration{DEFAULT_LOAD_STEP_SECONDS};
+    bool loopback = false;                    // Load test: subscribe to own topics for publish->delivery latency
+    int metricsPort = 0;                      // 0 = no Prometheus endpoint
+    int coordinatorPort = 0;                  // --coordinator: assign --beds to agents connecting on this port
+    int agentCount = 0;                       // --agents: agents the coordinator waits for
+    std::string coordinatorAddress;           // --agent host:port: take beds, seed and start epoch from a coordinator
+    double connectRate = DEFAULT_CONNECT_RATE;             // Connects started per second at startup
+    int connectConcurrency = DEFAULT_CONNECT_CONCURRENCY;  // TLS handshakes in flight at startup
+    std::string certBundlePath;               // Empty = certs/device_<n>.pem.crt and .private.key per bed
+    int gateways = 0;                         // Shared connections carrying every bed's topics; 0 = one connection per bed
+    bool mqttSink = true;                     // --sink mqtt|influx|both
+    bool influxSink = false;
+    std::string influxUrl;
+    std::string influxOrg;
+    std::string influxBucket = "PatientBedData";
+    std::string influxToken;                  // Defaults to $INFLUX_TOKEN
+    size_t influxBatchLines = DEFAULT_INFLUX_BATCH_LINES;
+    std::chrono::milliseconds influxFlushInterval{DEFAULT_INFLUX_FLUSH_MS};
+    double publishRate = DEFAULT_CONNECTION_PUBLISH_RATE; // Publishes/s per connection; 0 = unlimited
+    double fleetPublishRate = 0.0;            // Publishes/s across the fleet (account quota); 0 = unlimited
+    ThrottlePolicy throttlePolicy = ThrottlePolicy::COALESCE;
+    bool mqtt5 = false;                       // MQTT v5 with topic aliases, content-type/expiry properties and PUBACK reason codes
+    int messageExpirySeconds = DEFAULT_MESSAGE_EXPIRY_SECONDS; // MQTT v5 message-expiry; 0 = none
+    bool waveform = false;                    // Also publish ECG/pleth frames on PatientBed/<n>/waveform
+    bool phaseSpread = true;                  // Offset each bed's schedule by a deterministic phase
+    std::chrono::milliseconds jitter{0};      // Bounded +/- jitter per sample
+
+    bool batching() const { return batchSize > 1 || batchWindow.count() > 0; }
+};
+
+/**
+ * @brief Print command-line usage.
+ * @param program Program name (argv[0]).
+ */
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " <device_instance_number (e.g., 1 or 2)>" << std::endl;
+    std::cerr << "       " << program << " --beds <first>-<last> [--workers <n>]" << std::endl;
+    std::cerr << "       " << program << " --coordinator <port> --agents <n> --beds <first>-<last>" << std::endl;
+    std::cerr << "       " << program << " --agent <host>:<port> [options]" << std::endl;
+}
+
+/**
+ * @brief Parse a bed range of the form "N" or "FIRST-LAST".
+ * @param text Range text.
+ * @param firstBed Receives the first instance number.
+ * @param lastBed Receives the last instance number (inclusive).
+ * @return true if the range is well formed.
+ */
+bool parseBedRange(const std::string& text, int& firstBed, int& lastBed) {
+    try {
+        size_t pos = 0;
+        firstBed = std::stoi(text, &pos);
+        lastBed = firstBed;
+        if (pos < text.size()) {
+            if (text[pos] != '-') return false;
+            std::string rest = text.substr(pos + 1);
+            lastBed = std::stoi(rest, &pos);
+            if (pos != rest.size()) return false;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return firstBed > 0 && lastBed >= firstBed && (lastBed - firstBed) < MAX_FLEET_BEDS;
+}
+
+/**
+ * @brief Parse command-line arguments. Accepts "--name value" and "--name=value".
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @param options Receives parsed options.
+ * @return true on success.
+ */
+bool parseOptions(int argc, char* argv[], SimulatorOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            // Legacy form: a single device instance number
+            if (options.firstBed != 0 || !parseBedRange(arg, options.firstBed, options.lastBed)) return false;
+            continue;
+        }
+        std::string name = arg;
+        std::string value;
+        size_t eq = arg.find('=');
+        if (eq != std::string::npos) {
+            name = arg.substr(0, eq);
+            value = arg.substr(eq + 1);
+        } else if (name == "--report-on-change" || name == "--split-streams" || name == "--no-phase-spread" ||
+                   name == "--waveform" || name == "--loopback" || name == "--mqtt5" || name == "--aggregate-only" ||
+                   name == "--commands") {
+            // Flags without a value
+        } else if (i + 1 < argc) {
+            value = argv[++i];
+        }
+        try {
+            if (name == "--beds") {
+                if (!parseBedRange(value, options.firstBed, options.lastBed)) return false;
+            } else if (name == "--workers") {
+                options.workerThreads = std::stoi(value);
+                if (options.workerThreads <= 0) return false;
+            } else if (name == "--encoding") {
+                if (!parseEncoding(value, options.encoding)) return false;
+            } else if (name == "--timestamp") {
+                if (value == "iso8601") {
+                    options.timestampStyle = TimestampStyle::ISO8601_BASIC;
+                } else if (value == "rfc3339") {
+                    options.timestampStyle = TimestampStyle::RFC3339_MILLIS;
+                } else {
+                    return false;
+                }
+            } else if (name == "--log-level") {
+                if (!parseLogLevel(value, options.logLevel)) return false;
+            } else if (name == "--batch-size") {
+                options.batchSize = std::stoi(value);
+                if (options.batchSize < 1 || options.batchSize > MAX_BATCH_SIZE) return false;
+            } else if (name == "--batch-window") {
+                options.batchWindow = std::chrono::milliseconds(std::stol(value));
+                if (options.batchWindow.count() < 0) return false;
+            } else if (name == "--report-on-change") {
+                options.reportOnChange = true;
+            } else if (name == "--split-streams") {
+                options.splitStreams = true;
+            } else if (name == "--qos") {
+                if (!parseStreamQos(value, options.streamQos)) return false;
+            } else if (name == "--state-heartbeat") {
+                options.stateHeartbeat = std::chrono::seconds(std::stol(value));
+                if (options.stateHeartbeat.count() <= 0) return false;
+            } else if (name == "--aggregate") {
+                if (!parseAggregateWindows(value, options.aggregateWindows)) return false;
+            } else if (name == "--aggregate-only") {
+                options.aggregateOnly = true;
+            } else if (name == "--meal-schedule") {
+                options.mealSchedulePath = value;
+                if (value.empty()) return false;
+            } else if (name == "--spool") {
+                options.spoolPath = value;
+                if (value.empty()) return false;
+            } else if (name == "--spool-capacity") {
+                options.spoolRecordsPerBed = std::stoi(value);
+                if (options.spoolRecordsPerBed <= 0) return false;
+            } else if (name == "--replay-burst") {
+                options.replayBurst = std::stoi(value);
+                if (options.replayBurst <= 0) return false;
+            } else if (name == "--record") {
+                options.recordPath = value;
+                if (value.empty()) return false;
+            } else if (name == "--replay") {
+                options.tracePath = value;
+                if (value.empty()) return false;
+            } else if (name == "--replay-speed") {
+                if (value == "max") {
+                    options.traceSpeed = 0.0;
+                } else {
+                    options.traceSpeed = std::stod(value);
+                    if (!(options.traceSpeed > 0.0)) return false;
+                }
+            } else if (name == "--speed") {
+                if (value == "max") {
+                    options.clockMode = SimClock::Mode::AS_FAST_AS_POSSIBLE;
+                } else {
+                    options.clockMode = SimClock::Mode::SCALED;
+                    options.clockSpeed = std::stod(value);
+                    if (options.clockSpeed <= 0.0) return false;
+                }
+            } else if (name == "--start-time") {
+                std::tm tm_start{};
+                const char* end = strptime(value.c_str(), "%Y-%m-%dT%H:%M:%S", &tm_start);
+                if (end == nullptr || *end != '\0') return false;
+                tm_start.tm_isdst = -1; // Interpreted as local system time, like the meal schedule
+                options.startTime = std::chrono::system_clock::from_time_t(std::mktime(&tm_start));
+                options.startTimeSet = true;
+                if (options.clockMode == SimClock::Mode::REAL) options.clockMode = SimClock::Mode::SCALED;
+            } else if (name == "--duration") {
+                options.duration = std::chrono::seconds(std::stol(value));
+                if (options.duration.count() < 0) return false;
+            } else if (name == "--seed") {
+                options.seed = std::stoull(value);
+                options.seedSet = true;
+            } else if (name == "--metrics-port") {
+                options.metricsPort = std::stoi(value);
+                if (options.metricsPort < 0 || options.metricsPort > 65535) return false;
+            } else if (name == "--coordinator") {
+                options.coordinatorPort = std::stoi(value);
+                if (options.coordinatorPort <= 0 || options.coordinatorPort > 65535) return false;
+            } else if (name == "--agents") {
+                options.agentCount = std::stoi(value);
+                if (options.agentCount <= 0) return false;
+            } else if (name == "--agent") {
+                size_t colon = value.rfind(':');
+                if (colon == std::string::npos || colon == 0 || colon + 1 == value.size()) return false;
+                options.coordinatorAddress = value;
+            } else if (name == "--ramp") {
+                if (!parseRamp(value, options.ramp)) return false;
+            } else if (name == "--step-duration") {
+                options.stepDuration = std::chrono::seconds(std::stol(value));
+                if (options.stepDuration.count() <= 0) return false;
+            } else if (name == "--commands") {
+                options.commands = true;
+            } else if (name == "--command-rate") {
+                options.commandRate = std::stod(value);
+                if (!(options.commandRate > 0.0)) return false;
+                options.commands = true;
+            } else if (name == "--loopback") {
+                options.loopback = true;
+            } else if (name == "--waveform") {
+                options.waveform = true;
+            } else if (name == "--connect-rate") {
+                options.connectRate = std::stod(value);
+                if (!(options.connectRate > 0.0)) return false;
+            } else if (name == "--connect-concurrency") {
+                options.connectConcurrency = std::stoi(value);
+                if (options.connectConcurrency <= 0) return false;
+            } else if (name == "--publish-rate") {
+                options.publishRate = std::stod(value);
+                if (!(options.publishRate >= 0.0)) return false;
+            } else if (name == "--fleet-publish-rate") {
+                options.fleetPublishRate = std::stod(value);
+                if (!(options.fleetPublishRate >= 0.0)) return false;
+            } else if (name == "--throttle") {
+                if (value == "coalesce") {
+                    options.throttlePolicy = ThrottlePolicy::COALESCE;
+                } else if (value == "drop") {
+                    options.throttlePolicy = ThrottlePolicy::DROP;
+                } else {
+                    return false;
+                }
+            } else if (name == "--sink") {
+                if (value != "mqtt" && value != "influx" && value != "both") return false;
+                options.mqttSink = value != "influx";
+                options.influxSink = value != "mqtt";
+            } else if (name == "--influx-url") {
+                options.influxUrl = value;
+            } else if (name == "--influx-org") {
+                options.influxOrg = value;
+            } else if (name == "--influx-bucket") {
+                options.influxBucket = value;
+            } else if (name == "--influx-token") {
+                options.influxToken = value;
+            } else if (name == "--influx-batch") {
+                long lines = std::stol(value);
+                if (lines <= 0) return false;
+                options.influxBatchLines = static_cast<size_t>(lines);
+            } else if (name == "--influx-flush-ms") {
+                options.influxFlushInterval = std::chrono::milliseconds(std::stol(value));
+                if (options.influxFlushInterval.count() <= 0) return false;
+            } else if (name == "--gateways") {
+                options.gateways = std::stoi(value);
+                if (options.gateways < 0) return false;
+            } else if (name == "--cert-bundle") {
+                options.certBundlePath = value;
+            } else if (name == "--mqtt5") {
+                options.mqtt5 = true;
+            } else if (name == "--message-expiry") {
+                options.messageExpirySeconds = std::stoi(value);
+                if (options.messageExpirySeconds < 0) return false;
+            } else if (name == "--no-phase-spread") {
+                options.phaseSpread = false;
+            } else if (name == "--jitter-ms") {
+                options.jitter = std::chrono::milliseconds(std::stol(value));
+                if (options.jitter.count() < 0 || options.jitter.count() * 2 >= DATA_SEND_INTERVAL_SECONDS * 1000L) return false;
+            } else if (name == "--max-inflight") {
+                options.maxInflight = std::stoi(value);
+                if (options.maxInflight < 0 || options.maxInflight > MAX_INFLIGHT_LIMIT) return false;
+            } else {
+                std::cerr << "Unknown option: " << name << std::endl;
+                return false;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << name << ": " << value << std::endl;
+            return false;
+        }
+    }
+    if (!options.ramp.empty()) {
+        // Load tests run in real time with an in-flight window so publishes can overlap
+        if (options.clockMode != SimClock::Mode::REAL) return false;
+        if (options.maxInflight == 0) options.maxInflight = DEFAULT_LOAD_TEST_INFLIGHT;
+        if (!options.mqttSink) return false; // The load test measures the broker
+    }
+    if (options.influxSink) {
+        if (options.influxUrl.empty()) return false;
+        const char* token = std::getenv("INFLUX_TOKEN");
+        if (options.influxToken.empty() && token != nullptr) options.influxToken = token;
+    }
+    if (options.loopback) {
+        // Delivery latency is read back from the payload timestamp, which needs JSON and milliseconds
+        if (options.ramp.empty() || (options.encoding != PayloadEncoding::JSON && options.encoding != PayloadEncoding::JSON_PRETTY)) return false;
+        options.timestampStyle = TimestampStyle::RFC3339_MILLIS;
+    }
+    if (options.splitStreams) {
+        // The state stream carries transitions and heartbeats, so state is reported on change
+        options.reportOnChange = true;
+    }
+    if (options.aggregateOnly && options.aggregateWindows.empty()) {
+        parseAggregateWindows(DEFAULT_AGGREGATE_WINDOWS, options.aggregateWindows);
+    }
+    if (!options.tracePath.empty()) {
+        // A trace holds samples only, replayed on their recorded schedule: nothing is simulated
+        if (options.clockMode != SimClock::Mode::REAL || !options.ramp.empty() || options.splitStreams || options.waveform || options.commands) return false;
+    }
+    if (options.commands && (!options.mqttSink || !options.ramp.empty())) return false; // Commands drive the simulated state machines
+    if (options.coordinatorPort > 0 || options.agentCount > 0) {
+        // The coordinator only assigns beds and merges reports: it needs the fleet's range and its agents
+        if (options.coordinatorPort == 0 || options.agentCount == 0 || options.firstBed == 0 || !options.coordinatorAddress.empty()) return false;
+        if (options.agentCount > options.lastBed - options.firstBed + 1) return false;
+    }
+    if (!options.coordinatorAddress.empty()) {
+        // Beds come from the assignment; lockstep virtual time cannot be shared between hosts
+        if (options.firstBed != 0 || options.clockMode == SimClock::Mode::AS_FAST_AS_POSSIBLE || !options.ramp.empty() || !options.tracePath.empty()) return false;
+    }
+
+    if (options.batchWindow.count() > 0 && options.batchSize == 1) {
+        // Window only: size the batch to hold every sample the window can collect
+        long samplesPerWindow = options.batchWindow.count() / (DATA_SEND_INTERVAL_SECONDS * 1000L) + 1;
+        options.batchSize = static_cast<int>(std::min<long>(samplesPerWindow, MAX_BATCH_SIZE));
+    }
+    return options.firstBed != 0 || !options.tracePath.empty() || !options.coordinatorAddress.empty(); // A replay defaults to the trace's beds
+}
+
+/**
+ * @brief One MQTT client connection: a bed's own, or a gateway that carries the topics of many
+ * beds (--gateways). Everything on it is shared by its beds and safe to use from any worker thread.
+ */
+class MqttConnection {
+public:
+    std::string clientId;
+    std::string credentialName; // Section in --cert-bundle: "device <n>" or "gateway <n>"
+    std::string certPath;
+    std::string keyPath;
+    bool mqtt5;
+    bool gateway;              // Shared by several beds: no topic aliases, since the beds cannot share alias numbers
+    int topicAliasMaximum = 0; // MQTT v5: from the broker's CONNACK; 0 = no topic aliases
+    PublishWindow window;
+    RateLimiter publishLimit;  // Per-connection publish bucket (--publish-rate)
+    std::unique_ptr<mqtt::async_client> client;
+    std::unique_ptr<callback> cb;
+
+    /**
+     * @brief Construct a connection.
+     * @param id MQTT client ID.
+     * @param name Credential section name.
+     * @param cert Certificate file.
+     * @param key Private key file.
+     * @param maxInflight Unacknowledged QoS1 messages allowed on this connection (0 = synchronous).
+     * @param useMqtt5 Create an MQTT v5 client instead of 3.1.1.
+     * @param isGateway Whether several beds publish over this connection.
+     */
+    MqttConnection(std::string id, std::string name, std::string cert, std::string key, int maxInflight, bool useMqtt5, bool isGateway)
+        : clientId(std::move(id)),
+          credentialName(std::move(name)),
+          certPath(std::move(cert)),
+          keyPath(std::move(key)),
+          mqtt5(useMqtt5),
+          gateway(isGateway),
+          window(maxInflight),
+          client(useMqtt5 ? std::make_unique<mqtt::async_client>(SERVER_ADDRESS, clientId, mqtt::create_options(MQTTVERSION_5))
+                          : std::make_unique<mqtt::async_client>(SERVER_ADDRESS, clientId)),
+          cb(std::make_unique<callback>(*client, window)) {
+        client->set_callback(*cb);
+    }
+
+    /**
+     * @brief A bed's own connection, with its device client ID and certificate.
+     */
+    static std::unique_ptr<MqttConnection> forDevice(int instanceNumber, int maxInflight, bool useMqtt5) {
+        std::string n = std::to_string(instanceNumber);
+        return std::make_unique<MqttConnection>(CLIENT_ID_PREFIX + n, "device " + n, CLIENT_CERT_PATH_PREFIX + n + ".pem.crt",
+                                                CLIENT_KEY_PATH_PREFIX + n + ".private.key", maxInflight, useMqtt5, false);
+    }
+
+    /**
+     * @brief A gateway connection, with the gateway's client ID and certificate.
+     */
+    static std::unique_ptr<MqttConnection> forGateway(int gatewayNumber, int maxInflight, bool useMqtt5) {
+        std::string n = std::to_string(gatewayNumber);
+        return std::make_unique<MqttConnection>(GATEWAY_CLIENT_ID_PREFIX + n, "gateway " + n, GATEWAY_CERT_PATH_PREFIX + n + ".pem.crt",
+                                                GATEWAY_CERT_PATH_PREFIX + n + ".private.key", maxInflight, useMqtt5, true);
+    }
+
+    /**
+     * @brief Connect options: the fleet's shared TLS settings plus this connection's certificate.
+     * @param fleetSsl TLS options common to every connection (trust store), built once per fleet.
+     * @param keyStore Certificate chain file for this connection.
+     * @param privateKey Private key file for this connection (may be the key store itself).
+     * @return mqtt::connect_options Options for async_client::connect().
+     */
+    mqtt::connect_options connectOptions(const mqtt::ssl_options& fleetSsl, const std::string& keyStore, const std::string& privateKey) const {
+        mqtt::ssl_options ssl_opts(fleetSsl);
+        ssl_opts.set_key_store(keyStore);
+        ssl_opts.set_private_key(privateKey);
+        mqtt::connect_options conn_opts = mqtt5 ? mqtt::connect_options::v5() : mqtt::connect_options();
+        conn_opts.set_keep_alive_interval(60);
+        if (mqtt5) {
+            conn_opts.set_clean_start(true);
+        } else {
+            conn_opts.set_clean_session(true);
+        }
+        conn_opts.set_ssl(ssl_opts);
+        conn_opts.set_automatic_reconnect(true);
+        conn_opts.set_connect_timeout(CONNECT_TIMEOUT_SECONDS);
+        if (window.enabled()) {
+            conn_opts.set_max_inflight(MAX_INFLIGHT_LIMIT);
+        }
+        return conn_opts;
+    }
+
+    /**
+     * @brief Record what the broker's CONNACK says about this connection.
+     * @param token Completed connect token.
+     */
+    void onConnected(const mqtt::token& token) {
+        if (!mqtt5) return;
+        mqtt::connect_response response = token.get_connect_response();
+        const mqtt::properties& connack = response.get_properties();
+        if (connack.contains(mqtt::property::TOPIC_ALIAS_MAXIMUM)) {
+            topicAliasMaximum = mqtt::get<uint16_t>(connack, mqtt::property::TOPIC_ALIAS_MAXIMUM); // Two-byte property
+        }
+    }
+
+    void setMessageHandler(std::function<void(const mqtt::const_message_ptr&)> handler) { cb->setMessageHandler(std::move(handler)); }
+
+    /**
+     * @brief Subscribe to topic filters, waiting for all the SUBACKs together; renewed after every reconnect.
+     * @param topicFilters Topic filters.
+     * @param qos Subscription QoS.
+     * @return true if every subscription was acknowledged.
+     */
+    bool subscribe(const std::vector<std::string>& topicFilters, int qos) {
+        std::vector<mqtt::token_ptr> tokens;
+        try {
+            for (const std::string& topicFilter : topicFilters) {
+                cb->addSubscription(topicFilter, qos);
+                tokens.push_back(client->subscribe(topicFilter, qos));
+            }
+            for (const mqtt::token_ptr& token : tokens) token->wait();
+        } catch (const mqtt::exception& exc) {
+            LogLine(LogLevel::ERROR) << "Error subscribing " << clientId << ": " << exc.what();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Disconnect this client.
+     */
+    void disconnect() {
+        try {
+            client->disconnect()->wait();
+        } catch (const mqtt::exception& exc) {
+            LogLine(LogLevel::ERROR) << "Error disconnecting " << clientId << ": " << exc.what();
+        }
+    }
+};
+
+/**
+ * @brief One simulated patient bed: its MQTT identity and topics, and the connection it publishes on.
+ */
+class PatientBed {
+public:
+    int instanceNumber;
+    std::string deviceInstanceNumStr;
+    std::string clientId;      // Device ID in payloads; also the MQTT client ID unless on a gateway
+    std::string topic;
+    mqtt::string_ref topicRef; // Shared by every message so publishing does not copy the topic
+    std::string vitalsTopic;
+    mqtt::string_ref vitalsTopicRef;
+    std::string stateTopic;
+    mqtt::string_ref stateTopicRef;
+    std::string waveformTopic;
+    mqtt::string_ref waveformTopicRef;
+    std::string summaryTopic;
+    mqtt::string_ref summaryTopicRef;
+    std::string commandTopic;  // Subscribed with --commands
+    std::string ackTopic;
+    mqtt::string_ref ackTopicRef;
+    MqttConnection& connection;
+    PublishOutcome outcome;    // MQTT v5 QoS>0 publishes of this bed report here
+
+private:
+    std::array<mqtt::properties, TELEMETRY_STREAM_COUNT> publishProperties_; // MQTT v5: built once, copied into each message
+    uint32_t aliasConnection_ = 0; // cb->connections() that aliasesSent_ refers to
+    uint8_t aliasesSent_ = 0;      // Bit per stream: the broker has seen that stream's alias on this connection
+
+    bool hasAlias(TelemetryStream stream) const {
+        return !connection.gateway && static_cast<int>(stream) + 1 <= connection.topicAliasMaximum;
+    }
+
+public:
+    /**
+     * @brief Construct a bed and derive its client ID and topics.
+     * @param instanceNumber Device instance number.
+     * @param connection Connection to publish on: the bed's own or a gateway; must outlive the bed.
+     */
+    PatientBed(int instanceNumber, MqttConnection& connection)
+        : instanceNumber(instanceNumber),
+          deviceInstanceNumStr(std::to_string(instanceNumber)),
+          clientId(CLIENT_ID_PREFIX + deviceInstanceNumStr),
+          topic(TOPIC_PREFIX + deviceInstanceNumStr + "/data"),
+          topicRef(topic),
+          vitalsTopic(TOPIC_PREFIX + deviceInstanceNumStr + "/vitals"),
+          vitalsTopicRef(vitalsTopic),
+          stateTopic(TOPIC_PREFIX + deviceInstanceNumStr + "/state"),
+          stateTopicRef(stateTopic),
+          waveformTopic(TOPIC_PREFIX + deviceInstanceNumStr + "/waveform"),
+          waveformTopicRef(waveformTopic),
+          summaryTopic(TOPIC_PREFIX + deviceInstanceNumStr + "/summary"),
+          summaryTopicRef(summaryTopic),
+          commandTopic(TOPIC_PREFIX + deviceInstanceNumStr + "/cmd"),
+          ackTopic(commandTopic + "/ack"),
+          ackTopicRef(ackTopic),
+          connection(connection),
+          outcome(connection.window, clientId) {}
+
+    /**
+     * @brief Build the MQTT v5 properties every message on each stream carries.
+     * Call once connected, when the broker's topic alias maximum is known.
+     * @param encoding Payload encoding, for content-type and payload-format-indicator.
+     * @param messageExpirySeconds Message-expiry interval; 0 = none.
+     */
+    void preparePublishProperties(PayloadEncoding encoding, int messageExpirySeconds) {
+        bool utf8 = encoding == PayloadEncoding::JSON || encoding == PayloadEncoding::JSON_PRETTY;
+        for (size_t s = 0; s < TELEMETRY_STREAM_COUNT; ++s) {
+            TelemetryStream stream = static_cast<TelemetryStream>(s);
+            mqtt::properties& props = publishProperties_[s];
+            props.clear();
+            if (stream == TelemetryStream::WAVEFORM) {
+                props.add(mqtt::property(mqtt::property::CONTENT_TYPE, std::string(WAVEFORM_CONTENT_TYPE)));
+            } else {
+                props.add(mqtt::property(mqtt::property::CONTENT_TYPE, std::string(contentType(encoding))));
+                if (utf8) props.add(mqtt::property(mqtt::property::PAYLOAD_FORMAT_INDICATOR, 1));
+            }
+            if (messageExpirySeconds > 0) {
+                props.add(mqtt::property(mqtt::property::MESSAGE_EXPIRY_INTERVAL, messageExpirySeconds));
+            }
+            if (hasAlias(stream)) {
+                props.add(mqtt::property(mqtt::property::TOPIC_ALIAS, static_cast<int>(s) + 1));
+            }
+        }
+    }
+
+    /**
+     * @brief Build a message for one of this bed's streams.
+     * MQTT v5 messages carry the stream's prebuilt properties; once the broker has seen a stream's
+     * topic alias on the current connection, the topic itself is left empty.
+     * @param stream Telemetry stream.
+     * @param payload Payload; copied into the message.
+     * @param qos QoS.
+     * @return mqtt::message_ptr Message ready to publish.
+     */
+    mqtt::message_ptr makeMessage(TelemetryStream stream, std::string_view payload, int qos) {
+        if (!connection.mqtt5) {
+            return mqtt::make_message(streamTopic(stream), payload.data(), payload.size(), qos, false);
+        }
+        static const mqtt::string_ref aliasOnly{std::string()};
+        uint32_t connected = connection.cb->connections();
+        if (connected != aliasConnection_ || outcome.takeAliasesInvalid()) {
+            aliasConnection_ = connected; // Aliases do not survive a reconnect
+            aliasesSent_ = 0;
+        }
+        size_t s = static_cast<size_t>(stream);
+        bool aliased = hasAlias(stream) && (aliasesSent_ & (1u << s)) != 0;
+        mqtt::message_ptr message = mqtt::make_message(aliased ? aliasOnly : streamTopic(stream), payload.data(), payload.size(), qos, false);
+        message->set_properties(publishProperties_[s]);
+        return message;
+    }
+
+    /**
+     * @brief Record that a stream's message (topic plus alias) was handed to Paho on this connection.
+     */
+    void markAliasSent(TelemetryStream stream) {
+        if (connection.mqtt5 && hasAlias(stream)) aliasesSent_ |= static_cast<uint8_t>(1u << static_cast<size_t>(stream));
+    }
+
+    /**
+     * @brief Topic of one of this bed's streams.
+     * @param stream Telemetry stream.
+     * @return const mqtt::string_ref& Shared topic reference.
+     */
+    const mqtt::string_ref& streamTopic(TelemetryStream stream) const {
+        switch (stream) {
+        case TelemetryStream::VITALS: return vitalsTopicRef;
+        case TelemetryStream::STATE: return stateTopicRef;
+        case TelemetryStream::WAVEFORM: return waveformTopicRef;
+        case TelemetryStream::SUMMARY: return summaryTopicRef;
+        case TelemetryStream::ACK: return ackTopicRef;
+        case TelemetryStream::DATA: break;
+        }
+        return topicRef;
+    }
+};
+
+/**
+ * @brief One ward's daily meal inclination slots, in local system time.
+ */
+class MealSchedule {
+public:
+    struct Slot {
+        int startMinute;     // Minutes from local midnight
+        int durationMinutes;
+    };
+
+private:
+    std::vector<Slot> slots_;
+
+public:
+    MealSchedule() = default;
+
+    /**
+     * @brief Schedule from (hour, minute) start times, each lasting MEAL_INCLINATION_DURATION_MINUTES.
+     */
+    explicit MealSchedule(const std::vector<std::pair<int, int>>& startTimes) {
+        for (const auto& meal_time : startTimes) {
+            slots_.push_back({meal_time.first * 60 + meal_time.second, MEAL_INCLINATION_DURATION_MINUTES});
+        }
+    }
+
+    explicit MealSchedule(std::vector<Slot> slots) : slots_(std::move(slots)) {}
+
+    const std::vector<Slot>& slots() const { return slots_; }
+
+    /**
+     * @brief Check whether a local time of day falls inside one of the meal slots.
+     * @param tm_local Local time.
+     * @return true during a meal inclination slot.
+     */
+    bool activeAt(const std::tm& tm_local) const {
+        int current_total_minutes_from_midnight = tm_local.tm_hour * 60 + tm_local.tm_min;
+        for (const Slot& slot : slots_) {
+            if (current_total_minutes_from_midnight >= slot.startMinute &&
+                current_total_minutes_from_midnight < slot.startMinute + slot.durationMinutes) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool activeAt(std::chrono::system_clock::time_point time) const {
+        time_t itt = std::chrono::system_clock::to_time_t(time);
+        std::tm tm_local{};
+        localtime_r(&itt, &tm_local); // Uses system's local timezone
+        return activeAt(tm_local);
+    }
+
+    /**
+     * @brief First meal start or end strictly after a time point.
+     * Slots never cross midnight, so today's and tomorrow's boundaries cover every case.
+     * @param time Wall-clock time.
+     * @return Wall-clock time of the next boundary, or time_point::max() if there are no slots.
+     */
+    std::chrono::system_clock::time_point nextBoundary(std::chrono::system_clock::time_point time) const {
+        auto next = std::chrono::system_clock::time_point::max();
+        time_t itt = std::chrono::system_clock::to_time_t(time);
+        std::tm tm_local{};
+        localtime_r(&itt, &tm_local);
+        for (int day = 0; day <= 1; ++day) {
+            for (const Slot& slot : slots_) {
+                for (int minute : {slot.startMinute, slot.startMinute + slot.durationMinutes}) {
+                    std::tm tm_boundary = tm_local;
+                    tm_boundary.tm_mday += day;
+                    tm_boundary.tm_hour = 0;
+                    tm_boundary.tm_min = minute; // mktime normalizes, and resolves DST via tm_isdst = -1
+                    tm_boundary.tm_sec = 0;
+                    tm_boundary.tm_isdst = -1;
+                    auto boundary = std::chrono::system_clock::from_time_t(std::mktime(&tm_boundary));
+                    if (boundary > time && boundary < next) next = boundary;
+                }
+            }
+        }
+        return next;
+    }
+};
+
+/**
+ * @brief Meal schedules per ward, and which beds belong to which ward.
+ * Ward 0 is the default schedule for beds not listed in any ward.
+ */
+class MealPlan {
+    struct WardRange {
+        int firstBed;
+        int lastBed;
+        uint16_t ward;
+    };
+
+    std::vector<MealSchedule> schedules_;
+    std::vector<std::string> names_;
+    std::vector<WardRange> ranges_;
+
+    static bool parseSlot(const json& entry, MealSchedule::Slot& slot) {
+        std::string start = entry.is_string() ? entry.get<std::string>() : entry.at("start").get<std::string>();
+        int hour = 0;
+        int minute = 0;
+        char trailing = 0;
+        if (std::sscanf(start.c_str(), "%d:%d%c", &hour, &minute, &trailing) != 2) return false;
+        slot.startMinute = hour * 60 + minute;
+        slot.durationMinutes = entry.is_object() ? entry.value("minutes", MEAL_INCLINATION_DURATION_MINUTES) : MEAL_INCLINATION_DURATION_MINUTES;
+        return hour >= 0 && hour < 24 && minute >= 0 && minute < 60 && slot.durationMinutes > 0 &&
+               slot.startMinute + slot.durationMinutes <= 24 * 60;
+    }
+
+    static bool parseSchedule(const json& meals, MealSchedule& schedule) {
+        std::vector<MealSchedule::Slot> slots;
+        for (const json& entry : meals) {
+            MealSchedule::Slot slot{};
+            if (!parseSlot(entry, slot)) return false;
+            slots.push_back(slot);
+        }
+        schedule = MealSchedule(std::move(slots));
+        return true;
+    }
+
+public:
+    /**
+     * @brief Plan with the built-in meal_start_times for every bed.
+     */
+    MealPlan() : schedules_{MealSchedule(meal_start_times)}, names_{"default"} {}
+
+    /**
+     * @brief Load ward schedules from a JSON file.
+     * Format: {"default": [...], "wards": [{"name": "ICU", "beds": "1-40", "meals": [...]}]}, where each meal
+     * is "HH:MM" or {"start": "HH:MM", "minutes": n}. Slots must not cross midnight.
+     * @param path JSON file path.
+     * @return true on success; errors are logged.
+     */
+    bool load(const std::string& path) {
+        try {
+            std::ifstream in(path);
+            if (!in) {
+                LogLine(LogLevel::ERROR) << "Cannot open meal schedule " << path;
+                return false;
+            }
+            json config = json::parse(in);
+            if (config.contains("default") && !parseSchedule(config["default"], schedules_[0])) {
+                LogLine(LogLevel::ERROR) << "Invalid default meal schedule in " << path;
+                return false;
+            }
+            for (const json& ward : config.value("wards", json::array())) {
+                MealSchedule schedule;
+                WardRange range{};
+                std::string name = ward.value("name", "ward " + std::to_string(schedules_.size()));
+                if (!parseSchedule(ward.at("meals"), schedule) || !parseBedRange(ward.at("beds").get<std::string>(), range.firstBed, range.lastBed)) {
+                    LogLine(LogLevel::ERROR) << "Invalid meal schedule for " << name << " in " << path;
+                    return false;
+                }
+                range.ward = static_cast<uint16_t>(schedules_.size());
+                schedules_.push_back(std::move(schedule));
+                names_.push_back(name);
+                ranges_.push_back(range);
+            }
+        } catch (const json::exception& exc) {
+            LogLine(LogLevel::ERROR) << "Error reading meal schedule " << path << ": " << exc.what();
+            return false;
+        }
+        return true;
+    }
+
+    size_t wardCount() const { return schedules_.size(); }
+    const MealSchedule& schedule(uint16_t ward) const { return schedules_[ward]; }
+    const std::string& name(uint16_t ward) const { return names_[ward]; }
+
+    /**
+     * @brief Ward of a bed: the first listed range containing it, else the default.
+     */
+    uint16_t wardOf(int instanceNumber) const {
+        for (const WardRange& range : ranges_) {
+            if (instanceNumber >= range.firstBed && instanceNumber <= range.lastBed) return range.ward;
+        }
+        return 0;
+    }
+};
+
+/**
+ * @brief Inclination change reported by BedSimulator::step().
+ */
+enum class BedTransition : uint8_t {
+    NONE,
+    INCLINED_FOR_MEAL,
+    FLAT_AFTER_MEAL,
+    INCLINED_MINOR,
+    FLAT_AFTER_MINOR,
+    INCLINED_BY_COMMAND,
+    FLAT_BY_COMMAND
+};
+
+/**
+ * @brief Minimal 32-bit xorshift generator so each bed can carry its own random stream in 4 bytes.
+ * Satisfies UniformRandomBitGenerator, so it works with the standard distributions.
+ */
+class CompactRandom {
+    uint32_t state_;
+public:
+    using result_type = uint32_t;
+    explicit CompactRandom(uint32_t seed) : state_(seed ? seed : 0x9E3779B9u) {}
+    static constexpr result_type min() { return 1; }
+    static constexpr result_type max() { return 0xFFFFFFFFu; }
+    result_type operator()() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+};
+
+/**
+ * @brief Per-bed FLAT/INCLINED state machine with a fixed, allocation-free footprint.
+ * Beds are meant to be stored contiguously (e.g. std::vector<BedSimulator>) and advanced with step().
+ */
+class BedSimulator {
+    std::chrono::steady_clock::time_point lastNonMealStateChangeTime_;
+    CompactRandom gen_;
+    int32_t currentNonMealStateDurationSeconds_;
+    float currentInclination_ = 0.0f;
+    BedInclinationState currentInclinationState_ = BedInclinationState::FLAT;
+    bool inMealInclineOverride_ = false;
+
+    int32_t drawFlatDurationSeconds() {
+        return (FLAT_STATE_BASE_DURATION_MINUTES + std::uniform_int_distribution<>(0, FLAT_STATE_RAND_ADD_MINUTES - 1)(gen_)) * 60;
+    }
+
+    int32_t drawMinorInclineDurationSeconds() {
+        return (MINOR_INCLINATION_DURATION_BASE_MINUTES + std::uniform_int_distribution<>(0, MINOR_INCLINATION_DURATION_RAND_ADD_MINUTES - 1)(gen_)) * 60;
+    }
+
+    void setFlat(std::chrono::steady_clock::time_point now) {
+        currentInclination_ = 0.0f;
+        currentInclinationState_ = BedInclinationState::FLAT;
+        currentNonMealStateDurationSeconds_ = drawFlatDurationSeconds();
+        lastNonMealStateChangeTime_ = now;
+    }
+
+public:
+    /**
+     * @brief Construct a FLAT bed.
+     * @param seed Seed for the bed's random stream.
+     * @param now Start of the initial FLAT period.
+     */
+    BedSimulator(uint32_t seed, std::chrono::steady_clock::time_point now)
+        : lastNonMealStateChangeTime_(now), gen_(seed) {
+        currentNonMealStateDurationSeconds_ = drawFlatDurationSeconds();
+    }
+
+    /**
+     * @brief Advance the state machine to now.
+     * @param now Current steady time.
+     * @param isMealTimeSlot Whether the local time of day is inside a meal slot.
+     * @return BedTransition The change that happened, or NONE.
+     */
+    BedTransition step(std::chrono::steady_clock::time_point now, bool isMealTimeSlot) {
+        if (isMealTimeSlot) {
+            bool entering = !inMealInclineOverride_;
+            currentInclination_ = static_cast<float>(MEAL_INCLINATION_DEGREES);
+            currentInclinationState_ = BedInclinationState::INCLINED;
+            inMealInclineOverride_ = true;
+            return entering ? BedTransition::INCLINED_FOR_MEAL : BedTransition::NONE;
+        }
+        if (inMealInclineOverride_) {
+            setFlat(now);
+            inMealInclineOverride_ = false;
+            return BedTransition::FLAT_AFTER_MEAL;
+        }
+        if (now - lastNonMealStateChangeTime_ < std::chrono::seconds(currentNonMealStateDurationSeconds_)) {
+            return BedTransition::NONE;
+        }
+        if (currentInclinationState_ == BedInclinationState::INCLINED) {
+            setFlat(now);
+            return BedTransition::FLAT_AFTER_MINOR;
+        }
+        if (std::uniform_real_distribution<>(0.0, 1.0)(gen_) < PROBABILITY_MINOR_INCLINE) {
+            currentInclination_ = static_cast<float>(MINOR_INCLINATION_DEGREES);
+            currentInclinationState_ = BedInclinationState::INCLINED;
+            currentNonMealStateDurationSeconds_ = drawMinorInclineDurationSeconds();
+            lastNonMealStateChangeTime_ = now;
+            return BedTransition::INCLINED_MINOR;
+        }
+        setFlat(now); // Stay FLAT for another random period
+        return BedTransition::NONE;
+    }
+
+    /**
+     * @brief Apply a remote incline command. An incline is held for a random minor-incline duration
+     * before the bed returns FLAT; during a meal slot the bed still returns FLAT when the meal ends.
+     * @param now Current steady time.
+     * @param degrees Commanded inclination; 0 = FLAT.
+     * @return BedTransition INCLINED_BY_COMMAND or FLAT_BY_COMMAND.
+     */
+    BedTransition command(std::chrono::steady_clock::time_point now, double degrees) {
+        if (degrees <= 0.0) {
+            setFlat(now);
+            return BedTransition::FLAT_BY_COMMAND;
+        }
+        currentInclination_ = static_cast<float>(degrees);
+        currentInclinationState_ = BedInclinationState::INCLINED;
+        currentNonMealStateDurationSeconds_ = drawMinorInclineDurationSeconds();
+        lastNonMealStateChangeTime_ = now;
+        return BedTransition::INCLINED_BY_COMMAND;
+    }
+
+    double inclination() const { return currentInclination_; }
+    BedInclinationState state() const { return currentInclinationState_; }
+    bool inMealIncline() const { return inMealInclineOverride_; }
+
+    /**
+     * @brief When the current random FLAT/INCLINED duration expires.
+     */
+    std::chrono::steady_clock::time_point nextNonMealDeadline() const {
+        return lastNonMealStateChangeTime_ + std::chrono::seconds(currentNonMealStateDurationSeconds_);
+    }
+};
+
+static_assert(sizeof(BedSimulator) <= BED_SIMULATOR_TARGET_BYTES, "BedSimulator exceeds its per-bed memory target");
+
+/**
+ * @brief Log a state machine transition in the simulator's usual wording.
+ * @param deviceInstanceNumStr Bed instance number.
+ * @param transition Transition returned by BedSimulator::step().
+ * @param inclination Inclination after the transition.
+ */
+void logBedTransition(const std::string& deviceInstanceNumStr, BedTransition transition, double inclination) {
+    switch (transition) {
+    case BedTransition::INCLINED_FOR_MEAL:
+        LogLine(LogLevel::INFO) << "Bed " << deviceInstanceNumStr << " INCLINED for meal to " << inclination << " degrees.";
+        break;
+    case BedTransition::FLAT_AFTER_MEAL:
+        LogLine(LogLevel::INFO) << "Bed " << deviceInstanceNumStr << " set to FLAT after meal.";
+        break;
+    case BedTransition::INCLINED_MINOR:
+        LogLine(LogLevel::INFO) << "Bed " << deviceInstanceNumStr << " INCLINED (minor) to " << inclination << " degrees.";
+        break;
+    case BedTransition::FLAT_AFTER_MINOR:
+        LogLine(LogLevel::INFO) << "Bed " << deviceInstanceNumStr << " set to FLAT after minor incline.";
+        break;
+    case BedTransition::INCLINED_BY_COMMAND: {
+        static LogThrottle throttle; // --command-rate sends many
+        LogLine(LogLevel::INFO, throttle) << "Bed " << deviceInstanceNumStr << " INCLINED by command to " << inclination << " degrees.";
+        break;
+    }
+    case BedTransition::FLAT_BY_COMMAND: {
+        static LogThrottle throttle;
+        LogLine(LogLevel::INFO, throttle) << "Bed " << deviceInstanceNumStr << " set to FLAT by command.";
+        break;
+    }
+    case BedTransition::NONE:
+        break;
+    }
+}
+
+// --- InfluxDB Line-Protocol Sink ---
+
+/**
+ * @brief Writes samples straight to InfluxDB's /api/v2/write as gzip-compressed line protocol,
+ * bypassing AWS IoT and Telegraf. Workers hand over preformatted lines once per tick; a writer
+ * thread sends them in batches of --influx-batch lines or every --influx-flush-ms over one
+ * keep-alive HTTP/1.1 connection. Plain http:// only.
+ */
+class InfluxSink {
+    std::string host_;
+    std::string port_;
+    std::string requestHead_; // Request line and fixed headers, built once
+    size_t flushLines_ = DEFAULT_INFLUX_BATCH_LINES;
+    std::chrono::milliseconds flushInterval_{DEFAULT_INFLUX_FLUSH_MS};
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::string pending_;
+    size_t pendingLines_ = 0;
+    bool stopping_ = false;
+    std::thread thread_;
+
+    // Writer thread only
+    int fd_ = -1;
+    z_stream zlib_{};
+    bool zlibReady_ = false;
+    std::string batch_;
+    std::string body_;
+    std::string response_;
+
+    static bool sendAll(int fd, const char* data, size_t size, int flags) {
+        while (size > 0) {
+            ssize_t n = send(fd, data, size, flags | MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static std::string urlEncode(const std::string& text) {
+        std::string out;
+        for (unsigned char c : text) {
+            if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+                out += static_cast<char>(c);
+            } else {
+                char escaped[4];
+                std::snprintf(escaped, sizeof(escaped), "%%%02X", c);
+                out += escaped;
+            }
+        }
+        return out;
+    }
+
+    void disconnect() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    bool connectServer() {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addresses) != 0) return false;
+        for (addrinfo* address = addresses; address != nullptr && fd_ < 0; address = address->ai_next) {
+            fd_ = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            if (fd_ < 0) continue;
+            timeval timeout{INFLUX_TIMEOUT_SECONDS, 0};
+            setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            int noDelay = 1;
+            setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            if (::connect(fd_, address->ai_addr, address->ai_addrlen) != 0) disconnect();
+        }
+        freeaddrinfo(addresses);
+        return fd_ >= 0;
+    }
+
+    /**
+     * @brief gzip batch_ into body_.
+     */
+    bool compress() {
+        if (deflateReset(&zlib_) != Z_OK) return false;
+        body_.resize(deflateBound(&zlib_, batch_.size()));
+        zlib_.next_in = reinterpret_cast<Bytef*>(batch_.data());
+        zlib_.avail_in = static_cast<uInt>(batch_.size());
+        zlib_.next_out = reinterpret_cast<Bytef*>(body_.data());
+        zlib_.avail_out = static_cast<uInt>(body_.size());
+        if (deflate(&zlib_, Z_FINISH) != Z_STREAM_END) return false;
+        body_.resize(body_.size() - zlib_.avail_out);
+        return true;
+    }
+
+    /**
+     * @brief POST body_ on the kept-alive connection and read the response.
+     * @return int HTTP status, or 0 if the connection failed.
+     */
+    int post() {
+        if (fd_ < 0 && !connectServer()) return 0;
+        std::string head = requestHead_ + std::to_string(body_.size()) + "\r\n\r\n";
+        if (!sendAll(fd_, head.data(), head.size(), MSG_MORE) || !sendAll(fd_, body_.data(), body_.size(), 0)) {
+            disconnect();
+            return 0;
+        }
+        response_.clear();
+        size_t headerEnd = std::string::npos;
+        char chunk[4096];
+        while ((headerEnd = response_.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = recv(fd_, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                disconnect();
+                return 0;
+            }
+            response_.append(chunk, static_cast<size_t>(n));
+        }
+        int status = 0;
+        if (std::sscanf(response_.c_str(), "HTTP/1.%*d %d", &status) != 1) status = 0;
+        std::string headers = response_.substr(0, headerEnd);
+        std::transform(headers.begin(), headers.end(), headers.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        size_t lengthAt = headers.find("\r\ncontent-length:");
+        bool keepAlive = headers.find("\r\nconnection: close") == std::string::npos;
+        if (lengthAt != std::string::npos) {
+            size_t bodyBytes = std::strtoul(headers.c_str() + lengthAt + 17, nullptr, 10);
+            while (response_.size() < headerEnd + 4 + bodyBytes) {
+                ssize_t n = recv(fd_, chunk, sizeof(chunk), 0);
+                if (n <= 0) {
+                    keepAlive = false;
+                    break;
+                }
+                response_.append(chunk, static_cast<size_t>(n));
+            }
+        } else if (status != 204) {
+            keepAlive = false; // Body framing we do not parse (chunked): start afresh next time
+        }
+        if (!keepAlive || status == 0) disconnect();
+        return status;
+    }
+
+    /**
+     * @brief Compress and send one batch, reconnecting once if the kept-alive connection had closed.
+     */
+    void writeBatch(size_t lines) {
+        auto start = std::chrono::steady_clock::now();
+        int status = compress() ? post() : -1;
+        if (status == 0) status = post(); // The server may have closed an idle keep-alive connection
+        for (int attempt = 1; (status == 0 || status == 429 || status == 503) && attempt < INFLUX_MAX_ATTEMPTS; ++attempt) {
+            std::this_thread::sleep_for(std::chrono::seconds(attempt)); // Lines keep queuing meanwhile
+            status = post();
+        }
+        FleetMetrics& metrics = fleetMetrics();
+        metrics.influxWrite.observe(std::chrono::steady_clock::now() - start);
+        if (status >= 200 && status < 300) {
+            metrics.influxLinesWritten.add(lines);
+            return;
+        }
+        metrics.influxLinesDropped.addShared(lines);
+        static LogThrottle throttle;
+        if (status > 0) {
+            std::string_view message(response_);
+            size_t bodyAt = message.find("\r\n\r\n");
+            message = bodyAt == std::string_view::npos ? std::string_view() : message.substr(bodyAt + 4, 160);
+            LogLine(LogLevel::ERROR, throttle) << "InfluxDB write of " << lines << " lines failed: HTTP " << status << " " << message;
+        } else {
+            LogLine(LogLevel::ERROR, throttle) << "InfluxDB write of " << lines << " lines failed: cannot reach " << host_ << ":" << port_;
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait_for(lock, flushInterval_, [this] { return stopping_ || pendingLines_ >= flushLines_; });
+            if (pendingLines_ > 0) {
+                size_t lines = pendingLines_;
+                batch_.swap(pending_);
+                pending_.clear();
+                pendingLines_ = 0;
+                lock.unlock();
+                writeBatch(lines);
+                batch_.clear();
+                lock.lock();
+            }
+            if (stopping_ && pendingLines_ == 0) return;
+        }
+    }
+
+public:
+    InfluxSink() = default;
+    InfluxSink(const InfluxSink&) = delete;
+    InfluxSink& operator=(const InfluxSink&) = delete;
+    ~InfluxSink() { close(); }
+
+    /**
+     * @brief Parse the server URL and start the writer thread. Nothing is sent until lines arrive.
+     * @param url Server, as http://host[:port] (default port 8086).
+     * @param org Organization.
+     * @param bucket Bucket.
+     * @param token API token; empty sends no Authorization header.
+     * @param flushLines Lines per write.
+     * @param flushInterval Maximum time a line waits before being written.
+     * @return true on success.
+     */
+    bool open(const std::string& url, const std::string& org, const std::string& bucket, const std::string& token,
+              size_t flushLines, std::chrono::milliseconds flushInterval) {
+        const std::string scheme("http://");
+        if (url.compare(0, scheme.size(), scheme) != 0) {
+            LogLine(LogLevel::ERROR) << "InfluxDB URL must start with http://: " << url;
+            return false;
+        }
+        std::string authority = url.substr(scheme.size(), url.find('/', scheme.size()) - scheme.size());
+        size_t colon = authority.rfind(':');
+        host_ = colon == std::string::npos ? authority : authority.substr(0, colon);
+        port_ = colon == std::string::npos ? std::to_string(DEFAULT_INFLUX_PORT) : authority.substr(colon + 1);
+        if (host_.empty() || port_.empty()) {
+            LogLine(LogLevel::ERROR) << "Invalid InfluxDB URL: " << url;
+            return false;
+        }
+        flushLines_ = flushLines;
+        flushInterval_ = flushInterval;
+        requestHead_ = "POST /api/v2/write?org=" + urlEncode(org) + "&bucket=" + urlEncode(bucket) + "&precision=ns HTTP/1.1\r\n"
+                       "Host: " + authority + "\r\n"
+                       "Content-Type: text/plain; charset=utf-8\r\n"
+                       "Content-Encoding: gzip\r\n";
+        if (!token.empty()) requestHead_ += "Authorization: Token " + token + "\r\n";
+        requestHead_ += "Content-Length: ";
+        if (deflateInit2(&zlib_, INFLUX_GZIP_LEVEL, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+        zlibReady_ = true;
+        pending_.reserve(flushLines_ * INFLUX_LINE_BYTES);
+        thread_ = std::thread([this] { run(); });
+        LogLine(LogLevel::INFO) << "Writing line protocol to InfluxDB at " << host_ << ":" << port_ << " (bucket " << bucket << ", "
+                                << flushLines_ << " lines or " << flushInterval_.count() << " ms per write, gzip)";
+        return true;
+    }
+
+    /**
+     * @brief Format one sample as a line: measurement, deviceId/bedState tags, numeric fields and a ns timestamp.
+     * Device IDs and states never contain spaces, commas or '=', so tags need no escaping.
+     */
+    static void appendLine(std::string& out, const TelemetrySample& sample) {
+        char number[32];
+        auto appendNumber = [&out, &number](double value) {
+            out.append(number, std::to_chars(number, number + sizeof(number), value).ptr);
+        };
+        out += INFLUX_MEASUREMENT;
+        out += ",deviceId=";
+        out += sample.deviceId;
+        out += ",bedState=";
+        out += sample.state == BedInclinationState::FLAT ? "FLAT" : "INCLINED";
+        out += " heartRate=";
+        appendNumber(sample.heartRate);
+        out += ",spo2=";
+        appendNumber(sample.spo2);
+        out += ",inclination=";
+        appendNumber(sample.inclination);
+        out += ' ';
+        int64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(sample.time.time_since_epoch()).count();
+        out.append(number, std::to_chars(number, number + sizeof(number), nanos).ptr);
+        out += '\n';
+    }
+
+    /**
+     * @brief Queue formatted lines for the writer thread and clear them, or drop them if
+     * INFLUX_MAX_PENDING_BATCHES batches are already waiting. Safe from any thread.
+     * @param lines Newline-terminated lines.
+     * @param count Number of lines.
+     */
+    void append(std::string& lines, size_t count) {
+        bool full = false;
+        bool flush = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            full = pendingLines_ + count > flushLines_ * INFLUX_MAX_PENDING_BATCHES;
+            if (!full) {
+                pending_ += lines;
+                pendingLines_ += count;
+                flush = pendingLines_ >= flushLines_;
+            }
+        }
+        lines.clear();
+        if (full) {
+            fleetMetrics().influxLinesDropped.addShared(count);
+            static LogThrottle throttle;
+            LogLine(LogLevel::WARN, throttle) << "InfluxDB writes are falling behind, dropping " << count << " lines.";
+        } else if (flush) {
+            wake_.notify_one();
+        }
+    }
+
+    /**
+     * @brief Write every queued line, then stop the writer thread and close the connection.
+     */
+    void close() {
+        if (thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_one();
+            thread_.join();
+        }
+        disconnect();
+        if (zlibReady_) {
+            deflateEnd(&zlib_);
+            zlibReady_ = false;
+        }
+    }
+};
+
+// --- Event Scheduling ---
+
+// Scheduled bed events
+enum class BedEventKind : uint8_t {
+    SAMPLE,          // Sample vitals and publish
+    STATE_HEARTBEAT, // Include inclination/bedState in the next sample (on-change mode)
+    STATE_DEADLINE,  // A random FLAT/INCLINED duration expires
+    WAVEFORM         // Publish the next waveform frame (--waveform)
+};
+
+/**
+ * @brief One scheduled event for one bed. deadlineTick is absolute (SCHEDULER_TICK_MS units from the start).
+ */
+struct TimerEvent {
+    int64_t deadlineTick;
+    uint32_t bed; // Index into the fleet's connected beds
+    BedEventKind kind;
+};
+
+/**
+ * @brief Hierarchical timer wheel: TIMER_WHEEL_LEVELS levels of 2^TIMER_WHEEL_SLOT_BITS slots.
+ * Insertion and expiry are O(1); events further out than level 0 cascade down as time advances.
+ * Slot vectors keep their capacity, so a steady-state fleet schedules without allocating.
+ * Not thread-safe; owned by the scheduler thread.
+ */
+class TimerWheel {
+    static constexpr int SLOTS = 1 << TIMER_WHEEL_SLOT_BITS;
+    static constexpr int64_t SLOT_MASK = SLOTS - 1;
+
+    std::vector<TimerEvent> slots_[TIMER_WHEEL_LEVELS][SLOTS];
+    std::vector<TimerEvent> cascade_;
+    int64_t currentTick_ = 0;
+    size_t size_ = 0;
+
+    void place(const TimerEvent& event) {
+        int64_t deadline = std::max(event.deadlineTick, currentTick_);
+        int64_t delta = deadline - currentTick_;
+        for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+            int shift = TIMER_WHEEL_SLOT_BITS * level;
+            if (level == TIMER_WHEEL_LEVELS - 1 || delta < (int64_t{1} << (shift + TIMER_WHEEL_SLOT_BITS))) {
+                if (level == TIMER_WHEEL_LEVELS - 1 && delta >= (int64_t{1} << (shift + TIMER_WHEEL_SLOT_BITS))) {
+                    // Beyond the wheel's range: park in the furthest slot and re-place on cascade
+                    deadline = currentTick_ + (int64_t{1} << (shift + TIMER_WHEEL_SLOT_BITS)) - 1;
+                }
+                slots_[level][(deadline >> shift) & SLOT_MASK].push_back(event);
+                return;
+            }
+        }
+    }
+
+public:
+    int64_t currentTick() const { return currentTick_; }
+    size_t size() const { return size_; }
+
+    /**
+     * @brief Schedule an event. Deadlines at or before the current tick fire on the next advance().
+     * @param event Event to schedule.
+     */
+    void insert(TimerEvent event) {
+        event.deadlineTick = std::max(event.deadlineTick, currentTick_ + 1);
+        place(event);
+        ++size_;
+    }
+
+    /**
+     * @brief Advance by one tick, appending the events that expire to out.
+     * @param out Receives expired events.
+     */
+    void advance(std::vector<TimerEvent>& out) {
+        ++currentTick_;
+        int topLevel = 0;
+        while (topLevel + 1 < TIMER_WHEEL_LEVELS && (currentTick_ & ((int64_t{1} << (TIMER_WHEEL_SLOT_BITS * (topLevel + 1))) - 1)) == 0) {
+            ++topLevel;
+        }
+        for (int level = topLevel; level >= 1; --level) {
+            auto& slot = slots_[level][(currentTick_ >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK];
+            cascade_.swap(slot);
+            for (const TimerEvent& event : cascade_) {
+                place(event);
+            }
+            cascade_.clear();
+        }
+        auto& due = slots_[0][currentTick_ & SLOT_MASK];
+        size_ -= due.size();
+        out.insert(out.end(), due.begin(), due.end());
+        due.clear();
+    }
+};
+
+/**
+ * @brief Thread-safe queue through which workers hand re-armed events back to the scheduler.
+ */
+class TimerInbox {
+    std::mutex mutex_;
+    std::vector<TimerEvent> events_;
+public:
+    void post(const TimerEvent& event) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_.push_back(event);
+    }
+
+    /**
+     * @brief Move all posted events into out, keeping the internal capacity.
+     */
+    void drain(std::vector<TimerEvent>& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out.insert(out.end(), events_.begin(), events_.end());
+        events_.clear();
+    }
+};
+
+/**
+ * @brief Events that expired on one scheduler tick for beds owned by one worker.
+ */
+struct EventBatch {
+    std::chrono::steady_clock::time_point time;
+    std::vector<TimerEvent> events;
+};
+
+/**
+ * @brief Conversion between scheduler ticks and SimClock steady time.
+ */
+struct SchedulerTimebase {
+    std::chrono::steady_clock::time_point epoch;
+
+    /**
+     * @brief First tick at or after a time point.
+     */
+    int64_t tickAt(std::chrono::steady_clock::time_point time) const {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(time - epoch).count();
+        int64_t tickMicros = SCHEDULER_TICK_MS * 1000;
+        return elapsed <= 0 ? 0 : (elapsed + tickMicros - 1) / tickMicros;
+    }
+
+    std::chrono::steady_clock::time_point timeOf(int64_t tick) const {
+        return epoch + std::chrono::milliseconds(tick * SCHEDULER_TICK_MS);
+    }
+
+    static int64_t ticksIn(std::chrono::milliseconds duration) {
+        return std::max<int64_t>(1, duration.count() / SCHEDULER_TICK_MS);
+    }
+};
+
+/**
+ * @brief Deterministic phase of a bed's sample schedule within DATA_SEND_INTERVAL_SECONDS.
+ * Depends only on the instance number, so every process (and host) spreads a bed the same way.
+ * @param instanceNumber Device instance number.
+ * @return int64_t Offset in scheduler ticks.
+ */
+int64_t samplePhaseTicks(int instanceNumber) {
+    int64_t periodTicks = SchedulerTimebase::ticksIn(std::chrono::seconds(DATA_SEND_INTERVAL_SECONDS));
+    return static_cast<int64_t>(mixSeed(PHASE_SPREAD_SEED, static_cast<uint64_t>(instanceNumber)) % static_cast<uint64_t>(periodTicks));
+}
+
+/**
+ * @brief Log min/p50/p99/max of a per-bin event count series as a rate.
+ * @param label Description of the series.
+ * @param binCounts Events per bin; sorted in place.
+ * @param binMs Bin width in milliseconds.
+ */
+void logRateDistribution(const std::string& label, std::vector<uint32_t>& binCounts, int binMs) {
+    if (binCounts.empty()) return;
+    std::sort(binCounts.begin(), binCounts.end());
+    double scale = 1000.0 / binMs;
+    auto at = [&](double q) { return binCounts[std::min(binCounts.size() - 1, static_cast<size_t>(q * binCounts.size()))] * scale; };
+    LogLine(LogLevel::INFO) << label << " (msgs/s over " << binMs << " ms bins): min=" << binCounts.front() * scale
+              << " p50=" << at(0.50) << " p99=" << at(0.99) << " max=" << binCounts.back() * scale;
+}
+
+/**
+ * @brief Stateless 32-bit integer hash (lowbias32), used as a counter-based random generator.
+ * @param x Counter mixed with a key.
+ * @return uint32_t Well-distributed bits.
+ */
+inline uint32_t hashCounter(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * @brief Fill heart rate and SpO2 for a block of beds.
+ * Each value is a pure function of (key, counter), so a bed's vitals are reproducible no matter which
+ * worker owns it or which beds share its block. The loop has no carried state and autovectorizes.
+ * @param keys Per-bed random keys.
+ * @param counters Per-bed sample numbers.
+ * @param count Number of beds in the block.
+ * @param heartRate Output, uniform in [55, 85).
+ * @param spo2 Output, uniform in [95, 99.5).
+ */
+void fillVitals(const uint32_t* __restrict keys, const uint32_t* __restrict counters, size_t count,
+                double* __restrict heartRate, double* __restrict spo2) {
+    const double unit = 1.0 / 16777216.0; // 24 random bits -> [0, 1)
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t hrBits = hashCounter(keys[i] ^ (counters[i] * 0x9E3779B9u));
+        uint32_t spo2Bits = hashCounter(hrBits ^ 0x85EBCA6Bu);
+        heartRate[i] = 55.0 + 30.0 * (static_cast<int32_t>(hrBits >> 8) * unit);
+        spo2[i] = 95.0 + 4.5 * (static_cast<int32_t>(spo2Bits >> 8) * unit);
+    }
+}
+
+/**
+ * @brief Structure-of-arrays block of beds due for a sample in one tick, and their generated vitals.
+ */
+struct VitalsBlock {
+    std::vector<uint32_t> beds;     // Worker-local bed indices
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> counters;
+    std::vector<double> heartRate;
+    std::vector<double> spo2;
+
+    void add(uint32_t bed, uint32_t key, uint32_t counter) {
+        beds.push_back(bed);
+        keys.push_back(key);
+        counters.push_back(counter);
+    }
+
+    void generate() {
+        heartRate.resize(beds.size());
+        spo2.resize(beds.size());
+        fillVitals(keys.data(), counters.data(), beds.size(), heartRate.data(), spo2.data());
+    }
+
+    void clear() {
+        beds.clear();
+        keys.clear();
+        counters.clear();
+    }
+};
+
+/**
+ * @brief One-beat ECG and pleth templates, built once and shared by every bed.
+ * A beat is WAVEFORM_TEMPLATE_SAMPLES entries; beds play it back at their own heart rate.
+ */
+class WaveformTemplates {
+    std::vector<int16_t> ecg_;
+    std::vector<int16_t> pleth_;
+
+    static double gaussian(double t, double amplitude, double center, double width) {
+        double x = (t - center) / width;
+        return amplitude * std::exp(-0.5 * x * x);
+    }
+
+    WaveformTemplates() : ecg_(WAVEFORM_TEMPLATE_SAMPLES), pleth_(WAVEFORM_TEMPLATE_SAMPLES) {
+        for (int i = 0; i < WAVEFORM_TEMPLATE_SAMPLES; ++i) {
+            double t = static_cast<double>(i) / WAVEFORM_TEMPLATE_SAMPLES; // Fraction of the beat
+            // P, Q, R, S and T waves in millivolts
+            double mv = gaussian(t, 0.15, 0.20, 0.025) + gaussian(t, -0.10, 0.36, 0.010) + gaussian(t, 1.20, 0.40, 0.012) +
+                        gaussian(t, -0.25, 0.43, 0.012) + gaussian(t, 0.30, 0.65, 0.050);
+            ecg_[i] = static_cast<int16_t>(std::lround(mv * 1000.0 / ECG_MICROVOLTS_PER_COUNT));
+            // Systolic upstroke and dicrotic wave, delayed behind the R peak by the pulse transit time
+            double pleth = 0.1 + gaussian(t, 1.0, 0.55, 0.08) + gaussian(t, 0.35, 0.85, 0.07);
+            pleth_[i] = static_cast<int16_t>(std::lround(pleth * PLETH_FULL_SCALE_COUNTS / 1.5));
+        }
+    }
+
+public:
+    static const WaveformTemplates& instance() {
+        static const WaveformTemplates templates;
+        return templates;
+    }
+
+    const int16_t* ecg() const { return ecg_.data(); }
+    const int16_t* pleth() const { return pleth_.data(); }
+};
+
+/**
+ * @brief Per-bed waveform playback position.
+ */
+struct WaveformState {
+    uint32_t beatPhase = 0; // Position within the current beat; 2^32 = one beat
+    uint32_t sequence = 0;  // Frames published
+};
+
+/**
+ * @brief Builds binary waveform frames into a reusable buffer.
+ *
+ * Frame layout, little-endian:
+ *   0  char[4]  "PBWF"
+ *   4  uint8    version (1)
+ *   5  uint8    channel count (2)
+ *   6  uint16   reserved
+ *   8  uint32   bed instance number
+ *   12 uint32   frame sequence number
+ *   16 int64    first sample time, microseconds since the Unix epoch
+ *   24 uint16   ECG sample rate (Hz), then uint16 ECG sample count
+ *   28 uint16   pleth sample rate (Hz), then uint16 pleth sample count
+ *   32 int16[]  ECG samples (ECG_MICROVOLTS_PER_COUNT uV each), then pleth samples
+ */
+class WaveformWriter {
+    std::string buffer_;
+
+    char* putLe(char* out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            *out++ = static_cast<char>((value >> (8 * i)) & 0xFF);
+        }
+        return out;
+    }
+
+    /**
+     * @brief Play a template back at a beat rate, advancing the shared beat phase.
+     */
+    char* putChannel(char* out, const int16_t* beatTemplate, int count, uint32_t phase, uint32_t phaseStep) {
+        for (int i = 0; i < count; ++i) {
+            uint16_t value = static_cast<uint16_t>(beatTemplate[phase >> (32 - WAVEFORM_TEMPLATE_BITS)]);
+            out[2 * i] = static_cast<char>(value & 0xFF);
+            out[2 * i + 1] = static_cast<char>(value >> 8);
+            phase += phaseStep;
+        }
+        return out + 2 * count;
+    }
+
+public:
+    WaveformWriter() { buffer_.resize(WAVEFORM_HEADER_BYTES + 2 * (ECG_SAMPLES_PER_FRAME + PLETH_SAMPLES_PER_FRAME)); }
+
+    static int samplesPerFrame() { return ECG_SAMPLES_PER_FRAME + PLETH_SAMPLES_PER_FRAME; }
+
+    /**
+     * @brief Build the next frame for a bed.
+     * @param state Bed's playback position; advanced by one frame.
+     * @param instanceNumber Bed instance number written to the header.
+     * @param start Time of the first sample.
+     * @param heartRate Beats per minute for this frame.
+     * @return View of the frame, valid until the next call.
+     */
+    std::string_view write(WaveformState& state, int instanceNumber, std::chrono::system_clock::time_point start, double heartRate) {
+        const WaveformTemplates& templates = WaveformTemplates::instance();
+        double beatsPerFrame = heartRate / 60.0 * WAVEFORM_FRAME_SECONDS;
+        uint32_t ecgStep = static_cast<uint32_t>(beatsPerFrame / ECG_SAMPLES_PER_FRAME * 4294967296.0);
+        uint32_t plethStep = static_cast<uint32_t>(beatsPerFrame / PLETH_SAMPLES_PER_FRAME * 4294967296.0);
+        int64_t startMicros = std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count();
+
+        char* out = &buffer_[0];
+        std::memcpy(out, WAVEFORM_FRAME_MAGIC, 4);
+        out = putLe(out + 4, WAVEFORM_FRAME_VERSION, 1);
+        out = putLe(out, 2, 1);
+        out = putLe(out, 0, 2);
+        out = putLe(out, static_cast<uint32_t>(instanceNumber), 4);
+        out = putLe(out, state.sequence, 4);
+        out = putLe(out, static_cast<uint64_t>(startMicros), 8);
+        out = putLe(out, ECG_SAMPLE_RATE_HZ, 2);
+        out = putLe(out, ECG_SAMPLES_PER_FRAME, 2);
+        out = putLe(out, PLETH_SAMPLE_RATE_HZ, 2);
+        out = putLe(out, PLETH_SAMPLES_PER_FRAME, 2);
+        out = putChannel(out, templates.ecg(), ECG_SAMPLES_PER_FRAME, state.beatPhase, ecgStep);
+        putChannel(out, templates.pleth(), PLETH_SAMPLES_PER_FRAME, state.beatPhase, plethStep);
+
+        state.beatPhase += static_cast<uint32_t>(std::fmod(beatsPerFrame, 1.0) * 4294967296.0); // Whole beats wrap away
+        ++state.sequence;
+        return buffer_;
+    }
+};
+
+/**
+ * @brief A command for one of a worker's beds, parsed on the Paho thread that received it.
+ */
+struct BedCommand {
+    uint32_t bed;  // Worker-local bed index
+    json request;  // null if the payload was not JSON
+};
+
+/**
+ * @brief An encoded command ack waiting for a publish token.
+ */
+struct PendingAck {
+    uint32_t bed;
+    std::string payload;
+};
+
+/**
+ * @brief Fixed-size worker that owns a subset of the fleet and processes their events.
+ * The scheduler hands it batches of expired events; all state of its beds is touched only on
+ * this worker's thread. Vitals are generated per tick for all sampled beds at once from a
+ * counter-based generator; each bed's state machine carries its own compact random stream.
+ */
+class BedWorker {
+    std::vector<PatientBed*> beds_;
+    std::vector<uint32_t> fleetIndex_;     // Parallel to beds_: index used in TimerEvent::bed
+    std::vector<BedSimulator> simulators_; // Parallel to beds_
+    std::vector<TelemetryBatch> batches_;  // Parallel to beds_ when batching
+    std::vector<uint8_t> statePending_;    // Parallel to beds_ in on-change mode: next sample carries state (or is preceded by a state event)
+    std::vector<int64_t> armedDeadline_;   // Parallel to beds_: tick of the live STATE_DEADLINE event
+    std::vector<uint32_t> sampleNumber_;   // Parallel to beds_: samples scheduled so far
+    std::vector<uint16_t> wardOf_;         // Parallel to beds_: index into wardMeals_
+    std::vector<uint32_t> vitalsKey_;      // Parallel to beds_: counter-based vitals generator key
+    std::vector<WaveformState> waveforms_; // Parallel to beds_ with --waveform
+    std::vector<float> lastHeartRate_;     // Parallel to beds_ with --waveform: sets the waveform beat rate
+    std::vector<SpoolRing> spoolRings_;    // Parallel to beds_ with --spool
+    std::vector<WindowAggregate> aggregates_; // --aggregate: one per window per bed, bed-major
+    std::vector<PendingAck> pendingAcks_;  // Throttled acks, retried after every tick
+    std::vector<TelemetrySample> replay_;  // Scratch for replayed samples, reserved to --replay-burst
+    std::vector<PublishOutcome::Retry> retries_; // Scratch for MQTT v5 retries
+    std::vector<uint8_t> held_;            // Parallel to beds_: a throttled sample (or batch) waits for a publish token
+    std::vector<TelemetrySample> heldSamples_; // Parallel to beds_ without batching: the held sample
+    size_t heldCount_ = 0;
+    const SimulatorOptions& options_;
+    SpoolFile* spool_;
+    InfluxSink* influx_;
+    std::string influxLines_;              // Lines formatted in the current tick, handed to influx_ once per tick
+    size_t influxLineCount_ = 0;
+    TraceRecorder* recorder_;
+    std::vector<uint32_t> traceDevice_;    // Parallel to beds_ with --record: index in the trace's device table
+    std::vector<TraceRecord> traceRecords_; // Samples generated in the current tick, handed to recorder_ once per tick
+    uint64_t bedSeed_;
+    TimerInbox& inbox_;
+    SchedulerTimebase timebase_;
+    size_t workerCount_;
+
+    /**
+     * @brief Cached meal state of one ward, valid until boundaryTick.
+     */
+    struct WardMealState {
+        bool active;
+        std::chrono::system_clock::time_point boundary;
+        int64_t boundaryTick;
+    };
+    const MealPlan& mealPlan_;
+    std::chrono::system_clock::time_point wallEpoch_; // Wall time of timebase_.epoch
+    std::vector<WardMealState> wardMeals_;
+    VitalsBlock vitals_;                   // Beds sampled in the current tick
+    TelemetryWriter writer_;
+    std::vector<uint32_t> waveformDue_;    // Beds with a waveform frame due in the current tick
+    WaveformWriter waveformWriter_;
+    WorkerMetrics metrics_;
+
+    std::mutex queueMutex_;
+    std::condition_variable queueChanged_;
+    std::deque<EventBatch> queue_;
+    std::vector<BedCommand> commandInbox_; // Posted by Paho threads, guarded by queueMutex_
+    bool busy_ = false;
+    bool stopping_ = false;
+
+    /**
+     * @brief Bucket that refused a publish.
+     */
+    enum class PublishLimit {
+        NONE,       // Admitted
+        CONNECTION, // --publish-rate
+        FLEET       // --fleet-publish-rate
+    };
+
+    /**
+     * @brief Publish one bed's sample with vitals generated for it.
+     */
+    void publishSample(size_t index, const BedSimulator& sim, double hr, double spo2) {
+        TelemetrySample sample{beds_[index]->clientId, SimClock::wallNow(), hr, spo2, sim.inclination(), sim.state()};
+        if (recorder_ != nullptr) {
+            traceRecords_.push_back({std::chrono::duration_cast<std::chrono::nanoseconds>(sample.time.time_since_epoch()).count(),
+                                     static_cast<float>(hr), static_cast<float>(spo2), static_cast<float>(sample.inclination),
+                                     traceDevice_[index], static_cast<uint8_t>(sample.state)});
+        }
+        publishTelemetry(index, sample);
+    }
+
+    /**
+     * @brief Publish one bed's sample, generated or replayed, through the sinks, spool, batching and rate limits.
+     */
+    void publishTelemetry(size_t index, TelemetrySample sample) {
+        PatientBed& bed = *beds_[index];
+        auto now = SimClock::steadyNow();
+        if (bed.outcome.retriesPending() && bed.connection.client->is_connected()) {
+            republishRetries(bed);
+        }
+
+        if (influx_ != nullptr) {
+            InfluxSink::appendLine(influxLines_, sample); // Every sample, with every field
+            ++influxLineCount_;
+        }
+        if (!options_.mqttSink) return;
+        if (!aggregates_.empty()) {
+            aggregateSample(index, sample);
+            if (options_.aggregateOnly) return;
+        }
+        if (options_.splitStreams) {
+            // State goes on its own stream; retry a state event that could not be sent earlier
+            if (statePending_[index] != 0) publishStateEvent(index);
+            sample.includeState = false;
+        } else if (options_.reportOnChange) {
+            // Vitals every sample; inclination and bedState after transitions and heartbeats
+            sample.includeState = statePending_[index] != 0;
+            statePending_[index] = 0;
+        }
+        if (spool_ != nullptr) {
+            SpoolRing& ring = spoolRings_[index];
+            if (!bed.connection.client->is_connected()) {
+                spoolSample(bed, ring, sample);
+                return;
+            }
+            if (!ring.empty()) {
+                replaySpool(bed, ring);
+            }
+        }
+        if (options_.batching()) {
+            TelemetryBatch& batch = batches_[index];
+            batch.add(sample, now);
+            if (batch.due(static_cast<size_t>(options_.batchSize), options_.batchWindow, now)) {
+                publishDueBatch(index);
+            }
+            return;
+        }
+        if (held_[index] != 0) {
+            // Coalesce: the newer sample replaces the held one and carries any state it was due to carry
+            sample.includeState = sample.includeState || heldSamples_[index].includeState;
+            metrics_.samplesCoalesced.add();
+            if (admitPublish(bed) != PublishLimit::NONE) {
+                heldSamples_[index] = sample;
+                return;
+            }
+            held_[index] = 0;
+            --heldCount_;
+        } else if (PublishLimit limit = admitPublish(bed); limit != PublishLimit::NONE) {
+            countThrottled(bed, limit);
+            if (options_.throttlePolicy == ThrottlePolicy::DROP) {
+                dropSamples(index, &sample, 1);
+            } else {
+                heldSamples_[index] = sample;
+                held_[index] = 1;
+                ++heldCount_;
+            }
+            return;
+        }
+        sendSample(index, sample);
+    }
+
+    /**
+     * @brief Publish one sample that has a publish token; spool or drop it if that fails.
+     */
+    void sendSample(size_t index, const TelemetrySample& sample) {
+        PatientBed& bed = *beds_[index];
+        if (publishSample(bed, sample)) return;
+        if (spool_ == nullptr) {
+            dropSamples(index, &sample, 1);
+        } else {
+            spoolSample(bed, spoolRings_[index], sample);
+        }
+    }
+
+    /**
+     * @brief Publish a bed's due batch as one message, or hold or drop it while the bed is throttled.
+     * A held batch keeps collecting samples (one message either way) up to MAX_HELD_BATCHES batches;
+     * beyond that its oldest samples are dropped.
+     */
+    void publishDueBatch(size_t index) {
+        PatientBed& bed = *beds_[index];
+        TelemetryBatch& batch = batches_[index];
+        if (PublishLimit limit = admitPublish(bed); limit != PublishLimit::NONE) {
+            size_t held = batch.samples().size();
+            size_t maxHeld = MAX_HELD_BATCHES * static_cast<size_t>(options_.batchSize);
+            if (held_[index] != 0) {
+                if (held > maxHeld) {
+                    dropSamples(index, batch.samples().data(), held - maxHeld);
+                    batch.dropOldest(held - maxHeld);
+                }
+                return;
+            }
+            countThrottled(bed, limit);
+            if (options_.throttlePolicy == ThrottlePolicy::DROP) {
+                dropSamples(index, batch.samples().data(), held);
+                batch.clear();
+            } else {
+                held_[index] = 1;
+                ++heldCount_;
+            }
+            return;
+        }
+        if (held_[index] != 0) {
+            held_[index] = 0;
+            --heldCount_;
+        }
+        if (!publishSamples(bed, batch.samples())) {
+            if (spool_ == nullptr) {
+                dropSamples(index, batch.samples().data(), batch.samples().size());
+            } else {
+                for (const TelemetrySample& unsent : batch.samples()) {
+                    spoolSample(bed, spoolRings_[index], unsent);
+                }
+            }
+        }
+        batch.clear();
+    }
+
+    /**
+     * @brief Take a publish token from the bed's connection bucket, then from the fleet bucket.
+     * A connection token is returned when the fleet bucket is empty, so neither is spent on a
+     * message that is not sent.
+     */
+    PublishLimit admitPublish(PatientBed& bed) {
+        auto now = std::chrono::steady_clock::now();
+        if (!bed.connection.publishLimit.tryTake(now)) return PublishLimit::CONNECTION;
+        if (!fleetPublishLimit().tryTake(now)) {
+            bed.connection.publishLimit.refund();
+            return PublishLimit::FLEET;
+        }
+        return PublishLimit::NONE;
+    }
+
+    void countThrottled(const PatientBed& bed, PublishLimit limit) {
+        metrics_.publishesThrottled.add();
+        static LogThrottle throttle;
+        LogLine(LogLevel::WARN, throttle) << "Publish rate limit (" << (limit == PublishLimit::CONNECTION ? "per connection" : "fleet")
+                                          << ") reached for " << bed.clientId << ", "
+                                          << (options_.throttlePolicy == ThrottlePolicy::DROP ? "dropping messages." : "coalescing samples.");
+    }
+
+    /**
+     * @brief Account samples that will never be sent (throttled, or failed without a spool); on-change
+     * state they carried rides on the next sample.
+     */
+    void dropSamples(size_t index, const TelemetrySample* samples, size_t count) {
+        metrics_.samplesDropped.add(count);
+        if (!options_.reportOnChange || options_.splitStreams) return;
+        for (size_t i = 0; i < count; ++i) {
+            if (samples[i].includeState) statePending_[index] = 1;
+        }
+    }
+
+    /**
+     * @brief Send held samples and batches whose bed has a publish token again. Runs after every tick.
+     */
+    void releaseHeld() {
+        for (size_t index = 0; index < held_.size() && heldCount_ > 0; ++index) {
+            if (held_[index] == 0) continue;
+            if (options_.batching()) {
+                publishDueBatch(index);
+                continue;
+            }
+            if (admitPublish(*beds_[index]) != PublishLimit::NONE) continue;
+            held_[index] = 0;
+            --heldCount_;
+            sendSample(index, heldSamples_[index]);
+        }
+    }
+
+    /**
+     * @brief Publish a bed's current inclination and bedState on its state stream.
+     * Left pending while the bed is disconnected or the publish fails, so the next sample retries it.
+     */
+    void publishStateEvent(size_t index) {
+        PatientBed& bed = *beds_[index];
+        const BedSimulator& sim = simulators_[index];
+        statePending_[index] = 1;
+        if (!bed.connection.client->is_connected()) return;
+        if (PublishLimit limit = admitPublish(bed); limit != PublishLimit::NONE) {
+            countThrottled(bed, limit); // Left pending: the next event carries the state current by then
+            return;
+        }
+
+        TelemetrySample event{bed.clientId, SimClock::wallNow(), 0.0, 0.0, sim.inclination(), sim.state()};
+        event.includeVitals = false;
+        std::string encoded;
+        std::string_view payload;
+        if (options_.encoding == PayloadEncoding::JSON) {
+            payload = writer_.write(event);
+        } else {
+            encoded = Telemetry(event).encode(options_.encoding);
+            payload = encoded;
+        }
+        if (!publishPayload(bed, TelemetryStream::STATE, payload)) return;
+        statePending_[index] = 0;
+        metrics_.statesPublished.add();
+    }
+
+    /**
+     * @brief Add a sample to each of its bed's windows, publishing the summary of any window it closes.
+     */
+    void aggregateSample(size_t index, const TelemetrySample& sample) {
+        int64_t seconds = std::chrono::duration_cast<std::chrono::seconds>(sample.time.time_since_epoch()).count();
+        size_t windowCount = options_.aggregateWindows.size();
+        for (size_t w = 0; w < windowCount; ++w) {
+            WindowAggregate& aggregate = aggregates_[index * windowCount + w];
+            int64_t length = options_.aggregateWindows[w].count();
+            int64_t start = seconds - ((seconds % length) + length) % length;
+            if (aggregate.count > 0 && start != aggregate.windowStart) {
+                publishSummary(index, w);
+            }
+            aggregate.add(start, sample);
+        }
+    }
+
+    /**
+     * @brief Publish one window's summary on the bed's summary stream and empty the window.
+     * A summary that cannot be sent is dropped: the next window's summary supersedes it.
+     * @param partial Flushed at the end of the run, before the window closed.
+     */
+    void publishSummary(size_t index, size_t window, bool partial = false) {
+        PatientBed& bed = *beds_[index];
+        WindowAggregate& open = aggregates_[index * options_.aggregateWindows.size() + window];
+        WindowAggregate closed = open;
+        open.count = 0;
+        if (!bed.connection.client->is_connected()) {
+            metrics_.summariesDropped.add();
+            return;
+        }
+        if (PublishLimit limit = admitPublish(bed); limit != PublishLimit::NONE) {
+            countThrottled(bed, limit);
+            metrics_.summariesDropped.add();
+            return;
+        }
+        std::string payload = encodeDocument(closed.toJsonObject(bed.clientId, options_.aggregateWindows[window], partial), options_.encoding);
+        if (!publishPayload(bed, TelemetryStream::SUMMARY, payload)) {
+            metrics_.summariesDropped.add();
+            return;
+        }
+        metrics_.summariesPublished.add();
+    }
+
+    /**
+     * @brief Publish every window still open when the run ends, marked partial, so a run shorter
+     * than a window still reports it.
+     */
+    void flushSummaries() {
+        size_t windowCount = options_.aggregateWindows.size();
+        for (size_t index = 0; index < beds_.size(); ++index) {
+            for (size_t w = 0; w < windowCount; ++w) {
+                if (aggregates_[index * windowCount + w].count > 0) publishSummary(index, w, true);
+            }
+        }
+    }
+
+    /**
+     * @brief Stream that carries telemetry samples: /vitals when split, otherwise /data.
+     */
+    TelemetryStream sampleStream() const {
+        return options_.splitStreams ? TelemetryStream::VITALS : TelemetryStream::DATA;
+    }
+
+    /**
+     * @brief Encode and publish one sample.
+     * @return true if the message was handed to Paho.
+     */
+    bool publishSample(PatientBed& bed, const TelemetrySample& sample) {
+        auto serializeStart = std::chrono::steady_clock::now();
+        std::string encoded;
+        std::string_view payload;
+        if (options_.encoding == PayloadEncoding::JSON) {
+            // Fast path: format straight into the worker's buffer, which Paho copies once into the message
+            payload = writer_.write(sample);
+        } else {
+            encoded = Telemetry(sample).encode(options_.encoding);
+            payload = encoded;
+        }
+        metrics_.serialize.observe(std::chrono::steady_clock::now() - serializeStart);
+        if (!publishPayload(bed, payload)) return false;
+        metrics_.samplesPublished.add();
+        return true;
+    }
+
+    /**
+     * @brief Encode and publish several samples as one array payload.
+     * @return true if the message was handed to Paho.
+     */
+    bool publishSamples(PatientBed& bed, const std::vector<TelemetrySample>& samples) {
+        auto serializeStart = std::chrono::steady_clock::now();
+        std::string encoded;
+        std::string_view payload;
+        if (options_.encoding == PayloadEncoding::JSON) {
+            payload = writer_.writeArray(samples);
+        } else {
+            encoded = encodeBatch(samples, options_.encoding);
+            payload = encoded;
+        }
+        metrics_.serialize.observe(std::chrono::steady_clock::now() - serializeStart);
+        if (!publishPayload(bed, payload)) return false;
+        metrics_.samplesPublished.add(samples.size());
+        return true;
+    }
+
+    /**
+     * @brief Buffer a sample in the bed's spool while it cannot be published.
+     */
+    void spoolSample(PatientBed& bed, SpoolRing& ring, const TelemetrySample& sample) {
+        if (ring.empty()) {
+            static LogThrottle throttle; // Once per bed per outage, but a broker outage hits every bed
+            LogLine(LogLevel::WARN, throttle) << "Client " << bed.clientId << " not connected. Buffering samples to spool...";
+        }
+        metrics_.samplesBuffered.add();
+        if (ring.append(sample)) return;
+        metrics_.samplesDropped.add(); // The oldest record was overwritten
+        if (ring.written() % options_.spoolRecordsPerBed == 0) {
+            // Full: the oldest record was overwritten. Logged once per wrap to keep the output readable.
+            static LogThrottle throttle;
+            LogLine(LogLevel::WARN, throttle) << "Spool full for " << bed.clientId << ", dropping oldest samples.";
+        }
+    }
+
+    /**
+     * @brief Publish up to --replay-burst buffered samples, oldest first.
+     */
+    void replaySpool(PatientBed& bed, SpoolRing& ring) {
+        size_t count = std::min<uint64_t>(ring.size(), static_cast<uint64_t>(options_.replayBurst));
+        if (options_.batching()) {
+            count = std::min(count, static_cast<size_t>(options_.batchSize));
+        }
+        replay_.clear();
+        for (size_t i = 0; i < count; ++i) {
+            replay_.push_back(ring.at(i, bed.clientId));
+        }
+        // Replay is paced by the publish-rate limits: unsent samples simply stay in the spool
+        if (options_.batching()) {
+            if (admitPublish(bed) != PublishLimit::NONE) return;
+            if (!publishSamples(bed, replay_)) return;
+            ring.pop(count);
+            metrics_.samplesReplayed.add(count);
+        } else {
+            for (const TelemetrySample& sample : replay_) {
+                if (admitPublish(bed) != PublishLimit::NONE) return;
+                if (!publishSample(bed, sample)) return;
+                ring.pop(1);
+                metrics_.samplesReplayed.add();
+            }
+        }
+        if (ring.empty()) {
+            static LogThrottle throttle;
+            LogLine(LogLevel::INFO, throttle) << "Spool drained for " << bed.clientId;
+        }
+    }
+
+    /**
+     * @brief Publish an encoded sample payload on the bed's sample stream, honouring its in-flight window.
+     * @return true if the message was handed to Paho.
+     */
+    bool publishPayload(PatientBed& bed, std::string_view payload) {
+        return publishPayload(bed, sampleStream(), payload);
+    }
+
+    /**
+     * @brief Publish a payload on one of the bed's streams at that stream's QoS (--qos).
+     * QoS 0 messages are sent without waiting and without a window slot, so the in-flight
+     * window only holds messages that need a PUBACK.
+     * @return true if the message was handed to Paho.
+     */
+    bool publishPayload(PatientBed& bed, TelemetryStream stream, std::string_view payload, int attempt = 0) {
+        int qos = options_.streamQos[static_cast<size_t>(stream)];
+        mqtt::message_ptr pubmsg = bed.makeMessage(stream, payload, qos);
+
+        try {
+            if (!bed.connection.client->is_connected()) {
+                static LogThrottle throttle; // Repeats on every publish attempt while disconnected
+                LogLine(LogLevel::WARN, throttle) << "Client " << bed.clientId << " not connected. Retrying connection by Paho...";
+            }
+            if (qos == 0) {
+                bed.connection.client->publish(pubmsg);
+                bed.markAliasSent(stream);
+                metrics_.messagesPublished.add();
+                return true;
+            }
+            if (!bed.connection.window.enabled()) {
+                auto sentAt = std::chrono::steady_clock::now();
+                if (bed.connection.mqtt5) {
+                    // A failed PUBACK is retried by PublishOutcome rather than reported here
+                    mqtt::delivery_token_ptr token = bed.connection.client->publish(pubmsg, PublishOutcome::context(stream, attempt), bed.outcome);
+                    bed.markAliasSent(stream);
+                    try {
+                        token->wait();
+                    } catch (const mqtt::exception&) {
+                        return true;
+                    }
+                } else {
+                    bed.connection.client->publish(pubmsg)->wait();
+                }
+                fleetMetrics().publishToAck.observeShared(std::chrono::steady_clock::now() - sentAt);
+                metrics_.messagesPublished.add();
+                return true;
+            }
+            // Back-pressure only when K messages are already awaiting PUBACK
+            if (!bed.connection.window.acquire(pubmsg.get(), std::chrono::milliseconds(TIMEOUT))) {
+                static LogThrottle throttle;
+                LogLine(LogLevel::WARN, throttle) << "Publish window full for " << bed.clientId << ", dropping sample.";
+                return false;
+            }
+            try {
+                if (bed.connection.mqtt5) {
+                    bed.connection.client->publish(pubmsg, PublishOutcome::context(stream, attempt), bed.outcome);
+                } else {
+                    bed.connection.client->publish(pubmsg);
+                }
+            } catch (const mqtt::exception&) {
+                bed.connection.window.release(pubmsg.get(), false);
+                throw;
+            }
+            bed.markAliasSent(stream);
+            metrics_.messagesPublished.add();
+            return true;
+        } catch (const mqtt::exception& exc) {
+            static LogThrottle throttle;
+            LogLine(LogLevel::ERROR, throttle) << "Error publishing " << bed.clientId << ": " << exc.what();
+        }
+        return false;
+    }
+
+    /**
+     * @brief Republish messages whose PUBACK carried a retryable MQTT v5 reason code.
+     */
+    void republishRetries(PatientBed& bed) {
+        bed.outcome.takeRetries(retries_);
+        for (const PublishOutcome::Retry& retry : retries_) {
+            PublishLimit limit = admitPublish(bed);
+            if (limit != PublishLimit::NONE) {
+                countThrottled(bed, limit);
+                fleetMetrics().publishFailures.addShared();
+            } else if (!publishPayload(bed, retry.stream, retry.payload, retry.attempt)) {
+                fleetMetrics().publishFailures.addShared();
+            }
+        }
+        retries_.clear();
+    }
+
+    /**
+     * @brief Evaluate a ward's meal schedule at a wall time and find its next boundary.
+     */
+    WardMealState wardMealStateAt(uint16_t ward, std::chrono::system_clock::time_point time) const {
+        const MealSchedule& schedule = mealPlan_.schedule(ward);
+        WardMealState meal{schedule.activeAt(time), schedule.nextBoundary(time), std::numeric_limits<int64_t>::max()};
+        if (meal.boundary != std::chrono::system_clock::time_point::max()) {
+            meal.boundaryTick = timebase_.tickAt(timebase_.epoch + (meal.boundary - wallEpoch_));
+        }
+        return meal;
+    }
+
+    /**
+     * @brief Next tick at which a bed's state machine must run: its random-duration expiry or its ward's meal boundary.
+     */
+    int64_t nextStateTick(size_t index) const {
+        const BedSimulator& sim = simulators_[index];
+        int64_t mealTick = wardMeals_[wardOf_[index]].boundaryTick;
+        if (sim.inMealIncline()) return mealTick; // The random duration is suspended until the meal ends
+        return std::min(timebase_.tickAt(sim.nextNonMealDeadline()), mealTick);
+    }
+
+    /**
+     * @brief Advance one bed's state machine and keep its STATE_DEADLINE event armed.
+     */
+    void stepBed(size_t index) {
+        BedSimulator& sim = simulators_[index];
+        onTransition(index, sim.step(SimClock::steadyNow(), wardMeals_[wardOf_[index]].active));
+    }
+
+    /**
+     * @brief Log and report a bed's state change, and keep its STATE_DEADLINE event armed.
+     */
+    void onTransition(size_t index, BedTransition transition) {
+        logBedTransition(beds_[index]->deviceInstanceNumStr, transition, simulators_[index].inclination());
+        if (transition != BedTransition::NONE && options_.splitStreams) {
+            publishStateEvent(index); // Sent when it happens rather than with the next sample
+        } else if (transition != BedTransition::NONE && options_.reportOnChange) {
+            statePending_[index] = 1;
+        }
+        int64_t deadline = nextStateTick(index);
+        if (deadline != armedDeadline_[index]) {
+            armedDeadline_[index] = deadline;
+            inbox_.post({deadline, fleetIndex_[index], BedEventKind::STATE_DEADLINE});
+        }
+    }
+
+    /**
+     * @brief Apply received commands to their beds' state machines and ack each one.
+     * The only command is {"command": "incline", "inclination": <degrees>}; "id" and "sentAt" are echoed in the ack.
+     */
+    void handleCommands(const std::vector<BedCommand>& commands) {
+        for (const BedCommand& command : commands) {
+            size_t index = command.bed;
+            PatientBed& bed = *beds_[index];
+            BedSimulator& sim = simulators_[index];
+            const json& request = command.request;
+            bool valid = request.is_object() && request.contains("command") && request["command"] == "incline" &&
+                         request.contains("inclination") && request["inclination"].is_number();
+            double degrees = valid ? request["inclination"].get<double>() : 0.0;
+            valid = valid && degrees >= 0.0 && degrees <= MAX_COMMAND_INCLINATION_DEGREES;
+            if (valid) {
+                onTransition(index, sim.command(SimClock::steadyNow(), degrees));
+                metrics_.commandsApplied.add();
+            } else {
+                static LogThrottle throttle;
+                LogLine(LogLevel::WARN, throttle) << "Rejected command for " << bed.clientId << ": " << (request.is_null() ? "not JSON" : request.dump());
+                metrics_.commandsRejected.add();
+            }
+
+            json ack;
+            ack["deviceId"] = bed.clientId;
+            if (request.is_object() && request.contains("id")) ack["id"] = request["id"];
+            if (request.is_object() && request.contains("sentAt")) ack["sentAt"] = request["sentAt"];
+            ack["status"] = valid ? "ok" : "rejected";
+            ack["inclination"] = sim.inclination();
+            ack["bedState"] = sim.state() == BedInclinationState::FLAT ? "FLAT" : "INCLINED";
+            char timestamp[TIMESTAMP_BUFFER_BYTES];
+            ack["timestamp"] = std::string(timestamp, formatTimestampLocal(SimClock::wallNow(), timestamp, sizeof(timestamp)));
+            pendingAcks_.push_back({command.bed, encodeDocument(ack, options_.encoding)});
+        }
+        publishAcks();
+    }
+
+    /**
+     * @brief Publish pending command acks; a throttled ack waits for the next tick, any other failure drops it.
+     */
+    void publishAcks() {
+        size_t kept = 0;
+        for (PendingAck& ack : pendingAcks_) {
+            PatientBed& bed = *beds_[ack.bed];
+            if (!bed.connection.client->is_connected()) continue;
+            if (PublishLimit limit = admitPublish(bed); limit != PublishLimit::NONE) {
+                countThrottled(bed, limit);
+                pendingAcks_[kept++] = std::move(ack);
+                continue;
+            }
+            if (publishPayload(bed, TelemetryStream::ACK, ack.payload)) metrics_.acksPublished.add();
+        }
+        pendingAcks_.resize(kept);
+    }
+
+    /**
+     * @brief Tick of a bed's k-th sample: phase + k periods, plus bounded deterministic jitter.
+     * Deadlines are absolute, so jitter never accumulates into drift.
+     */
+    int64_t sampleTick(size_t index, uint32_t k) const {
+        int instanceNumber = beds_[index]->instanceNumber;
+        int64_t tick = k * SchedulerTimebase::ticksIn(std::chrono::seconds(DATA_SEND_INTERVAL_SECONDS));
+        if (options_.phaseSpread) {
+            tick += samplePhaseTicks(instanceNumber);
+        }
+        int64_t jitterTicks = options_.jitter.count() / SCHEDULER_TICK_MS;
+        if (jitterTicks > 0) {
+            uint32_t draw = mixSeed((static_cast<uint64_t>(instanceNumber) << 32) | k, PHASE_SPREAD_SEED);
+            tick += static_cast<int64_t>(draw % static_cast<uint32_t>(2 * jitterTicks + 1)) - jitterTicks;
+        }
+        return tick;
+    }
+
+    /**
+     * @brief Handle every event of one scheduler tick.
+     */
+    void process(const EventBatch& batch) {
+        SimClock::sleepUntil(batch.time); // Pins this thread's virtual time in AS_FAST_AS_POSSIBLE mode
+        int64_t tick = timebase_.tickAt(batch.time);
+
+        // --- Inclination Logic using Local System Time ---
+        // Meal slots are only re-evaluated when a ward crosses its precomputed boundary
+        for (size_t ward = 0; ward < wardMeals_.size(); ++ward) {
+            if (tick >= wardMeals_[ward].boundaryTick) {
+                wardMeals_[ward] = wardMealStateAt(static_cast<uint16_t>(ward), wardMeals_[ward].boundary);
+            }
+        }
+
+        for (const TimerEvent& event : batch.events) {
+            size_t index = event.bed / workerCount_;
+            switch (event.kind) {
+            case BedEventKind::SAMPLE:
+                if (tick >= armedDeadline_[index]) {
+                    stepBed(index); // Due in this tick: update state before it is published
+                }
+                vitals_.add(static_cast<uint32_t>(index), vitalsKey_[index], sampleNumber_[index]);
+                // Absolute deadlines: the period does not drift by publish latency
+                inbox_.post({sampleTick(index, ++sampleNumber_[index]), event.bed, BedEventKind::SAMPLE});
+                break;
+            case BedEventKind::STATE_HEARTBEAT:
+                if (options_.splitStreams) {
+                    publishStateEvent(index);
+                } else {
+                    statePending_[index] = 1;
+                }
+                inbox_.post({event.deadlineTick + SchedulerTimebase::ticksIn(options_.stateHeartbeat), event.bed, BedEventKind::STATE_HEARTBEAT});
+                break;
+            case BedEventKind::STATE_DEADLINE:
+                if (event.deadlineTick == armedDeadline_[index]) { // Otherwise superseded by a newer deadline
+                    stepBed(index);
+                }
+                break;
+            case BedEventKind::WAVEFORM:
+                waveformDue_.push_back(static_cast<uint32_t>(index));
+                inbox_.post({event.deadlineTick + SchedulerTimebase::ticksIn(std::chrono::seconds(WAVEFORM_FRAME_SECONDS)), event.bed, BedEventKind::WAVEFORM});
+                break;
+            }
+        }
+        // --- End of Inclination Logic ---
+
+        // Vitals for every bed sampled in this tick in one pass, then publish in event order
+        vitals_.generate();
+        for (size_t i = 0; i < vitals_.beds.size(); ++i) {
+            size_t index = vitals_.beds[i];
+            publishSample(index, simulators_[index], vitals_.heartRate[i], vitals_.spo2[i]);
+            if (options_.waveform) lastHeartRate_[index] = static_cast<float>(vitals_.heartRate[i]);
+        }
+        vitals_.clear();
+
+        if (!waveformDue_.empty()) {
+            publishWaveforms();
+        }
+        endTick();
+    }
+
+    /**
+     * @brief Work done once per tick after its samples: held samples, then the lines and records for the sinks.
+     */
+    void endTick() {
+        if (heldCount_ > 0) {
+            releaseHeld();
+        }
+        if (!pendingAcks_.empty()) {
+            publishAcks();
+        }
+        if (influxLineCount_ > 0) {
+            influx_->append(influxLines_, influxLineCount_);
+            influxLineCount_ = 0;
+        }
+        if (!traceRecords_.empty()) {
+            recorder_->append(traceRecords_.data(), traceRecords_.size());
+            traceRecords_.clear();
+        }
+    }
+
+    /**
+     * @brief Build and publish the frames due in this tick, accounting their samples and thread CPU time.
+     */
+    void publishWaveforms() {
+        timespec cpuStart{};
+        timespec cpuEnd{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+        // The frame holds the second of signal that ends now
+        auto start = SimClock::wallNow() - std::chrono::seconds(WAVEFORM_FRAME_SECONDS);
+        for (uint32_t index : waveformDue_) {
+            PatientBed& bed = *beds_[index];
+            std::string_view frame = waveformWriter_.write(waveforms_[index], bed.instanceNumber, start, lastHeartRate_[index]);
+            if (!bed.connection.client->is_connected()) continue;
+            if (PublishLimit limit = admitPublish(bed); limit != PublishLimit::NONE) {
+                countThrottled(bed, limit); // A late frame is worthless: dropped under either policy
+                continue;
+            }
+            publishPayload(bed, TelemetryStream::WAVEFORM, frame);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+        int64_t nanos = (cpuEnd.tv_sec - cpuStart.tv_sec) * 1000000000LL + (cpuEnd.tv_nsec - cpuStart.tv_nsec);
+        metrics_.waveformSamples.add(waveformDue_.size() * WaveformWriter::samplesPerFrame());
+        metrics_.waveformCpuNanos.add(static_cast<uint64_t>(nanos));
+        waveformDue_.clear();
+    }
+
+public:
+    /**
+     * @brief Construct a worker.
+     * @param bedSeed Base seed from which each bed's state machine seed and vitals key are derived by instance number.
+     * @param options Simulator options; must outlive the worker.
+     * @param spool Store-and-forward spool, or nullptr.
+     * @param influx InfluxDB sink, or nullptr.
+     * @param recorder Trace recorder (--record), or nullptr.
+     * @param inbox Scheduler inbox for re-armed events.
+     * @param timebase Scheduler tick timebase.
+     * @param workerCount Number of workers; beds are assigned round-robin by fleet index.
+     * @param mealPlan Ward meal schedules; must outlive the worker.
+     */
+    BedWorker(uint64_t bedSeed, const SimulatorOptions& options, SpoolFile* spool, InfluxSink* influx, TraceRecorder* recorder,
+              TimerInbox& inbox, SchedulerTimebase timebase, size_t workerCount, const MealPlan& mealPlan)
+        : options_(options), spool_(spool), influx_(influx), recorder_(recorder), bedSeed_(bedSeed), inbox_(inbox), timebase_(timebase),
+          workerCount_(workerCount), mealPlan_(mealPlan), wallEpoch_(SimClock::toWall(timebase.epoch)) {
+        replay_.reserve(static_cast<size_t>(options_.replayBurst));
+        for (size_t ward = 0; ward < mealPlan_.wardCount(); ++ward) {
+            wardMeals_.push_back(wardMealStateAt(static_cast<uint16_t>(ward), wallEpoch_));
+        }
+    }
+
+    /**
+     * @brief Assign a bed to this worker, start its state machine FLAT and arm its first events.
+     * @param bed Bed owned by the fleet; must outlive the worker.
+     * @param fleetIndex Bed's index in the fleet; fleetIndex % workerCount must equal this worker.
+     */
+    void addBed(PatientBed* bed, uint32_t fleetIndex) {
+        beds_.push_back(bed);
+        if (bed->connection.mqtt5) {
+            bed->preparePublishProperties(options_.encoding, options_.messageExpirySeconds);
+        }
+        fleetIndex_.push_back(fleetIndex);
+        simulators_.emplace_back(mixSeed(bedSeed_, static_cast<uint64_t>(bed->instanceNumber)), timebase_.epoch);
+        vitalsKey_.push_back(mixSeed(bedSeed_ ^ VITALS_STREAM_SEED, static_cast<uint64_t>(bed->instanceNumber)));
+        if (options_.batching()) {
+            batches_.emplace_back(static_cast<size_t>(options_.batchSize));
+        }
+        statePending_.push_back(1); // The first sample always carries state
+        held_.push_back(0);
+        if (!options_.batching()) {
+            heldSamples_.emplace_back();
+        }
+        if (spool_ != nullptr) {
+            spoolRings_.push_back(spool_->ring(bed->instanceNumber));
+        }
+        if (recorder_ != nullptr) {
+            traceDevice_.push_back(recorder_->intern(bed->instanceNumber));
+        }
+        aggregates_.resize(aggregates_.size() + options_.aggregateWindows.size());
+
+        sampleNumber_.push_back(0);
+        wardOf_.push_back(mealPlan_.wardOf(bed->instanceNumber));
+        if (!options_.tracePath.empty()) {
+            armedDeadline_.push_back(std::numeric_limits<int64_t>::max());
+            return; // Replayed beds publish recorded samples instead of scheduled ones
+        }
+        inbox_.post({sampleTick(beds_.size() - 1, 0), fleetIndex, BedEventKind::SAMPLE});
+        if (options_.reportOnChange) {
+            // Offset like the samples: split-stream heartbeats are QoS 1 /state messages of their own
+            int64_t phase = options_.phaseSpread ? samplePhaseTicks(bed->instanceNumber) : 0;
+            inbox_.post({SchedulerTimebase::ticksIn(options_.stateHeartbeat) + phase, fleetIndex, BedEventKind::STATE_HEARTBEAT});
+        }
+        if (options_.waveform) {
+            waveforms_.emplace_back();
+            lastHeartRate_.push_back(WAVEFORM_INITIAL_HEART_RATE);
+            int64_t frameTicks = SchedulerTimebase::ticksIn(std::chrono::seconds(WAVEFORM_FRAME_SECONDS));
+            int64_t phase = options_.phaseSpread ? samplePhaseTicks(bed->instanceNumber) % frameTicks : 0;
+            inbox_.post({frameTicks + phase, fleetIndex, BedEventKind::WAVEFORM});
+        }
+        int64_t deadline = nextStateTick(beds_.size() - 1);
+        armedDeadline_.push_back(deadline);
+        inbox_.post({deadline, fleetIndex, BedEventKind::STATE_DEADLINE});
+    }
+
+    /**
+     * @brief Queue a batch of expired events, waiting while the worker is MAX_QUEUED_BATCHES behind.
+     * @param batch Events for this worker's beds.
+     */
+    void submit(EventBatch&& batch) {
+        std::unique_lock<std::mutex> lock(queueMutex_);
+        queueChanged_.wait(lock, [this] { return queue_.size() < MAX_QUEUED_BATCHES; });
+        queue_.push_back(std::move(batch));
+        queueChanged_.notify_all();
+    }
+
+    /**
+     * @brief Queue a command for one of this worker's beds; handled at once, between ticks. Safe from any thread.
+     * @param fleetIndex Bed's index in the fleet.
+     * @param request Parsed command payload, or null if it was not JSON.
+     */
+    void postCommand(uint32_t fleetIndex, json request) {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        commandInbox_.push_back({static_cast<uint32_t>(fleetIndex / workerCount_), std::move(request)});
+        queueChanged_.notify_all();
+    }
+
+    /**
+     * @brief Wait until every submitted batch has been processed.
+     */
+    void waitIdle() {
+        std::unique_lock<std::mutex> lock(queueMutex_);
+        queueChanged_.wait(lock, [this] { return queue_.empty() && !busy_; });
+    }
+
+    /**
+     * @brief This worker's counters; safe to read from any thread.
+     */
+    const WorkerMetrics& metrics() const { return metrics_; }
+
+    /**
+     * @brief Ask run() to return once the queue is drained.
+     */
+    void stop() {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        stopping_ = true;
+        queueChanged_.notify_all();
+    }
+
+    /**
+     * @brief Process submitted batches and posted commands until stop().
+     */
+    void run() {
+        std::vector<BedCommand> commands;
+        while (true) {
+            EventBatch batch;
+            bool haveBatch = false;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex_);
+                queueChanged_.wait(lock, [this] { return !queue_.empty() || !commandInbox_.empty() || stopping_; });
+                commands.swap(commandInbox_);
+                if (queue_.empty() && commands.empty()) {
+                    lock.unlock();
+                    flushSummaries();
+                    return;
+                }
+                if (!queue_.empty()) {
+                    batch = std::move(queue_.front());
+                    queue_.pop_front();
+                    haveBatch = true;
+                }
+                busy_ = true;
+                queueChanged_.notify_all();
+            }
+            if (!commands.empty()) {
+                handleCommands(commands);
+                commands.clear();
+            }
+            if (haveBatch) process(batch);
+            {
+                std::lock_guard<std::mutex> lock(queueMutex_);
+                busy_ = false;
+                queueChanged_.notify_all();
+            }
+        }
+    }
+
+    /**
+     * @brief Publish this worker's beds' samples from a trace on their recorded schedule; used instead of run().
+     * Samples keep their recorded timestamps. Only the device column is read for other workers' beds.
+     * @param trace Mapped trace; beds not in it publish nothing.
+     * @param speed Replay speed-up (1 = the recorded pace); 0 = as fast as the publish pipeline allows.
+     * @param start Steady time of the trace's earliest sample, shared by every worker.
+     * @return uint64_t Samples replayed.
+     */
+    uint64_t replay(const TraceFile& trace, double speed, std::chrono::steady_clock::time_point start) {
+        std::unordered_map<int, int32_t> byInstance;
+        for (size_t index = 0; index < beds_.size(); ++index) {
+            byInstance.emplace(beds_[index]->instanceNumber, static_cast<int32_t>(index));
+        }
+        std::vector<int32_t> localOf(trace.deviceCount(), -1); // Trace device -> this worker's bed index
+        for (uint32_t device = 0; device < trace.deviceCount(); ++device) {
+            auto found = byInstance.find(trace.instanceNumber(device));
+            if (found != byInstance.end()) localOf[device] = found->second;
+        }
+        std::vector<float> lastInclination(beds_.size(), std::numeric_limits<float>::quiet_NaN());
+        auto traceStart = trace.start();
+        uint64_t replayed = 0;
+        for (uint64_t b = 0; b < trace.blockCount(); ++b) {
+            TraceBlock block = trace.block(b);
+            for (size_t i = 0; i < block.count; ++i) {
+                int32_t index = localOf[block.device[i]];
+                if (index < 0) continue;
+                auto time = std::chrono::system_clock::time_point(
+                    std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(block.epochNanos[i])));
+                if (speed > 0.0) {
+                    auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>((time - traceStart) / speed);
+                    if (due > std::chrono::steady_clock::now()) {
+                        endTick(); // Everything due so far goes out before waiting
+                        std::this_thread::sleep_until(due);
+                    }
+                }
+                if (options_.reportOnChange && block.inclination[i] != lastInclination[index]) {
+                    statePending_[index] = 1; // A recorded transition (or the bed's first sample)
+                }
+                lastInclination[index] = block.inclination[i];
+                TelemetrySample sample{beds_[index]->clientId, time, block.heartRate[i], block.spo2[i], block.inclination[i],
+                                       static_cast<BedInclinationState>(block.state[i])};
+                publishTelemetry(static_cast<size_t>(index), sample);
+                ++replayed;
+            }
+            endTick();
+        }
+        flushSummaries();
+        return replayed;
+    }
+};
+
+/**
+ * @brief Drives every bed's events from one thread with a TimerWheel and hands them to the
+ * owning workers in per-tick batches.
+ */
+class FleetScheduler {
+    SchedulerTimebase timebase_;
+    TimerWheel wheel_;
+    TimerInbox inbox_;
+    std::vector<BedWorker*> workers_;
+    std::vector<TimerEvent> expired_;
+    std::vector<TimerEvent> rearmed_;
+    uint64_t reportedWaveformSamples_ = 0;
+    uint64_t reportedWaveformCpuNanos_ = 0;
+
+public:
+    /**
+     * @brief Construct a scheduler.
+     * @param epoch SimClock time of tick 0.
+     */
+    explicit FleetScheduler(std::chrono::steady_clock::time_point epoch) : timebase_{epoch} {}
+
+    /**
+     * @brief Log waveform samples per simulated second and per CPU-second of worker time since the last report.
+     */
+    void logWaveformThroughput() {
+        uint64_t samples = 0;
+        uint64_t cpuNanos = 0;
+        for (const BedWorker* worker : workers_) {
+            samples += worker->metrics().waveformSamples.value();
+            cpuNanos += worker->metrics().waveformCpuNanos.value();
+        }
+        if (samples == reportedWaveformSamples_) return;
+        double deltaSamples = static_cast<double>(samples - reportedWaveformSamples_);
+        double deltaCpuSeconds = static_cast<double>(cpuNanos - reportedWaveformCpuNanos_) / 1e9;
+        LogLine(LogLevel::INFO) << "Waveform: " << static_cast<uint64_t>(deltaSamples / PUBLISH_RATE_REPORT_SECONDS)
+                  << " samples/s sustained, " << static_cast<uint64_t>(deltaCpuSeconds > 0 ? deltaSamples / deltaCpuSeconds : 0.0)
+                  << " samples per worker CPU-second (per core)";
+        reportedWaveformSamples_ = samples;
+        reportedWaveformCpuNanos_ = cpuNanos;
+    }
+
+    TimerInbox& inbox() { return inbox_; }
+    const SchedulerTimebase& timebase() const { return timebase_; }
+
+    /**
+     * @brief Register workers in fleet-index order (bed i belongs to worker i % count).
+     */
+    void addWorker(BedWorker* worker) { workers_.push_back(worker); }
+
+    /**
+     * @brief Run the wheel until duration has elapsed (0 = forever).
+     * @param duration Simulated run length.
+     */
+    void run(std::chrono::seconds duration) {
+        int64_t endTick = duration.count() > 0 ? SchedulerTimebase::ticksIn(duration) : INT64_MAX;
+        std::vector<std::vector<TimerEvent>> perWorker(workers_.size());
+        bool lockstep = SimClock::mode() == SimClock::Mode::AS_FAST_AS_POSSIBLE;
+        int64_t ticksPerBin = SchedulerTimebase::ticksIn(std::chrono::milliseconds(PUBLISH_RATE_BIN_MS));
+        size_t binsPerReport = static_cast<size_t>(PUBLISH_RATE_REPORT_SECONDS * 1000 / PUBLISH_RATE_BIN_MS);
+        std::vector<uint32_t> rateBins;
+        rateBins.reserve(binsPerReport);
+        uint32_t samplesInBin = 0;
+        while (wheel_.currentTick() < endTick) {
+            inbox_.drain(rearmed_);
+            for (const TimerEvent& event : rearmed_) {
+                wheel_.insert(event);
+            }
+            rearmed_.clear();
+
+            int64_t tick = wheel_.currentTick() + 1;
+            auto tickTime = timebase_.timeOf(tick);
+            SimClock::sleepUntil(tickTime);
+            auto lag = SimClock::steadyNow() - tickTime;
+            fleetMetrics().schedulerLag.observe(lag);
+            if (lag > std::chrono::milliseconds(SCHEDULER_TICK_MS)) {
+                fleetMetrics().loopOverruns.add();
+            }
+            wheel_.advance(expired_);
+            if (tick % ticksPerBin == 0) {
+                // Instantaneous sample rate, reported as a distribution once per PUBLISH_RATE_REPORT_SECONDS
+                rateBins.push_back(samplesInBin);
+                samplesInBin = 0;
+                if (rateBins.size() == binsPerReport) {
+                    logRateDistribution("Sample publish rate", rateBins, PUBLISH_RATE_BIN_MS);
+                    rateBins.clear();
+                    logWaveformThroughput();
+                }
+            }
+            if (expired_.empty()) continue;
+
+            for (const TimerEvent& event : expired_) {
+                if (event.kind == BedEventKind::SAMPLE) ++samplesInBin;
+                perWorker[event.bed % workers_.size()].push_back(event);
+            }
+            expired_.clear();
+            for (size_t w = 0; w < workers_.size(); ++w) {
+                if (!perWorker[w].empty()) {
+                    workers_[w]->submit(EventBatch{tickTime, std::move(perWorker[w])});
+                    perWorker[w].clear();
+                }
+            }
+            if (lockstep) {
+                // Virtual time only advances once every worker has re-armed its events: deterministic runs
+                for (BedWorker* worker : workers_) worker->waitIdle();
+            }
+        }
+    }
+
+    /**
+     * @brief Ask every worker to return from run() once its queue is drained.
+     */
+    void stopWorkers() {
+        for (BedWorker* worker : workers_) {
+            worker->stop();
+        }
+    }
+};
+
+/**
+ * @brief Append one Prometheus metric family header.
+ */
+void appendMetricHeader(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void appendMetricValue(std::string& out, const char* name, const std::string& labels, double value) {
+    std::ostringstream line;
+    line << std::setprecision(15) << name << labels << ' ' << value << '\n'; // Counters stay exact past a million
+    out += line.str();
+}
+
+/**
+ * @brief Append a histogram in seconds from non-cumulative power-of-two buckets.
+ */
+void appendHistogram(std::string& out, const char* name, const char* help, const std::vector<uint64_t>& buckets, uint64_t sumNanos) {
+    appendMetricHeader(out, name, "histogram", help);
+    std::string bucketName = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        cumulative += buckets[i];
+        std::ostringstream label;
+        if (i + 1 < buckets.size()) {
+            label << "{le=\"" << LatencyHistogram::bucketBoundSeconds(i) << "\"}";
+        } else {
+            label << "{le=\"+Inf\"}";
+        }
+        appendMetricValue(out, bucketName.c_str(), label.str(), static_cast<double>(cumulative));
+    }
+    appendMetricValue(out, (std::string(name) + "_sum").c_str(), "", sumNanos / 1e9);
+    appendMetricValue(out, (std::string(name) + "_count").c_str(), "", static_cast<double>(cumulative));
+}
+
+/**
+ * @brief Render every metric in the Prometheus text exposition format.
+ * Worker counters are summed here, at scrape time; in-flight depth is read from each connection's window.
+ */
+std::string renderMetrics(const std::vector<std::unique_ptr<BedWorker>>& workers, const std::vector<MqttConnection*>& connections) {
+    struct WorkerCounter {
+        const char* name;
+        const char* help;
+        const MetricCounter WorkerMetrics::*counter;
+    };
+    static const WorkerCounter workerCounters[] = {
+        {"patientbed_messages_published_total", "MQTT messages handed to Paho.", &WorkerMetrics::messagesPublished},
+        {"patientbed_samples_published_total", "Telemetry samples handed to Paho.", &WorkerMetrics::samplesPublished},
+        {"patientbed_samples_dropped_total", "Samples neither published nor buffered, or overwritten in a full spool.", &WorkerMetrics::samplesDropped},
+        {"patientbed_samples_buffered_total", "Samples written to the store-and-forward spool.", &WorkerMetrics::samplesBuffered},
+        {"patientbed_samples_replayed_total", "Samples published from the spool after reconnecting.", &WorkerMetrics::samplesReplayed},
+        {"patientbed_state_events_published_total", "State events handed to Paho on the state stream.", &WorkerMetrics::statesPublished},
+        {"patientbed_summaries_published_total", "Window summaries handed to Paho on the summary stream.", &WorkerMetrics::summariesPublished},
+        {"patientbed_commands_applied_total", "Commands received on the command topic and applied to the bed.", &WorkerMetrics::commandsApplied},
+        {"patientbed_commands_rejected_total", "Commands received on the command topic that were malformed, unknown or out of range.", &WorkerMetrics::commandsRejected},
+        {"patientbed_command_acks_published_total", "Command acks handed to Paho on the ack stream.", &WorkerMetrics::acksPublished},
+        {"patientbed_summaries_dropped_total", "Window summaries not sent because the bed was disconnected, throttled or the publish failed.", &WorkerMetrics::summariesDropped},
+        {"patientbed_publishes_throttled_total", "Messages held back or dropped by the per-connection or fleet publish-rate limit.", &WorkerMetrics::publishesThrottled},
+        {"patientbed_samples_coalesced_total", "Throttled samples superseded by a newer sample of the same bed.", &WorkerMetrics::samplesCoalesced},
+        {"patientbed_waveform_samples_total", "Waveform samples published.", &WorkerMetrics::waveformSamples},
+    };
+
+    std::string out;
+    for (const WorkerCounter& family : workerCounters) {
+        appendMetricHeader(out, family.name, "counter", family.help);
+        for (size_t w = 0; w < workers.size(); ++w) {
+            appendMetricValue(out, family.name, "{worker=\"" + std::to_string(w) + "\"}", static_cast<double>((workers[w]->metrics().*family.counter).value()));
+        }
+    }
+
+    std::vector<uint64_t> buckets;
+    uint64_t sumNanos = 0;
+    for (const auto& worker : workers) worker->metrics().serialize.accumulate(buckets, sumNanos);
+    appendHistogram(out, "patientbed_serialize_seconds", "Time to encode one payload.", buckets, sumNanos);
+
+    FleetMetrics& fleet = fleetMetrics();
+    buckets.clear();
+    sumNanos = 0;
+    fleet.publishToAck.accumulate(buckets, sumNanos);
+    appendHistogram(out, "patientbed_publish_ack_seconds", "QoS1 publish to PUBACK latency, sampled per bed.", buckets, sumNanos);
+    buckets.clear();
+    sumNanos = 0;
+    fleet.schedulerLag.accumulate(buckets, sumNanos);
+    appendHistogram(out, "patientbed_scheduler_lag_seconds", "Delay between a scheduler tick's due time and its start, in simulated time.", buckets, sumNanos);
+    buckets.clear();
+    sumNanos = 0;
+    fleet.connectTime.accumulate(buckets, sumNanos);
+    appendHistogram(out, "patientbed_connect_seconds", "Initial connect time, from starting the connect to CONNACK.", buckets, sumNanos);
+    buckets.clear();
+    sumNanos = 0;
+    fleet.influxWrite.accumulate(buckets, sumNanos);
+    appendHistogram(out, "patientbed_influx_write_seconds", "InfluxDB batch write time: compress, POST and response, including retries.", buckets, sumNanos);
+    buckets.clear();
+    sumNanos = 0;
+    fleet.commandRoundTrip.accumulate(buckets, sumNanos);
+    appendHistogram(out, "patientbed_command_round_trip_seconds", "Command round trip (--command-rate): sent on /cmd to its ack received on /cmd/ack.", buckets, sumNanos);
+
+    appendMetricHeader(out, "patientbed_loop_overruns_total", "counter", "Scheduler ticks started more than one tick late.");
+    appendMetricValue(out, "patientbed_loop_overruns_total", "", static_cast<double>(fleet.loopOverruns.value()));
+    appendMetricHeader(out, "patientbed_publish_retries_total", "counter", "MQTT v5 PUBACK failures queued for another attempt.");
+    appendMetricValue(out, "patientbed_publish_retries_total", "", static_cast<double>(fleet.publishRetries.value()));
+    appendMetricHeader(out, "patientbed_publish_failures_total", "counter", "MQTT v5 PUBACK failures dropped: permanent reason code or retries exhausted.");
+    appendMetricValue(out, "patientbed_publish_failures_total", "", static_cast<double>(fleet.publishFailures.value()));
+    appendMetricHeader(out, "patientbed_influx_lines_written_total", "counter", "Lines accepted by InfluxDB.");
+    appendMetricValue(out, "patientbed_influx_lines_written_total", "", static_cast<double>(fleet.influxLinesWritten.value()));
+    appendMetricHeader(out, "patientbed_influx_lines_dropped_total", "counter", "Lines rejected by InfluxDB, not delivered, or dropped from a full queue.");
+    appendMetricValue(out, "patientbed_influx_lines_dropped_total", "", static_cast<double>(fleet.influxLinesDropped.value()));
+    appendMetricHeader(out, "patientbed_connects_total", "counter", "Successful connections, including automatic reconnects.");
+    appendMetricValue(out, "patientbed_connects_total", "", static_cast<double>(fleet.connects.value()));
+    appendMetricHeader(out, "patientbed_connections_lost_total", "counter", "Connections lost.");
+    appendMetricValue(out, "patientbed_connections_lost_total", "", static_cast<double>(fleet.connectionsLost.value()));
+
+    long inFlight = 0;
+    int maxInFlight = 0;
+    for (MqttConnection* connection : connections) {
+        int depth = connection->window.inFlight();
+        inFlight += depth;
+        maxInFlight = std::max(maxInFlight, depth);
+    }
+    appendMetricHeader(out, "patientbed_inflight_messages", "gauge", "QoS1 messages awaiting PUBACK across all connections.");
+    appendMetricValue(out, "patientbed_inflight_messages", "", static_cast<double>(inFlight));
+    appendMetricHeader(out, "patientbed_inflight_messages_max", "gauge", "Deepest per-connection in-flight window.");
+    appendMetricValue(out, "patientbed_inflight_messages_max", "", static_cast<double>(maxInFlight));
+    return out;
+}
+
+/**
+ * @brief Minimal HTTP server answering GET /metrics with the Prometheus text format.
+ * The body is rendered on the server thread at scrape time, so the hot path never formats metrics.
+ */
+class MetricsServer {
+    int listenFd_ = -1;
+    std::thread thread_;
+    std::atomic<bool> stopping_{false};
+    std::function<std::string()> render_;
+
+    void serve() {
+        while (!stopping_.load()) {
+            int fd = accept(listenFd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return; // Listening socket shut down
+            }
+            timeval timeout{1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            std::string request;
+            char chunk[1024];
+            while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) break;
+                request.append(chunk, static_cast<size_t>(n));
+            }
+            bool found = request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0;
+            std::string body = found ? render_() : "Not found\n";
+            std::string response = std::string(found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n") +
+                                   "Content-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) +
+                                   "\r\nConnection: close\r\n\r\n" + body;
+            for (size_t sent = 0; sent < response.size();) {
+                ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                sent += static_cast<size_t>(n);
+            }
+            close(fd);
+        }
+    }
+
+public:
+    MetricsServer() = default;
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+    ~MetricsServer() { stop(); }
+
+    /**
+     * @brief Listen on all interfaces and serve scrapes from a background thread.
+     * @param port TCP port.
+     * @param render Produces the exposition body.
+     * @return true if the socket is listening.
+     */
+    bool start(int port, std::function<std::string()> render) {
+        render_ = std::move(render);
+        listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (listenFd_ < 0 || bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFd_, 16) != 0) {
+            LogLine(LogLevel::ERROR) << "Cannot listen for metrics on port " << port << ": " << std::strerror(errno);
+            stop();
+            return false;
+        }
+        thread_ = std::thread([this] { serve(); });
+        LogLine(LogLevel::INFO) << "Serving Prometheus metrics on http://0.0.0.0:" << port << "/metrics";
+        return true;
+    }
+
+    void stop() {
+        stopping_.store(true);
+        if (listenFd_ >= 0) shutdown(listenFd_, SHUT_RDWR); // Wakes accept()
+        if (thread_.joinable()) thread_.join();
+        if (listenFd_ >= 0) {
+            close(listenFd_);
+            listenFd_ = -1;
+        }
+    }
+};
+
+/**
+ * @brief Parse the "timestamp" field of a JSON telemetry payload without a full JSON parse.
+ * Accepts both TimestampStyle formats ("...T08:00:05+0530" and "...T08:00:05.123+05:30") and "Z".
+ * @param payload JSON payload.
+ * @param time Parsed time on success.
+ * @return true if a timestamp was found and parsed.
+ */
+bool parsePayloadTimestamp(std::string_view payload, std::chrono::system_clock::time_point& time) {
+    size_t key = payload.find("\"timestamp\"");
+    if (key == std::string_view::npos) return false;
+    size_t open = payload.find('"', payload.find(':', key));
+    size_t close = open == std::string_view::npos ? open : payload.find('"', open + 1);
+    if (close == std::string_view::npos) return false;
+    std::string text(payload.substr(open + 1, close - open - 1));
+
+    std::tm tm_utc{};
+    const char* rest = strptime(text.c_str(), "%Y-%m-%dT%H:%M:%S", &tm_utc);
+    if (rest == nullptr) return false;
+    int millis = 0;
+    if (*rest == '.') {
+        char* end = nullptr;
+        long fraction = std::strtol(rest + 1, &end, 10);
+        for (long digits = end - (rest + 1); digits < 3; ++digits) fraction *= 10;
+        for (long digits = end - (rest + 1); digits > 3; --digits) fraction /= 10;
+        millis = static_cast<int>(fraction);
+        rest = end;
+    }
+    long offsetSeconds = 0;
+    if (*rest == '+' || *rest == '-') {
+        int hours = 0;
+        int minutes = 0;
+        if (std::sscanf(rest + 1, "%2d:%2d", &hours, &minutes) != 2 && std::sscanf(rest + 1, "%2d%2d", &hours, &minutes) != 2) return false;
+        offsetSeconds = (hours * 60L + minutes) * 60L * (*rest == '-' ? -1 : 1);
+    } else if (*rest != 'Z') {
+        return false;
+    }
+    time = std::chrono::system_clock::from_time_t(timegm(&tm_utc) - offsetSeconds) + std::chrono::milliseconds(millis);
+    return true;
+}
+
+/**
+ * @brief HDR-style latency histogram in microseconds: 2^LOAD_TEST_HISTOGRAM_SUB_BUCKET_BITS linear
+ * sub-buckets per power of two, so every recorded value keeps under 1% relative error.
+ * Safe to record from any thread (Paho callbacks); read once recording has stopped.
+ */
+class HdrHistogram {
+    static constexpr int SUB_BUCKET_BITS = LOAD_TEST_HISTOGRAM_SUB_BUCKET_BITS;
+    static constexpr uint64_t SUB_BUCKETS = 1ull << SUB_BUCKET_BITS;
+    static constexpr uint64_t HALF_SUB_BUCKETS = SUB_BUCKETS / 2;
+
+    std::vector<std::atomic<uint64_t>> counts_;
+    std::atomic<uint64_t> total_{0};
+    std::atomic<uint64_t> max_{0};
+
+    static size_t indexOf(uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+        int shift = (63 - __builtin_clzll(value)) - SUB_BUCKET_BITS + 1; // value >> shift lies in [S/2, S)
+        return static_cast<size_t>(SUB_BUCKETS + (shift - 1) * HALF_SUB_BUCKETS + ((value >> shift) - HALF_SUB_BUCKETS));
+    }
+
+    static uint64_t highestEquivalentValue(size_t index) {
+        if (index < SUB_BUCKETS) return index;
+        uint64_t shift = (index - SUB_BUCKETS) / HALF_SUB_BUCKETS + 1;
+        uint64_t mantissa = (index - SUB_BUCKETS) % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+public:
+    HdrHistogram() : counts_(SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * HALF_SUB_BUCKETS) {}
+
+    void record(uint64_t micros) {
+        counts_[indexOf(micros)].fetch_add(1, std::memory_order_relaxed);
+        total_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t seen = max_.load(std::memory_order_relaxed);
+        while (micros > seen && !max_.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const { return total_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Value at a quantile, reported as the top of its bucket as HdrHistogram does.
+     * @param quantile In [0, 1].
+     */
+    uint64_t percentile(double quantile) const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= target) return std::min(highestEquivalentValue(i), max());
+        }
+        return max();
+    }
+};
+
+/**
+ * @brief Microseconds as milliseconds, for log lines.
+ */
+std::string formatMillis(uint64_t micros) {
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(micros < 10000 ? 2 : 1) << micros / 1000.0 << " ms";
+    return text.str();
+}
+
+/**
+ * @brief p50, p99, p99.9 and max of a histogram, for log lines.
+ */
+std::string formatPercentiles(const HdrHistogram& histogram) {
+    return "p50=" + formatMillis(histogram.percentile(0.50)) + " p99=" + formatMillis(histogram.percentile(0.99)) +
+           " p999=" + formatMillis(histogram.percentile(0.999)) + " max=" + formatMillis(histogram.max());
+}
+
+/**
+ * @brief Companion command load driver (--command-rate): sends incline commands to the fleet's own
+ * beds over their own connections and measures each command's round trip from its "sentAt"
+ * (epoch microseconds) to the ack that echoes it. Percentiles are logged every
+ * PUBLISH_RATE_REPORT_SECONDS and when the run ends.
+ */
+class CommandDriver {
+    const SimulatorOptions& options_;
+    std::vector<PatientBed*> beds_;
+    HdrHistogram roundTrip_;
+    std::atomic<uint64_t> sent_{0};
+    std::atomic<uint64_t> acked_{0};
+    std::atomic<uint64_t> rejected_{0};
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+
+    void send() {
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / options_.commandRate));
+        auto start = std::chrono::steady_clock::now();
+        auto nextReport = start + std::chrono::seconds(PUBLISH_RATE_REPORT_SECONDS);
+        for (uint64_t k = 0; !stopping_; ++k) {
+            auto scheduled = start + interval * static_cast<int64_t>(k);
+            std::this_thread::sleep_until(scheduled);
+            if (scheduled >= nextReport) {
+                logSummary("Command round trip");
+                nextReport += std::chrono::seconds(PUBLISH_RATE_REPORT_SECONDS);
+            }
+            PatientBed& bed = *beds_[k % beds_.size()];
+            // Every bed alternates between inclined and FLAT on successive rounds
+            bool incline = (k / beds_.size()) % 2 == 0;
+            json request{{"id", k},
+                         {"command", "incline"},
+                         {"inclination", incline ? DRIVER_COMMAND_INCLINATION_DEGREES : 0.0},
+                         {"sentAt", std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()}};
+            std::string payload = request.dump();
+            mqtt::message_ptr pubmsg = mqtt::make_message(bed.commandTopic, payload.data(), payload.size(), QOS, false);
+            if (bed.connection.window.enabled() && !bed.connection.window.acquire(pubmsg.get(), std::chrono::milliseconds(TIMEOUT))) continue;
+            try {
+                bed.connection.client->publish(pubmsg);
+                sent_.fetch_add(1, std::memory_order_relaxed);
+            } catch (const mqtt::exception& exc) {
+                bed.connection.window.release(pubmsg.get(), false);
+                static LogThrottle throttle;
+                LogLine(LogLevel::ERROR, throttle) << "Error sending command to " << bed.clientId << ": " << exc.what();
+            }
+        }
+    }
+
+public:
+    /**
+     * @brief Construct a driver; it sends nothing until start().
+     * @param options Options with a command rate.
+     * @param beds Connected beds, in the order they receive commands.
+     */
+    CommandDriver(const SimulatorOptions& options, std::vector<PatientBed*> beds) : options_(options), beds_(std::move(beds)) {}
+
+    ~CommandDriver() { stop(); }
+
+    void start() {
+        if (beds_.empty()) return;
+        LogLine(LogLevel::INFO) << "Sending " << options_.commandRate << " commands/s round-robin to " << beds_.size() << " beds";
+        thread_ = std::thread([this] { send(); });
+    }
+
+    /**
+     * @brief Record the round trip of an ack received on a /cmd/ack topic. Called from Paho threads.
+     */
+    void onAck(const mqtt::const_message_ptr& msg) {
+        json ack;
+        if (!decodeDocument(msg->get_payload_str(), options_.encoding, ack) || !ack.is_object() || !ack.contains("sentAt") || !ack["sentAt"].is_number_integer()) return;
+        auto sentAt = std::chrono::system_clock::time_point(std::chrono::microseconds(ack["sentAt"].get<int64_t>()));
+        auto latency = std::chrono::system_clock::now() - sentAt;
+        roundTrip_.record(static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(latency).count())));
+        fleetMetrics().commandRoundTrip.observeShared(latency);
+        acked_.fetch_add(1, std::memory_order_relaxed);
+        if (ack.value("status", "") != "ok") rejected_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Stop sending, give outstanding acks up to TIMEOUT to arrive, and log the final percentiles.
+     */
+    void stop() {
+        if (!thread_.joinable()) return;
+        stopping_ = true;
+        thread_.join();
+        auto drainDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TIMEOUT);
+        while (acked_ < sent_ && std::chrono::steady_clock::now() < drainDeadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOAD_TEST_DRAIN_POLL_MS));
+        }
+        logSummary("Command round trip result");
+    }
+
+    void logSummary(const char* label) const {
+        LogLine(LogLevel::INFO) << label << ": " << acked_.load() << " acked of " << sent_.load() << " sent ("
+                                << rejected_.load() << " rejected); send->ack " << formatPercentiles(roundTrip_);
+    }
+};
+
+/**
+ * @brief Routes messages arriving on the fleet's connections: commands to the worker that owns the
+ * bed, acks to the CommandDriver. Devices subscribe to their own PatientBed/<n>/cmd; a gateway
+ * subscribes to GATEWAY_COMMAND_TOPIC once and ignores beds that are not on it.
+ */
+class CommandRouter {
+    struct Target {
+        BedWorker* worker;
+        uint32_t fleetIndex;
+        const MqttConnection* connection;
+    };
+    std::unordered_map<std::string, Target> targets_; // Command topic -> bed; read-only once subscribed
+    std::unordered_map<MqttConnection*, std::vector<std::string>> topics_;
+    CommandDriver* driver_;
+
+    void onMessage(const MqttConnection& connection, const mqtt::const_message_ptr& msg) {
+        const std::string& topic = msg->get_topic();
+        bool isAck = topic.size() > 4 && topic.compare(topic.size() - 4, 4, "/ack") == 0;
+        auto found = targets_.find(isAck ? topic.substr(0, topic.size() - 4) : topic);
+        if (found == targets_.end() || found->second.connection != &connection) return; // Another gateway's bed
+        if (isAck) {
+            if (driver_ != nullptr) driver_->onAck(msg);
+            return;
+        }
+        json request;
+        if (!decodeDocument(msg->get_payload_str(), PayloadEncoding::JSON, request)) request = nullptr;
+        found->second.worker->postCommand(found->second.fleetIndex, std::move(request));
+    }
+
+public:
+    /**
+     * @brief Construct a router.
+     * @param driver Command driver whose acks to measure, or nullptr.
+     */
+    explicit CommandRouter(CommandDriver* driver) : driver_(driver) {}
+
+    /**
+     * @brief Route a bed's commands to its worker.
+     * @param bed Connected bed.
+     * @param worker Worker the bed was added to.
+     * @param fleetIndex Bed's index in the fleet.
+     */
+    void addBed(PatientBed* bed, BedWorker* worker, uint32_t fleetIndex) {
+        targets_.emplace(bed->commandTopic, Target{worker, fleetIndex, &bed->connection});
+        std::vector<std::string>& topics = topics_[&bed->connection];
+        if (!bed->connection.gateway) {
+            topics.push_back(bed->commandTopic);
+            if (driver_ != nullptr) topics.push_back(bed->ackTopic);
+        } else if (topics.empty()) {
+            topics.push_back(GATEWAY_COMMAND_TOPIC);
+            if (driver_ != nullptr) topics.push_back(std::string(GATEWAY_COMMAND_TOPIC) + "/ack");
+        }
+    }
+
+    /**
+     * @brief Install the message handler on every connection with beds and subscribe to their topics.
+     * @return true if every subscription was acknowledged.
+     */
+    bool subscribe() {
+        bool ok = true;
+        for (auto& entry : topics_) {
+            MqttConnection* connection = entry.first;
+            connection->setMessageHandler([this, connection](const mqtt::const_message_ptr& msg) { onMessage(*connection, msg); });
+            ok = connection->subscribe(entry.second, QOS) && ok;
+        }
+        LogLine(LogLevel::INFO) << "Listening for commands on " << targets_.size() << " beds over " << topics_.size() << " connections";
+        return ok;
+    }
+};
+
+/**
+ * @brief Steps through a ramp of bed counts and rates against the broker and reports latency percentiles.
+ *
+ * Senders publish on a fixed schedule. Each message's latency is measured from the time it was
+ * scheduled to be sent, not from when the sender got round to it, so stalls in the client or a full
+ * window count against the broker instead of being hidden (coordinated-omission correction).
+ */
+class LoadTester : public mqtt::iaction_listener {
+    const SimulatorOptions& options_;
+    std::vector<PatientBed*> beds_;
+    int senderThreads_;
+    std::chrono::steady_clock::time_point steadyEpoch_;
+    std::chrono::system_clock::time_point wallEpoch_;
+
+    /**
+     * @brief One step's results. Every step's are allocated up front and live as long as the tester,
+     * so a callback for a step that has just ended never touches freed or reassigned state.
+     */
+    struct StepResults {
+        HdrHistogram ackLatency;
+        HdrHistogram deliveryLatency;
+        std::atomic<uint64_t> published{0};
+        std::atomic<uint64_t> acked{0};
+        std::atomic<uint64_t> failed{0};
+    };
+
+    std::atomic<uint32_t> step_{0}; // Step being run, from 1; 0 = between steps, callbacks are not counted
+    std::vector<std::unique_ptr<StepResults>> results_; // Indexed by step - 1
+    std::unordered_map<std::string, PatientBed*> bedsByTopic_; // For releasing a failed publish's window slot
+
+    /**
+     * @brief Results of the step a callback belongs to, or nullptr if that step has already been reported.
+     */
+    StepResults* resultsFor(uint32_t step) {
+        if (step == 0 || step != step_.load(std::memory_order_relaxed)) return nullptr;
+        return results_[step - 1].get();
+    }
+
+    /**
+     * @brief Pack the step number and scheduled send time into Paho's per-publish user context.
+     */
+    void* packContext(uint32_t step, std::chrono::steady_clock::time_point scheduled) const {
+        uint64_t micros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(scheduled - steadyEpoch_).count());
+        return reinterpret_cast<void*>(static_cast<uintptr_t>((static_cast<uint64_t>(step) << 48) | (micros & 0xFFFFFFFFFFFFull)));
+    }
+
+    void on_success(const mqtt::token& tok) override {
+        uint64_t context = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(tok.get_user_context()));
+        StepResults* results = resultsFor(static_cast<uint32_t>(context >> 48));
+        if (results == nullptr) return; // Ack for an earlier step
+        auto scheduled = steadyEpoch_ + std::chrono::microseconds(context & 0xFFFFFFFFFFFFull);
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - scheduled);
+        results->ackLatency.record(static_cast<uint64_t>(std::max<int64_t>(0, latency.count())));
+        results->acked.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void on_failure(const mqtt::token& tok) override {
+        // delivery_complete only runs for delivered messages: a failed one returns its slot here, whatever its step
+        const auto* delivery = dynamic_cast<const mqtt::delivery_token*>(&tok);
+        if (mqtt::const_message_ptr msg = delivery ? delivery->get_message() : nullptr) {
+            auto bed = bedsByTopic_.find(msg->get_topic());
+            if (bed != bedsByTopic_.end()) bed->second->connection.window.release(msg.get(), false);
+        }
+        uint64_t context = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(tok.get_user_context()));
+        if (StepResults* results = resultsFor(static_cast<uint32_t>(context >> 48))) {
+            results->failed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Record publish-to-delivery latency for a message received back on a bed's own topic.
+     */
+    void onLoopback(const mqtt::const_message_ptr& msg) {
+        std::chrono::system_clock::time_point sent;
+        if (!parsePayloadTimestamp(msg->get_payload_str(), sent)) return;
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - sent);
+        if (StepResults* results = resultsFor(step_.load(std::memory_order_relaxed))) {
+            results->deliveryLatency.record(static_cast<uint64_t>(std::max<int64_t>(0, latency.count())));
+        }
+    }
+
+    /**
+     * @brief Publish this thread's share of a step on schedule until stepEnd.
+     */
+    void sendStep(int thread, const LoadStep& step, uint32_t stepNumber,
+                  std::chrono::steady_clock::time_point stepStart, std::chrono::steady_clock::time_point stepEnd) {
+        std::vector<PatientBed*> mine;
+        for (int i = thread; i < step.beds; i += senderThreads_) mine.push_back(beds_[i]);
+        if (mine.empty()) return;
+
+        StepResults& results = *results_[stepNumber - 1];
+        TelemetryWriter writer;
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / (mine.size() * step.ratePerBed)));
+        for (uint64_t k = 0;; ++k) {
+            auto scheduled = stepStart + interval * static_cast<int64_t>(k);
+            if (scheduled >= stepEnd) break;
+            std::this_thread::sleep_until(scheduled); // Returns at once when behind: the backlog is sent immediately
+            PatientBed& bed = *mine[k % mine.size()];
+
+            uint32_t bits = hashCounter(static_cast<uint32_t>(k) ^ static_cast<uint32_t>(bed.instanceNumber) * 0x9E3779B9u);
+            TelemetrySample sample{bed.clientId, wallEpoch_ + std::chrono::duration_cast<std::chrono::system_clock::duration>(scheduled - steadyEpoch_),
+                                   55.0 + 30.0 * (bits >> 8) / 16777216.0, 95.0 + 4.5 * (bits & 0xFF) / 256.0, 0.0, BedInclinationState::FLAT};
+            std::string_view payload = writer.write(sample);
+            mqtt::message_ptr pubmsg = mqtt::make_message(bed.topicRef, payload.data(), payload.size(), QOS, false);
+            if (bed.connection.window.enabled() && !bed.connection.window.acquire(pubmsg.get(), std::chrono::milliseconds(TIMEOUT))) {
+                results.failed.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            try {
+                bed.connection.client->publish(pubmsg, packContext(stepNumber, scheduled), *this);
+                results.published.fetch_add(1, std::memory_order_relaxed);
+            } catch (const mqtt::exception&) {
+                bed.connection.window.release(pubmsg.get(), false);
+                results.failed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+public:
+    /**
+     * @brief Construct a load tester over connected beds.
+     * @param options Options with a non-empty ramp.
+     * @param beds Connected beds; the first step.beds of them publish in each step.
+     * @param senderThreads Publishing threads.
+     */
+    LoadTester(const SimulatorOptions& options, std::vector<PatientBed*> beds, int senderThreads)
+        : options_(options), beds_(std::move(beds)), senderThreads_(senderThreads),
+          steadyEpoch_(std::chrono::steady_clock::now()), wallEpoch_(std::chrono::system_clock::now()) {
+        for (size_t s = 0; s < options_.ramp.size(); ++s) results_.push_back(std::make_unique<StepResults>());
+        for (PatientBed* bed : beds_) bedsByTopic_.emplace(bed->topic, bed);
+    }
+
+    /**
+     * @brief Run every step of the ramp and log one summary line per step.
+     */
+    void run() {
+        if (options_.loopback) {
+            for (PatientBed* bed : beds_) {
+                bed->connection.setMessageHandler([this](const mqtt::const_message_ptr& msg) { onLoopback(msg); });
+                try {
+                    bed->connection.client->subscribe(bed->topic, QOS)->wait();
+                } catch (const mqtt::exception& exc) {
+                    LogLine(LogLevel::ERROR) << "Error subscribing " << bed->clientId << " to " << bed->topic << ": " << exc.what();
+                }
+            }
+        }
+
+        for (size_t s = 0; s < options_.ramp.size(); ++s) {
+            LoadStep step = options_.ramp[s];
+            step.beds = std::min<int>(step.beds, static_cast<int>(beds_.size()));
+            StepResults& results = *results_[s];
+            step_.store(static_cast<uint32_t>(s + 1));
+
+            LogLine(LogLevel::INFO) << "Load step " << (s + 1) << "/" << options_.ramp.size() << ": " << step.beds
+                      << " beds x " << step.ratePerBed << " msg/s for " << options_.stepDuration.count() << " s";
+            auto stepStart = std::chrono::steady_clock::now();
+            auto stepEnd = stepStart + options_.stepDuration;
+            std::vector<std::thread> senders;
+            for (int t = 0; t < senderThreads_; ++t) {
+                senders.emplace_back([this, t, step, s, stepStart, stepEnd] { sendStep(t, step, static_cast<uint32_t>(s + 1), stepStart, stepEnd); });
+            }
+            for (auto& sender : senders) sender.join();
+
+            // Let the step's outstanding acks arrive before reporting
+            auto drainDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TIMEOUT);
+            while (results.acked + results.failed < results.published && std::chrono::steady_clock::now() < drainDeadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(LOAD_TEST_DRAIN_POLL_MS));
+            }
+            step_.store(0); // Late acks are ignored from here on
+
+            double seconds = std::chrono::duration<double>(options_.stepDuration).count();
+            std::ostringstream summary;
+            summary.setf(std::ios::fixed);
+            summary << std::setprecision(1) << "Load step " << (s + 1) << " result: offered " << step.beds * step.ratePerBed
+                    << " msg/s, achieved " << results.acked.load() / seconds << " msg/s (" << results.published.load() << " published, "
+                    << results.acked.load() << " acked, " << results.failed.load() << " failed); publish->PUBACK " << formatPercentiles(results.ackLatency);
+            if (options_.loopback) {
+                summary << "; publish->delivery " << formatPercentiles(results.deliveryLatency) << " (" << results.deliveryLatency.count() << " received)";
+            }
+            LogLine(LogLevel::INFO) << summary.str();
+        }
+
+        if (options_.loopback) {
+            for (PatientBed* bed : beds_) {
+                try {
+                    bed->connection.client->unsubscribe(bed->topic)->wait();
+                } catch (const mqtt::exception&) {
+                    // Disconnecting next anyway
+                }
+                bed->connection.setMessageHandler(nullptr);
+            }
+        }
+    }
+};
+
+/**
+ * @brief Fleet TLS credentials, read once and handed to Paho from memory.
+ * Paho's ssl_options only take file paths, and each connect builds its own OpenSSL context
+ * from them, so parsed certificates cannot be shared across connections. Instead the CA is read
+ * once into a single sealed memfd that every connection's trust store points at, and each
+ * connection's certificate and key are loaded lazily (from its two files, or from --cert-bundle)
+ * into one sealed memfd at its first connect. Reconnects re-read memory, never the disk. Call from one thread.
+ */
+class CredentialStore {
+    std::string caPath_;
+    std::vector<int> fds_;
+    std::unordered_map<std::string, std::string> bundle_;    // Credential name -> certificate chain + key, with --cert-bundle
+    std::unordered_map<std::string, std::string> keyStores_; // Credential name -> memfd path
+    bool fromBundle_ = false;
+
+    static bool readFile(const std::string& path, std::string& contents) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    /**
+     * @brief Copy contents into a sealed memory file.
+     * @return std::string /proc/self/fd path, or empty if memfd_create is unavailable.
+     */
+    std::string memoryFile(const std::string& name, const std::string& contents) {
+        int fd = memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) return std::string();
+        size_t written = 0;
+        while (written < contents.size()) {
+            ssize_t n = ::write(fd, contents.data() + written, contents.size() - written);
+            if (n <= 0) {
+                ::close(fd);
+                return std::string();
+            }
+            written += static_cast<size_t>(n);
+        }
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+        fds_.push_back(fd);
+        return "/proc/self/fd/" + std::to_string(fd);
+    }
+
+public:
+    CredentialStore() = default;
+    CredentialStore(const CredentialStore&) = delete;
+    CredentialStore& operator=(const CredentialStore&) = delete;
+
+    ~CredentialStore() {
+        for (int fd : fds_) ::close(fd);
+    }
+
+    /**
+     * @brief Read the CA and, if given, split a bundle into per-connection sections.
+     * The bundle concatenates each device's (or gateway's) PEM certificate and private key after
+     * a "# device <n>" (or "# gateway <n>") line.
+     * @param bundlePath Bundle file, or empty to read certs/device_<n>.* (gateway_<n>.*) on demand.
+     * @return true on success.
+     */
+    bool open(const std::string& bundlePath) {
+        std::string ca;
+        if (!readFile(CA_CERT_PATH, ca) || ca.find("-----BEGIN CERTIFICATE-----") == std::string::npos) {
+            LogLine(LogLevel::ERROR) << "Cannot read CA certificate " << CA_CERT_PATH;
+            return false;
+        }
+        caPath_ = memoryFile("ca", ca);
+        if (caPath_.empty()) {
+            LogLine(LogLevel::ERROR) << "Cannot create in-memory credential files: " << std::strerror(errno);
+            return false;
+        }
+
+        // One credential fd per connection on top of its socket: lift the soft descriptor limit to the hard one
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+
+        if (bundlePath.empty()) return true;
+        std::ifstream in(bundlePath);
+        if (!in) {
+            LogLine(LogLevel::ERROR) << "Cannot open certificate bundle " << bundlePath;
+            return false;
+        }
+        fromBundle_ = true;
+        std::string line;
+        std::string* section = nullptr;
+        while (std::getline(in, line)) {
+            if (line.compare(0, CERT_BUNDLE_SECTION_PREFIX.size(), CERT_BUNDLE_SECTION_PREFIX) == 0) {
+                std::istringstream header(line.substr(CERT_BUNDLE_SECTION_PREFIX.size()));
+                std::string kind;
+                int number = 0;
+                bool valid = (header >> kind >> number) && number > 0 && (kind == "device" || kind == "gateway");
+                section = valid ? &bundle_[kind + " " + std::to_string(number)] : nullptr;
+                continue;
+            }
+            if (section != nullptr) {
+                *section += line;
+                *section += '\n';
+            }
+        }
+        LogLine(LogLevel::INFO) << "Loaded credentials for " << bundle_.size() << " client(s) from " << bundlePath;
+        return true;
+    }
+
+    /**
+     * @brief Trust store path shared by every connection.
+     */
+    const std::string& trustStore() const { return caPath_; }
+
+    /**
+     * @brief Path of a connection's certificate chain and private key, loading it on first use.
+     * @param connection Connection to make.
+     * @param keyStore Receives the key store path (also used as the private key path).
+     * @return true if the connection has credentials.
+     */
+    bool keyStore(const MqttConnection& connection, std::string& keyStore) {
+        auto cached = keyStores_.find(connection.credentialName);
+        if (cached != keyStores_.end()) {
+            keyStore = cached->second;
+            return true;
+        }
+        std::string pem;
+        if (fromBundle_) {
+            auto section = bundle_.find(connection.credentialName);
+            if (section == bundle_.end()) return false;
+            pem.swap(section->second);
+            bundle_.erase(section);
+        } else {
+            std::string key;
+            if (!readFile(connection.certPath, pem) || !readFile(connection.keyPath, key)) return false;
+            pem += '\n';
+            pem += key;
+        }
+        if (pem.find("-----BEGIN CERTIFICATE-----") == std::string::npos || pem.find("PRIVATE KEY-----") == std::string::npos) {
+            return false;
+        }
+        keyStore = memoryFile(connection.clientId, pem);
+        if (keyStore.empty()) return false;
+        keyStores_.emplace(connection.credentialName, keyStore);
+        return true;
+    }
+};
+
+/**
+ * @brief Token bucket: refills at rate tokens per second up to burst. Not thread-safe.
+ */
+class TokenBucket {
+    double rate_;
+    double burst_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_;
+
+    void refill(std::chrono::steady_clock::time_point now) {
+        if (now <= last_) return;
+        tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+        last_ = now;
+    }
+
+public:
+    /**
+     * @brief Construct a full bucket.
+     * @param rate Tokens per second.
+     * @param burst Capacity.
+     * @param now Current time.
+     */
+    TokenBucket(double rate, double burst, std::chrono::steady_clock::time_point now)
+        : rate_(rate), burst_(burst), tokens_(burst), last_(now) {}
+
+    /**
+     * @brief Take n tokens if available.
+     * @return true if taken.
+     */
+    bool tryTake(std::chrono::steady_clock::time_point now, double n = 1.0) {
+        refill(now);
+        if (tokens_ < n) return false;
+        tokens_ -= n;
+        return true;
+    }
+
+    /**
+     * @brief Earliest time at which n tokens will be available.
+     */
+    std::chrono::steady_clock::time_point nextAvailable(std::chrono::steady_clock::time_point now, double n = 1.0) {
+        refill(now);
+        if (tokens_ >= n) return now;
+        return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((n - tokens_) / rate_));
+    }
+};
+
+/**
+ * @brief Brings a fleet up: asynchronous connects, at most --connect-concurrency handshakes in
+ * flight, started no faster than --connect-rate per second so the broker's connect limits hold.
+ * Every connection copies one TLS configuration built for the fleet from the CredentialStore.
+ * Paho keeps each client's TLS session for its own automatic reconnects but offers no way to
+ * share a session between clients, so every first connect is a full mutual-TLS handshake.
+ */
+class ConnectionManager : public mqtt::iaction_listener {
+    CredentialStore& credentials_;
+    double rate_;
+    int concurrency_;
+    std::mutex mutex_;
+    std::condition_variable finished_;
+    std::vector<MqttConnection*> connections_;
+    std::vector<std::chrono::steady_clock::time_point> started_;
+    std::vector<double> handshakeSeconds_;
+    std::vector<uint8_t> connected_;
+    int outstanding_ = 0;
+    size_t completed_ = 0;
+
+    static size_t indexOf(const mqtt::token& tok) { return reinterpret_cast<uintptr_t>(tok.get_user_context()); }
+
+    void finish(size_t index, bool success) {
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - started_[index];
+        std::lock_guard<std::mutex> lock(mutex_);
+        connected_[index] = success ? 1 : 0;
+        if (success) {
+            handshakeSeconds_.push_back(std::chrono::duration<double>(elapsed).count());
+            fleetMetrics().connectTime.observeShared(elapsed);
+        }
+        --outstanding_;
+        ++completed_;
+        finished_.notify_one();
+    }
+
+    void on_success(const mqtt::token& tok) override {
+        size_t index = indexOf(tok);
+        connections_[index]->onConnected(tok);
+        finish(index, true);
+    }
+
+    void on_failure(const mqtt::token& tok) override {
+        size_t index = indexOf(tok);
+        static LogThrottle throttle;
+        LogLine(LogLevel::ERROR, throttle) << "Error connecting " << connections_[index]->clientId << ": return code " << tok.get_return_code();
+        finish(index, false);
+    }
+
+public:
+    /**
+     * @brief Construct a manager.
+     * @param credentials Opened fleet credentials.
+     * @param rate Connects started per second.
+     * @param concurrency Handshakes in flight at once.
+     */
+    ConnectionManager(CredentialStore& credentials, double rate, int concurrency)
+        : credentials_(credentials), rate_(rate), concurrency_(concurrency) {}
+
+    /**
+     * @brief Connect every client and wait until each has connected or failed.
+     * @param connections Bed or gateway connections, in order.
+     * @return std::vector<MqttConnection*> Connected clients, in order.
+     */
+    std::vector<MqttConnection*> connectAll(const std::vector<std::unique_ptr<MqttConnection>>& connections) {
+        mqtt::ssl_options fleetSsl;
+        fleetSsl.set_trust_store(credentials_.trustStore());
+        for (const auto& connection : connections) connections_.push_back(connection.get());
+        started_.resize(connections_.size());
+        connected_.assign(connections_.size(), 0);
+        handshakeSeconds_.reserve(connections_.size());
+
+        auto start = std::chrono::steady_clock::now();
+        auto nextProgress = start + std::chrono::seconds(CONNECT_PROGRESS_SECONDS);
+        TokenBucket bucket(rate_, std::max(1.0, std::min<double>(CONNECT_BURST, rate_)), start); // Below 1 connect/s a whole token must still fit
+        size_t next = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (completed_ < connections_.size()) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= nextProgress) {
+                LogLine(LogLevel::INFO) << "Connecting: " << completed_ << "/" << connections_.size() << " done, " << outstanding_ << " handshakes in flight";
+                nextProgress += std::chrono::seconds(CONNECT_PROGRESS_SECONDS);
+            }
+            bool canStart = next < connections_.size() && outstanding_ < concurrency_;
+            if (canStart && bucket.tryTake(now)) {
+                size_t index = next++;
+                ++outstanding_;
+                started_[index] = now;
+                lock.unlock(); // Paho may complete the connect on this thread
+                std::string keyStore;
+                if (!credentials_.keyStore(*connections_[index], keyStore)) {
+                    LogLine(LogLevel::ERROR) << "No valid certificate and private key for " << connections_[index]->clientId;
+                    finish(index, false);
+                    lock.lock();
+                    continue;
+                }
+                try {
+                    connections_[index]->client->connect(connections_[index]->connectOptions(fleetSsl, keyStore, keyStore),
+                                                  reinterpret_cast<void*>(static_cast<uintptr_t>(index)), *this);
+                } catch (const mqtt::exception& exc) {
+                    LogLine(LogLevel::ERROR) << "Error connecting " << connections_[index]->clientId << ": " << exc.what();
+                    finish(index, false);
+                }
+                lock.lock();
+                continue;
+            }
+            auto wakeAt = canStart ? bucket.nextAvailable(now) : nextProgress;
+            finished_.wait_until(lock, std::min(wakeAt, nextProgress));
+        }
+        double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::vector<MqttConnection*> connected;
+        for (size_t i = 0; i < connections_.size(); ++i) {
+            if (connected_[i]) connected.push_back(connections_[i]);
+        }
+        std::sort(handshakeSeconds_.begin(), handshakeSeconds_.end());
+        auto at = [this](double q) {
+            return handshakeSeconds_.empty() ? 0.0 : handshakeSeconds_[static_cast<size_t>(q * (handshakeSeconds_.size() - 1))] * 1000.0;
+        };
+        LogLine(LogLevel::INFO) << "Connected " << connected.size() << "/" << connections_.size() << " clients (limit " << rate_ << " connects/s, "
+                                << concurrency_ << " in flight) in " << std::fixed << std::setprecision(2) << totalSeconds << " s; connect p50 "
+                                << at(0.50) << " ms, p99 " << at(0.99) << " ms, max " << at(1.0) << " ms";
+        return connected;
+    }
+};
+
+/**
+ * @brief Disconnect every connected client.
+ */
+void disconnectAll(const std::vector<MqttConnection*>& connected) {
+    LogLine(LogLevel::INFO) << "Disconnecting...";
+    for (MqttConnection* connection : connected) {
+        connection->disconnect();
+    }
+    LogLine(LogLevel::INFO) << "Disconnected.";
+}
+
+// --- Distributed Load ---
+
+/**
+ * @brief Send every byte of data on a blocking socket.
+ * @return true if all of it was sent.
+ */
+bool sendAll(int fd, const std::string& data) {
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/**
+ * @brief Receive until buffer holds at least count bytes.
+ * @param buffer Bytes received but not yet consumed; keeps whatever arrives past count.
+ * @return false on EOF, timeout or error.
+ */
+bool receiveAtLeast(int fd, std::string& buffer, size_t count) {
+    char chunk[4096];
+    while (buffer.size() < count) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+    return true;
+}
+
+/**
+ * @brief Receive one '\n'-terminated line of the coordinator protocol.
+ * @param buffer Bytes received but not yet consumed.
+ * @param line Receives the line without its terminator.
+ * @return false on EOF, timeout, error or an over-long line.
+ */
+bool receiveLine(int fd, std::string& buffer, std::string& line) {
+    size_t end;
+    while ((end = buffer.find('\n')) == std::string::npos) {
+        if (buffer.size() > 1024 || !receiveAtLeast(fd, buffer, buffer.size() + 1)) return false;
+    }
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 1);
+    return true;
+}
+
+/**
+ * @brief Receive the body that follows a "<verb> <bytes>" line.
+ */
+bool receiveBody(int fd, std::string& buffer, size_t bytes, std::string& body) {
+    if (bytes > COORDINATOR_MAX_REPORT_BYTES || !receiveAtLeast(fd, buffer, bytes)) return false;
+    body = buffer.substr(0, bytes);
+    buffer.erase(0, bytes);
+    return true;
+}
+
+/**
+ * @brief Merge the Prometheus expositions of several agents into one.
+ * Identical series are summed; every agent renders the same families and bucket bounds, so the
+ * merged histograms are exact. Gauges named "*_max" keep the largest value instead.
+ */
+std::string mergeMetrics(const std::vector<std::string>& expositions) {
+    std::vector<std::string> order; // HELP/TYPE lines and series, in first-seen order
+    std::unordered_set<std::string> comments;
+    std::unordered_map<std::string, double> values;
+    for (const std::string& text : expositions) {
+        std::istringstream lines(text);
+        std::string line;
+        while (std::getline(lines, line)) {
+            if (line.empty()) continue;
+            if (line[0] == '#') {
+                if (comments.insert(line).second) order.push_back(line);
+                continue;
+            }
+            size_t space = line.rfind(' ');
+            if (space == std::string::npos) continue;
+            std::string series = line.substr(0, space);
+            double value = std::strtod(line.c_str() + space + 1, nullptr);
+            auto [entry, inserted] = values.emplace(series, value);
+            if (inserted) {
+                order.push_back(series);
+            } else if (series.size() > 4 && series.compare(series.size() - 4, 4, "_max") == 0) {
+                entry->second = std::max(entry->second, value);
+            } else {
+                entry->second += value;
+            }
+        }
+    }
+    std::string out;
+    for (const std::string& entry : order) {
+        if (entry[0] == '#') {
+            out += entry;
+            out += '\n';
+            continue;
+        }
+        size_t brace = entry.find('{');
+        appendMetricValue(out, entry.substr(0, brace).c_str(), brace == std::string::npos ? "" : entry.substr(brace), values[entry]);
+    }
+    return out;
+}
+
+/**
+ * @brief Sum every series of a metric family in an exposition.
+ */
+double metricTotal(const std::string& exposition, const std::string& name) {
+    double total = 0.0;
+    std::istringstream lines(exposition);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, name.size(), name) != 0 || line.size() <= name.size() || (line[name.size()] != '{' && line[name.size()] != ' ')) continue;
+        total += std::strtod(line.c_str() + line.rfind(' ') + 1, nullptr);
+    }
+    return total;
+}
+
+/**
+ * @brief p50, p99 and p99.9 of a histogram family, for log lines. Each is the upper bound of the
+ * bucket it falls in, so the values are accurate to the power-of-two bucket width.
+ */
+std::string formatBucketPercentiles(const std::string& exposition, const std::string& name) {
+    std::vector<std::pair<double, double>> buckets; // Upper bound in seconds (infinity for +Inf), cumulative count
+    std::string prefix = name + "_bucket{le=\"";
+    std::istringstream lines(exposition);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, prefix.size(), prefix) != 0) continue;
+        std::string bound = line.substr(prefix.size(), line.find('"', prefix.size()) - prefix.size());
+        buckets.emplace_back(bound == "+Inf" ? std::numeric_limits<double>::infinity() : std::strtod(bound.c_str(), nullptr),
+                             std::strtod(line.c_str() + line.rfind(' ') + 1, nullptr));
+    }
+    if (buckets.empty() || buckets.back().second <= 0.0) return "no samples";
+    std::string text;
+    const std::pair<double, const char*> quantiles[] = {{0.50, "p50"}, {0.99, "p99"}, {0.999, "p999"}};
+    for (const auto& [quantile, label] : quantiles) {
+        size_t i = 0;
+        while (i + 1 < buckets.size() && buckets[i].second < quantile * buckets.back().second) ++i;
+        bool overflow = std::isinf(buckets[i].first) && i > 0;
+        double bound = overflow ? buckets[i - 1].first : buckets[i].first;
+        text += std::string(text.empty() ? "" : " ") + label + (overflow ? ">" : "<=") + formatMillis(static_cast<uint64_t>(bound * 1e6 + 0.5));
+    }
+    return text + " (" + std::to_string(static_cast<uint64_t>(buckets.back().second)) + ")";
+}
+
+/**
+ * @brief Agent side of --agent: joins a coordinator, takes its bed range, seed and start epoch, and
+ * sends it a metrics snapshot every COORDINATOR_REPORT_SECONDS and a final one when the run ends.
+ * Otherwise the agent runs the same fleet as a single-node simulator.
+ *
+ * The protocol is one line per message over TCP: HELLO <host>, ASSIGN <first> <last> <seed>,
+ * READY <connected beds>, START <epoch ms>, then REPORT <bytes> / FINAL <bytes> followed by the
+ * Prometheus exposition.
+ */
+class CoordinatorLink {
+    int fd_ = -1;
+    std::string buffer_;   // Received but not yet consumed
+    std::mutex sendMutex_; // Snapshots come from the reporter thread, the final report from main
+    std::mutex stopMutex_;
+    std::condition_variable stopSignal_;
+    bool stopping_ = false;
+    std::thread reporter_;
+
+    bool sendReport(const char* verb, const std::string& metrics) {
+        std::lock_guard<std::mutex> lock(sendMutex_);
+        return sendAll(fd_, std::string(verb) + ' ' + std::to_string(metrics.size()) + '\n' + metrics);
+    }
+
+    void stopReports() {
+        {
+            std::lock_guard<std::mutex> lock(stopMutex_);
+            stopping_ = true;
+        }
+        stopSignal_.notify_all();
+        if (reporter_.joinable()) reporter_.join();
+    }
+
+public:
+    CoordinatorLink() = default;
+    CoordinatorLink(const CoordinatorLink&) = delete;
+    CoordinatorLink& operator=(const CoordinatorLink&) = delete;
+    ~CoordinatorLink() {
+        stopReports();
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    /**
+     * @brief Connect to the coordinator and take this agent's assignment.
+     * @param address Coordinator "host:port".
+     * @param options Receives the assigned bed range and seed.
+     * @return true once assigned.
+     */
+    bool join(const std::string& address, SimulatorOptions& options) {
+        size_t colon = address.rfind(':');
+        std::string host = address.substr(0, colon);
+        std::string port = address.substr(colon + 1);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) == 0) {
+            for (addrinfo* candidate = addresses; candidate != nullptr && fd_ < 0; candidate = candidate->ai_next) {
+                fd_ = socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+                if (fd_ >= 0 && ::connect(fd_, candidate->ai_addr, candidate->ai_addrlen) != 0) {
+                    ::close(fd_);
+                    fd_ = -1;
+                }
+            }
+            freeaddrinfo(addresses);
+        }
+        if (fd_ < 0) {
+            LogLine(LogLevel::ERROR) << "Cannot connect to coordinator " << address << ".";
+            return false;
+        }
+        int noDelay = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        char hostname[256] = {};
+        if (gethostname(hostname, sizeof(hostname) - 1) != 0) std::strcpy(hostname, "unknown");
+        std::string line;
+        int first = 0;
+        int last = 0;
+        unsigned long long seed = 0;
+        if (!sendAll(fd_, std::string("HELLO ") + hostname + '\n') || !receiveLine(fd_, buffer_, line) ||
+            std::sscanf(line.c_str(), "ASSIGN %d %d %llu", &first, &last, &seed) != 3 || first <= 0 || last < first ||
+            last - first >= MAX_FLEET_BEDS) {
+            LogLine(LogLevel::ERROR) << "Coordinator " << address << " did not assign any beds.";
+            return false;
+        }
+        options.firstBed = first;
+        options.lastBed = last;
+        options.seed = seed; // Every agent derives its beds' seeds from the fleet's seed
+        options.seedSet = true;
+        LogLine(LogLevel::INFO) << "Agent of coordinator " << address << ": beds " << first << "-" << last << ", seed " << seed;
+        return true;
+    }
+
+    /**
+     * @brief Tell the coordinator this agent is connected and wait for the fleet's start.
+     * @param connectedBeds Beds that will publish.
+     * @param epoch Receives the wall-clock time at which every agent starts its scheduler.
+     * @return true once the coordinator has started the fleet.
+     */
+    bool ready(size_t connectedBeds, std::chrono::system_clock::time_point& epoch) {
+        std::string line;
+        long long epochMillis = 0;
+        if (!sendAll(fd_, "READY " + std::to_string(connectedBeds) + '\n') || !receiveLine(fd_, buffer_, line) ||
+            std::sscanf(line.c_str(), "START %lld", &epochMillis) != 1) {
+            LogLine(LogLevel::ERROR) << "Coordinator did not start the fleet.";
+            return false;
+        }
+        epoch = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::milliseconds(epochMillis)));
+        auto lead = std::chrono::duration_cast<std::chrono::milliseconds>(epoch - std::chrono::system_clock::now()).count();
+        if (lead < 0) {
+            LogLine(LogLevel::WARN) << "Fleet start epoch passed " << -lead << " ms ago; check this host's clock synchronisation.";
+        } else {
+            LogLine(LogLevel::INFO) << "Fleet starts in " << lead << " ms";
+        }
+        return true;
+    }
+
+    /**
+     * @brief Send a snapshot every COORDINATOR_REPORT_SECONDS from a background thread.
+     * @param render Produces the Prometheus exposition.
+     */
+    void startReports(std::function<std::string()> render) {
+        reporter_ = std::thread([this, render = std::move(render)] {
+            std::unique_lock<std::mutex> lock(stopMutex_);
+            while (!stopSignal_.wait_for(lock, std::chrono::seconds(COORDINATOR_REPORT_SECONDS), [this] { return stopping_; })) {
+                lock.unlock();
+                bool sent = sendReport("REPORT", render());
+                lock.lock();
+                if (!sent) {
+                    LogLine(LogLevel::WARN) << "Lost the coordinator; the run continues without reports.";
+                    return;
+                }
+            }
+        });
+    }
+
+    /**
+     * @brief Stop the snapshots and send the final report.
+     * @param metrics Prometheus exposition after the workers have stopped.
+     */
+    void finish(const std::string& metrics) {
+        stopReports();
+        if (!sendReport("FINAL", metrics)) {
+            LogLine(LogLevel::WARN) << "Could not send the final report to the coordinator.";
+        }
+        shutdown(fd_, SHUT_WR);
+    }
+};
+
+/**
+ * @brief Coordinator of a multi-node run (--coordinator): splits --beds into contiguous ranges for
+ * --agents agent processes, starts them together on one wall-clock epoch so the fleet's phase
+ * spreading is the same as on a single host, and merges their metrics. Merged totals and latency
+ * percentiles are logged every PUBLISH_RATE_REPORT_SECONDS and at the end; --metrics-port serves
+ * the merged exposition while the agents run.
+ */
+class Coordinator {
+    struct Agent {
+        int fd = -1;
+        std::string host;
+        int firstBed = 0;
+        int lastBed = 0;
+        std::string buffer;       // Received but not yet consumed; reader thread only
+        size_t connectedBeds = 0;
+        bool ready = false;
+        bool finished = false;    // FINAL received
+        bool lost = false;        // Disconnected before FINAL; its last snapshot still counts
+        std::string metrics;      // Latest snapshot
+        std::thread reader;
+    };
+
+    const SimulatorOptions& options_;
+    std::vector<std::unique_ptr<Agent>> agents_;
+    std::mutex mutex_; // Guards agents_ and each agent's state and snapshot
+    std::condition_variable changed_;
+
+    void receive(Agent& agent) {
+        std::string line;
+        std::string body;
+        while (receiveLine(agent.fd, agent.buffer, line)) {
+            char verb[8] = {};
+            unsigned long long value = 0;
+            if (std::sscanf(line.c_str(), "%7s %llu", verb, &value) != 2) break;
+            std::string_view command(verb);
+            bool final = command == "FINAL";
+            if (command == "READY") {
+                std::lock_guard<std::mutex> lock(mutex_);
+                agent.ready = true;
+                agent.connectedBeds = static_cast<size_t>(value);
+            } else if ((command == "REPORT" || final) && receiveBody(agent.fd, agent.buffer, static_cast<size_t>(value), body)) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                agent.metrics = std::move(body);
+                agent.finished = final;
+            } else {
+                break;
+            }
+            changed_.notify_all();
+            if (final) return;
+        }
+        LogLine(LogLevel::WARN) << "Lost agent " << agent.host << " (beds " << agent.firstBed << "-" << agent.lastBed << ")";
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            agent.lost = true;
+        }
+        changed_.notify_all();
+    }
+
+    /**
+     * @brief Accept one agent and send it the next bed range.
+     * @return false if the connection was not an agent.
+     */
+    bool admit(int fd) {
+        auto agent = std::make_unique<Agent>();
+        agent->fd = fd;
+        timeval timeout{COORDINATOR_HANDSHAKE_TIMEOUT_SECONDS, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string line;
+        if (!receiveLine(fd, agent->buffer, line) || line.compare(0, 6, "HELLO ") != 0) {
+            LogLine(LogLevel::WARN) << "Ignoring a connection that is not an agent.";
+            return false;
+        }
+        timeval none{0, 0}; // Agents take as long as their MQTT connects need before READY
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        agent->host = line.substr(6);
+
+        // An even split in instance order: the first bedCount % agents agents take one extra bed
+        int index = static_cast<int>(agents_.size());
+        int bedCount = options_.lastBed - options_.firstBed + 1;
+        int share = bedCount / options_.agentCount;
+        int extra = bedCount % options_.agentCount;
+        agent->firstBed = options_.firstBed + index * share + std::min(index, extra);
+        agent->lastBed = agent->firstBed + share + (index < extra ? 1 : 0) - 1;
+        if (!sendAll(fd, "ASSIGN " + std::to_string(agent->firstBed) + ' ' + std::to_string(agent->lastBed) + ' ' + std::to_string(options_.seed) + '\n')) {
+            return false;
+        }
+        LogLine(LogLevel::INFO) << "Agent " << index + 1 << "/" << options_.agentCount << " (" << agent->host << "): beds "
+                                << agent->firstBed << "-" << agent->lastBed;
+        std::lock_guard<std::mutex> lock(mutex_);
+        agents_.push_back(std::move(agent));
+        Agent& admitted = *agents_.back();
+        admitted.reader = std::thread([this, &admitted] { receive(admitted); });
+        return true;
+    }
+
+    std::string mergeLocked() const {
+        std::vector<std::string> snapshots;
+        for (const auto& agent : agents_) {
+            if (!agent->metrics.empty()) snapshots.push_back(agent->metrics);
+        }
+        return mergeMetrics(snapshots);
+    }
+
+    static void logSummary(const char* label, const std::string& merged) {
+        LogLine(LogLevel::INFO) << label << ": " << static_cast<uint64_t>(metricTotal(merged, "patientbed_samples_published_total")) << " samples in "
+                                << static_cast<uint64_t>(metricTotal(merged, "patientbed_messages_published_total")) << " messages, "
+                                << static_cast<uint64_t>(metricTotal(merged, "patientbed_samples_dropped_total")) << " dropped, "
+                                << static_cast<uint64_t>(metricTotal(merged, "patientbed_connections_lost_total")) << " connections lost";
+        LogLine(LogLevel::INFO) << label << " publish->PUBACK " << formatBucketPercentiles(merged, "patientbed_publish_ack_seconds");
+        if (metricTotal(merged, "patientbed_command_round_trip_seconds_count") > 0.0) {
+            LogLine(LogLevel::INFO) << label << " command round trip " << formatBucketPercentiles(merged, "patientbed_command_round_trip_seconds");
+        }
+    }
+
+public:
+    /**
+     * @brief Construct a coordinator.
+     * @param options --beds, --agents, --coordinator port, and optionally --seed and --metrics-port.
+     */
+    explicit Coordinator(SimulatorOptions& options) : options_(options) {
+        if (!options.seedSet) {
+            // One seed for the whole fleet, so every agent's beds draw from the same sequences as a single host's
+            std::random_device rd;
+            options.seed = static_cast<uint64_t>(rd()) << 32 | rd();
+            options.seedSet = true;
+        }
+    }
+
+    ~Coordinator() {
+        for (const auto& agent : agents_) {
+            shutdown(agent->fd, SHUT_RDWR); // Wakes readers of agents still running
+            if (agent->reader.joinable()) agent->reader.join();
+            ::close(agent->fd);
+        }
+    }
+
+    /**
+     * @brief Merged exposition of every agent's latest snapshot.
+     */
+    std::string render() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return mergeLocked();
+    }
+
+    /**
+     * @brief Admit the agents, start them, and wait for their final reports.
+     * @return Process exit code.
+     */
+    int run() {
+        int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(static_cast<uint16_t>(options_.coordinatorPort));
+        if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFd, options_.agentCount) != 0) {
+            LogLine(LogLevel::ERROR) << "Cannot listen for agents on port " << options_.coordinatorPort << ": " << std::strerror(errno);
+            if (listenFd >= 0) ::close(listenFd);
+            return 1;
+        }
+        MetricsServer metricsServer;
+        if (options_.metricsPort > 0 && !metricsServer.start(options_.metricsPort, [this] { return render(); })) {
+            ::close(listenFd);
+            return 1;
+        }
+        LogLine(LogLevel::INFO) << "Coordinator: waiting for " << options_.agentCount << " agent(s) on port " << options_.coordinatorPort
+                                << " to run beds " << options_.firstBed << "-" << options_.lastBed << " (seed " << options_.seed << ")";
+        while (agents_.size() < static_cast<size_t>(options_.agentCount)) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                LogLine(LogLevel::ERROR) << "Cannot accept agents: " << std::strerror(errno);
+                ::close(listenFd);
+                return 1;
+            }
+            if (!admit(fd)) ::close(fd);
+        }
+        ::close(listenFd);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return std::all_of(agents_.begin(), agents_.end(), [](const auto& agent) { return agent->ready || agent->lost; }); });
+        auto epoch = std::chrono::system_clock::now() + std::chrono::milliseconds(COORDINATOR_START_LEAD_MS);
+        std::string start = "START " + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(epoch.time_since_epoch()).count()) + '\n';
+        int started = 0;
+        size_t connectedBeds = 0;
+        for (const auto& agent : agents_) {
+            if (agent->lost || !sendAll(agent->fd, start)) continue;
+            ++started;
+            connectedBeds += agent->connectedBeds;
+        }
+        if (started == 0) {
+            LogLine(LogLevel::ERROR) << "No agent is ready; nothing to run.";
+            return 1;
+        }
+        LogLine(LogLevel::INFO) << "Starting " << started << " agent(s) with " << connectedBeds << " connected beds in "
+                                << COORDINATOR_START_LEAD_MS << " ms";
+
+        auto done = [this] { return std::all_of(agents_.begin(), agents_.end(), [](const auto& agent) { return agent->finished || agent->lost; }); };
+        while (!changed_.wait_for(lock, std::chrono::seconds(PUBLISH_RATE_REPORT_SECONDS), done)) {
+            std::string merged = mergeLocked();
+            lock.unlock();
+            logSummary("Fleet so far", merged);
+            lock.lock();
+        }
+        std::string merged = mergeLocked();
+        size_t finished = static_cast<size_t>(std::count_if(agents_.begin(), agents_.end(), [](const auto& agent) { return agent->finished; }));
+        lock.unlock();
+        if (finished < agents_.size()) {
+            LogLine(LogLevel::WARN) << (agents_.size() - finished) << " agent(s) ended without a final report; their last snapshots are included.";
+        }
+        logSummary("Fleet total", merged);
+        return 0;
+    }
+};
+
+#ifndef PATIENTBED_NO_MAIN // Defined by patientbedbenchmark.cpp, which includes this file
+/**
+ * @brief Main function for Patient Bed Simulator.
+ * Connects one MQTT client per bed (or --gateways shared clients), simulates telemetry, and publishes data at intervals.
+ * A single instance number runs one bed; --beds runs a fleet on a fixed-size worker pool.
+ */
+int main(int argc, char* argv[]) {
+    SimulatorOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    TimestampFormatter::setStyle(options.timestampStyle);
+    AsyncLogger::instance().setLevel(options.logLevel);
+    if (options.coordinatorPort > 0) {
+        return Coordinator(options).run();
+    }
+    std::unique_ptr<CoordinatorLink> coordinator;
+    if (!options.coordinatorAddress.empty()) {
+        coordinator = std::make_unique<CoordinatorLink>();
+        if (!coordinator->join(options.coordinatorAddress, options)) {
+            return 1;
+        }
+    }
+    if (options.clockMode != SimClock::Mode::REAL && !coordinator) { // An agent's clock starts at the coordinator's epoch
+        SimClock::configure(options.clockMode, options.clockSpeed, options.startTimeSet ? options.startTime : std::chrono::system_clock::now());
+    }
+
+    MealPlan mealPlan;
+    if (!options.mealSchedulePath.empty()) {
+        if (!mealPlan.load(options.mealSchedulePath)) {
+            return 1;
+        }
+        LogLine(LogLevel::INFO) << "Loaded meal schedules for " << mealPlan.wardCount() << " ward(s) from " << options.mealSchedulePath;
+    }
+
+    TraceFile trace;
+    if (!options.tracePath.empty()) {
+        if (!trace.open(options.tracePath)) {
+            return 1;
+        }
+        if (options.firstBed == 0) {
+            // Without --beds, replay every bed in the trace
+            std::vector<int> instances;
+            for (uint32_t device = 0; device < trace.deviceCount(); ++device) instances.push_back(trace.instanceNumber(device));
+            auto [first, last] = std::minmax_element(instances.begin(), instances.end());
+            if (instances.empty() || *first <= 0 || *last - *first >= MAX_FLEET_BEDS) {
+                LogLine(LogLevel::ERROR) << "Trace " << options.tracePath << " has no replayable bed range; pass --beds.";
+                return 1;
+            }
+            options.firstBed = *first;
+            options.lastBed = *last;
+        }
+    }
+
+    int bedCount = options.lastBed - options.firstBed + 1;
+    int workerCount = options.workerThreads;
+    if (workerCount == 0) {
+        workerCount = std::max(1, std::min<int>(std::thread::hardware_concurrency(), DEFAULT_MAX_WORKER_THREADS));
+    }
+    workerCount = std::min(workerCount, bedCount);
+
+    // Gateway mode shards beds over the shared connections by instance number.
+    // Without the MQTT sink every bed shares one client that is never connected.
+    std::vector<std::unique_ptr<MqttConnection>> connections;
+    int gatewayCount = options.mqttSink ? std::min(options.gateways, bedCount) : 1;
+    for (int g = 1; g <= gatewayCount; ++g) {
+        connections.push_back(MqttConnection::forGateway(g, options.maxInflight, options.mqtt5));
+    }
+    std::vector<std::unique_ptr<PatientBed>> beds;
+    beds.reserve(bedCount);
+    for (int n = options.firstBed; n <= options.lastBed; ++n) {
+        if (gatewayCount == 0) {
+            connections.push_back(MqttConnection::forDevice(n, options.maxInflight, options.mqtt5));
+        }
+        MqttConnection& connection = gatewayCount > 0 ? *connections[static_cast<size_t>(n % gatewayCount)] : *connections.back();
+        beds.push_back(std::make_unique<PatientBed>(n, connection));
+    }
+    for (const auto& connection : connections) {
+        connection->publishLimit.configure(options.publishRate, options.publishRate * PUBLISH_BURST_SECONDS);
+    }
+
+    if (bedCount == 1) {
+        LogLine(LogLevel::INFO) << "Starting Patient Bed Simulator: " << beds.front()->clientId;
+        if (options.splitStreams) {
+            LogLine(LogLevel::INFO) << "Publishing to topics: " << beds.front()->vitalsTopic << " (QoS " << options.streamQos[static_cast<size_t>(TelemetryStream::VITALS)]
+                                    << ") and " << beds.front()->stateTopic << " (QoS " << options.streamQos[static_cast<size_t>(TelemetryStream::STATE)] << ")";
+        } else {
+            LogLine(LogLevel::INFO) << "Publishing to topic: " << beds.front()->topic;
+        }
+    } else {
+        LogLine(LogLevel::INFO) << "Starting Patient Bed Simulator fleet: " << beds.front()->clientId
+                  << " to " << beds.back()->clientId << " (" << bedCount << " beds, " << workerCount << " workers)";
+        if (options.splitStreams) {
+            LogLine(LogLevel::INFO) << "Publishing to topics: " << beds.front()->vitalsTopic << " to " << beds.back()->vitalsTopic << " (QoS "
+                                    << options.streamQos[static_cast<size_t>(TelemetryStream::VITALS)] << ") and " << beds.front()->stateTopic << " to "
+                                    << beds.back()->stateTopic << " (QoS " << options.streamQos[static_cast<size_t>(TelemetryStream::STATE)] << ")";
+        } else {
+            LogLine(LogLevel::INFO) << "Publishing to topics: " << beds.front()->topic << " to " << beds.back()->topic;
+        }
+        LogLine(LogLevel::INFO) << "Simulator state: " << sizeof(BedSimulator) << " bytes per bed (target " << BED_SIMULATOR_TARGET_BYTES << ")";
+    }
+    if (gatewayCount > 0 && options.mqttSink) {
+        LogLine(LogLevel::INFO) << "Gateway mode: " << bedCount << " beds over " << gatewayCount << " connections ("
+                                << connections.front()->clientId << " to " << connections.back()->clientId << ", bed n on gateway n % "
+                                << gatewayCount << " + 1)";
+    }
+
+    if (!options.aggregateWindows.empty()) {
+        std::string windows;
+        for (std::chrono::seconds window : options.aggregateWindows) {
+            windows += (windows.empty() ? "" : ", ") + std::to_string(window.count()) + " s";
+        }
+        LogLine(LogLevel::INFO) << "Edge aggregation: " << windows << " summaries on " << beds.front()->summaryTopic << " (QoS "
+                                << options.streamQos[static_cast<size_t>(TelemetryStream::SUMMARY)] << ")"
+                                << (options.aggregateOnly ? "; raw samples are not published" : "");
+    }
+    if (options.waveform) {
+        LogLine(LogLevel::INFO) << "Waveform frames: " << ECG_SAMPLE_RATE_HZ << " Hz ECG + " << PLETH_SAMPLE_RATE_HZ
+                  << " Hz pleth, " << (WAVEFORM_HEADER_BYTES + 2 * WaveformWriter::samplesPerFrame()) << " bytes every " << WAVEFORM_FRAME_SECONDS
+                  << " s on " << beds.front()->waveformTopic << " (" << static_cast<long>(bedCount) * WaveformWriter::samplesPerFrame() / WAVEFORM_FRAME_SECONDS
+                  << " samples/s planned)";
+    }
+    reportEncodingSizes(beds.front()->clientId, options.encoding);
+
+    std::vector<MqttConnection*> connected;
+    std::vector<PatientBed*> connectedBeds; // Beds that publish: all of them when only writing to InfluxDB
+    CredentialStore credentials;
+    if (options.mqttSink) {
+        LogLine(LogLevel::INFO) << "Connecting to MQTT broker at " << SERVER_ADDRESS << "...";
+        if (!credentials.open(options.certBundlePath)) {
+            return 1;
+        }
+        connected = ConnectionManager(credentials, options.connectRate, options.connectConcurrency).connectAll(connections);
+        std::unordered_set<const MqttConnection*> up(connected.begin(), connected.end());
+        for (const auto& bed : beds) {
+            if (up.count(&bed->connection) != 0) connectedBeds.push_back(bed.get());
+        }
+        if (connectedBeds.empty() || (bedCount == 1 && connectedBeds.size() != 1)) {
+            return 1;
+        }
+        if (connectedBeds.size() < beds.size()) {
+            LogLine(LogLevel::WARN) << (beds.size() - connectedBeds.size()) << " bed(s) failed to connect and will not publish.";
+        }
+    } else {
+        for (const auto& bed : beds) connectedBeds.push_back(bed.get());
+    }
+
+    if (!options.ramp.empty()) {
+        LoadTester(options, connectedBeds, workerCount).run();
+        disconnectAll(connected);
+        return 0;
+    }
+
+    std::unique_ptr<SpoolFile> spool;
+    if (!options.spoolPath.empty()) {
+        spool = std::make_unique<SpoolFile>();
+        if (!spool->open(options.spoolPath, options.firstBed, bedCount, static_cast<uint64_t>(options.spoolRecordsPerBed))) {
+            return 1;
+        }
+        spool->startCheckpoints(std::chrono::seconds(SPOOL_CHECKPOINT_SECONDS));
+    }
+
+    // A fixed --seed makes every bed reproducible, independent of the bed range and worker count
+    std::random_device rd;
+    uint64_t baseSeed = options.seedSet ? options.seed : (static_cast<uint64_t>(rd()) << 32 | rd());
+    if (connectedBeds.size() > 1 && options.tracePath.empty()) {
+        // Planned load over one sample period, before jitter
+        std::vector<uint32_t> plannedBins(static_cast<size_t>(DATA_SEND_INTERVAL_SECONDS * 1000 / PUBLISH_RATE_BIN_MS), 0);
+        for (PatientBed* bed : connectedBeds) {
+            int64_t phaseMs = options.phaseSpread ? samplePhaseTicks(bed->instanceNumber) * SCHEDULER_TICK_MS : 0;
+            ++plannedBins[static_cast<size_t>(phaseMs / PUBLISH_RATE_BIN_MS)];
+        }
+        logRateDistribution(options.phaseSpread ? "Planned publish rate with phase spreading" : "Planned publish rate without phase spreading",
+                            plannedBins, PUBLISH_RATE_BIN_MS);
+    }
+
+    fleetPublishLimit().configure(options.fleetPublishRate, options.fleetPublishRate * PUBLISH_BURST_SECONDS);
+    if (options.publishRate > 0.0 || options.fleetPublishRate > 0.0) {
+        auto limitText = [](double rate) { return rate > 0.0 ? std::to_string(static_cast<long>(rate)) + "/s" : std::string("unlimited"); };
+        LogLine(LogLevel::INFO) << "Publish rate limits: " << limitText(options.publishRate) << " per connection, "
+                                << limitText(options.fleetPublishRate) << " for the fleet; throttled samples are "
+                                << (options.throttlePolicy == ThrottlePolicy::DROP ? "dropped" : "coalesced");
+    }
+
+    std::unique_ptr<InfluxSink> influx;
+    if (options.influxSink) {
+        influx = std::make_unique<InfluxSink>();
+        if (!influx->open(options.influxUrl, options.influxOrg, options.influxBucket, options.influxToken,
+                          options.influxBatchLines, options.influxFlushInterval)) {
+            return 1;
+        }
+    }
+
+    std::unique_ptr<TraceRecorder> recorder;
+    if (!options.recordPath.empty()) {
+        recorder = std::make_unique<TraceRecorder>();
+        if (!recorder->open(options.recordPath)) {
+            return 1;
+        }
+    }
+
+    if (coordinator) {
+        // Every agent starts its scheduler at the same wall-clock instant, so bed phases line up across hosts
+        std::chrono::system_clock::time_point epoch;
+        if (!coordinator->ready(connectedBeds.size(), epoch)) {
+            disconnectAll(connected);
+            return 1;
+        }
+        std::this_thread::sleep_until(epoch);
+        if (options.clockMode != SimClock::Mode::REAL) {
+            SimClock::configure(options.clockMode, options.clockSpeed, options.startTimeSet ? options.startTime : epoch);
+        }
+    }
+
+    FleetScheduler scheduler(SimClock::steadyNow());
+    std::vector<std::unique_ptr<BedWorker>> workers;
+    for (int w = 0; w < workerCount; ++w) {
+        workers.push_back(std::make_unique<BedWorker>(baseSeed, options, spool.get(), influx.get(), recorder.get(),
+                                                      scheduler.inbox(), scheduler.timebase(), workerCount, mealPlan));
+        scheduler.addWorker(workers.back().get());
+    }
+    for (size_t i = 0; i < connectedBeds.size(); ++i) {
+        workers[i % workers.size()]->addBed(connectedBeds[i], static_cast<uint32_t>(i));
     }
 
+    std::unique_ptr<CommandDriver> commandDriver;
+    std::unique_ptr<CommandRouter> commandRouter;
+    if (options.commands) {
+        if (options.commandRate > 0.0) {
+            commandDriver = std::make_unique<CommandDriver>(options, connectedBeds);
+        }
+        commandRouter = std::make_unique<CommandRouter>(commandDriver.get());
+        for (size_t i = 0; i < connectedBeds.size(); ++i) {
+            commandRouter->addBed(connectedBeds[i], workers[i % workers.size()].get(), static_cast<uint32_t>(i));
+        }
+        if (!commandRouter->subscribe()) {
+            LogLine(LogLevel::WARN) << "Some command subscriptions failed; those beds will not receive commands.";
+        }
+    }
+
+    MetricsServer metricsServer;
+    if (options.metricsPort > 0 &&
+        !metricsServer.start(options.metricsPort, [&workers, &connected] { return renderMetrics(workers, connected); })) {
+        return 1;
+    }
+    if (coordinator) {
+        coordinator->startReports([&workers, &connected] { return renderMetrics(workers, connected); });
+    }
+
+    std::vector<std::thread> threads;
+    if (!options.tracePath.empty()) {
+        // Workers replay their own beds' records in parallel against one shared start time
+        std::atomic<uint64_t> replayed{0};
+        auto start = std::chrono::steady_clock::now();
+        for (auto& worker : workers) {
+            threads.emplace_back([&worker, &trace, &options, &replayed, start] { replayed += worker->replay(trace, options.traceSpeed, start); });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        LogLine(LogLevel::INFO) << "Replayed " << replayed.load() << " samples in " << std::fixed << std::setprecision(2) << seconds << " s ("
+                                << static_cast<uint64_t>(seconds > 0.0 ? replayed.load() / seconds : 0.0) << " samples/s)";
+    } else {
+        for (auto& worker : workers) {
+            threads.emplace_back([&worker] { worker->run(); });
+        }
+        if (commandDriver) commandDriver->start();
+        scheduler.run(options.duration);
+        if (commandDriver) commandDriver->stop(); // While the workers still ack
+        scheduler.stopWorkers();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    if (influx) influx->close(); // Writes the lines still queued
+    if (recorder) recorder->close();
+    if (coordinator) coordinator->finish(renderMetrics(workers, connected));
+    disconnectAll(connected);
     return 0;
-}
\ No newline at end of file
+}
+#endif // PATIENTBED_NO_MAIN